@@ -0,0 +1,178 @@
+#include "allocation.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+/*
+ * Counters of one thread. Every thread gets its own slot the first time it allocates, so counting is an uncontended
+ * atomic add (the atomics are only there so that print() can read the counters of other threads).
+ */
+struct thread_allocations {
+	std::atomic<uint64_t> allocations[allocation_tracker::phase_count];
+	std::atomic<uint64_t> bytes[allocation_tracker::phase_count];
+};
+
+static constexpr int max_tracked_threads = 256;		// any further threads share the last slot
+static thread_allocations thread_slots[max_tracked_threads];
+static std::atomic<int> used_slots = 0;
+static std::atomic<bool> fail_in_pixels = false;
+
+// a plain integer, so that accessing it never allocates (which would recurse into operator new)
+static thread_local int thread_phase = allocation_tracker::other;
+
+allocation_tracker::scope::scope(int phase) : m_previous(thread_phase) {
+	thread_phase = phase;
+}
+
+allocation_tracker::scope::~scope() {
+	thread_phase = m_previous;
+}
+
+bool allocation_tracker::enabled() {
+#ifdef TRACK_ALLOCATIONS
+	return true;
+#else
+	return false;
+#endif
+}
+
+void allocation_tracker::fail_on_pixel_allocation(bool fail) {
+	fail_in_pixels = fail;
+}
+
+int allocation_tracker::current_phase() {
+	return thread_phase;
+}
+
+const char* allocation_tracker::phase_name(int phase) {
+	const char* names[] = { "other", "interface", "scene", "render setup", "pixels" };
+	return phase >= 0 && phase < phase_count ? names[phase] : "unknown";
+}
+
+uint64_t allocation_tracker::allocations(int phase) {
+	uint64_t total = 0;
+	int slots = std::min(used_slots.load(), max_tracked_threads);
+	for (int s = 0; s < slots; s++)
+		total += thread_slots[s].allocations[phase].load(std::memory_order_relaxed);
+	return total;
+}
+
+uint64_t allocation_tracker::bytes(int phase) {
+	uint64_t total = 0;
+	int slots = std::min(used_slots.load(), max_tracked_threads);
+	for (int s = 0; s < slots; s++)
+		total += thread_slots[s].bytes[phase].load(std::memory_order_relaxed);
+	return total;
+}
+
+void allocation_tracker::print(std::ostream& out) {
+	if (!enabled()) {
+		out << "Allocation tracking is not compiled in (configure with -DHELLOWORLD_TRACK_ALLOCATIONS=ON)\n";
+		return;
+	}
+	char line[160];
+	out << "Heap allocations per phase:\n";
+	for (int p = 0; p < phase_count; p++) {
+		std::snprintf(line, sizeof(line), "  %-14s %12llu allocations %14llu bytes\n", phase_name(p),
+			(unsigned long long)allocations(p), (unsigned long long)bytes(p));
+		out << line;
+	}
+	out << "Heap allocations per thread (in the order the threads first allocated):\n";
+	int slots = std::min(used_slots.load(), max_tracked_threads);
+	for (int s = 0; s < slots; s++) {
+		std::snprintf(line, sizeof(line), "  thread %3d", s);
+		out << line;
+		for (int p = 0; p < phase_count; p++) {
+			std::snprintf(line, sizeof(line), "  %s %llu", phase_name(p),
+				(unsigned long long)thread_slots[s].allocations[p].load(std::memory_order_relaxed));
+			out << line;
+		}
+		out << "\n";
+	}
+}
+
+#ifdef TRACK_ALLOCATIONS
+
+static thread_local int thread_slot = -1;
+
+static void CountAllocation(size_t size) {
+	if (thread_phase == allocation_tracker::pixels && fail_in_pixels) {
+		// the report must not allocate, so it is written with the C library directly
+		std::fprintf(stderr, "Heap allocation of %zu bytes in the per-pixel render path (run a debugger to find it)\n", size);
+		std::abort();
+	}
+	if (thread_slot < 0)
+		thread_slot = std::min(used_slots++, max_tracked_threads - 1);
+	thread_slots[thread_slot].allocations[thread_phase].fetch_add(1, std::memory_order_relaxed);
+	thread_slots[thread_slot].bytes[thread_phase].fetch_add(size, std::memory_order_relaxed);
+}
+
+static void* Allocate(size_t size) {
+	CountAllocation(size);
+	return std::malloc(size == 0 ? 1 : size);
+}
+
+static void* AllocateAligned(size_t size, std::align_val_t alignment) {
+	CountAllocation(size);
+	size_t align = static_cast<size_t>(alignment);
+#ifdef _MSC_VER
+	return _aligned_malloc(size == 0 ? 1 : size, align);
+#else
+	return std::aligned_alloc(align, (size + align - 1) / align * align);
+#endif
+}
+
+static void FreeAligned(void* p) {
+#ifdef _MSC_VER
+	_aligned_free(p);
+#else
+	std::free(p);
+#endif
+}
+
+void* operator new(size_t size) {
+	if (void* p = Allocate(size))
+		return p;
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+	if (void* p = Allocate(size))
+		return p;
+	throw std::bad_alloc();
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+	if (void* p = AllocateAligned(size, alignment))
+		return p;
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+	if (void* p = AllocateAligned(size, alignment))
+		return p;
+	throw std::bad_alloc();
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return Allocate(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return Allocate(size); }
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return AllocateAligned(size, alignment); }
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return AllocateAligned(size, alignment); }
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { FreeAligned(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { FreeAligned(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { FreeAligned(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { FreeAligned(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { FreeAligned(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { FreeAligned(p); }
+
+#endif
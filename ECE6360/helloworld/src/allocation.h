@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+
+/*
+ * Heap allocation counts per thread and per phase (built with the HELLOWORLD_TRACK_ALLOCATIONS CMake option). The
+ * per-pixel work of a render runs in the pixels phase, which must not allocate (see fail_on_pixel_allocation()).
+ */
+class allocation_tracker {
+public:
+    enum phase_type { other = 0, interface, scene, render_setup, pixels, phase_count };
+
+    /*
+     * Sets the phase of the calling thread for the lifetime of the object and restores the previous phase
+     * afterwards, so phases can be nested.
+     */
+    class scope {
+    public:
+        explicit scope(int phase);
+        ~scope();
+        scope(const scope&) = delete;
+        scope& operator=(const scope&) = delete;
+
+    private:
+        int m_previous;
+    };
+
+    // true if the counting operator new is compiled in
+    static bool enabled();
+
+    // abort when the pixels phase allocates (only has an effect when tracking is enabled)
+    static void fail_on_pixel_allocation(bool fail);
+
+    static int current_phase();
+    static const char* phase_name(int phase);
+
+    // totals over all threads
+    static uint64_t allocations(int phase);
+    static uint64_t bytes(int phase);
+
+    // write the counts per phase and per thread
+    static void print(std::ostream& out);
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "ray.h"
+#include "vec3.h"
+
+/*
+ * A pinhole camera that generates one ray per pixel. The viewport is a rectangle placed focal_length in front of
+ * the camera center. Its height is fixed, and its width follows the aspect ratio of the image, so the picture is
+ * never stretched when the image size changes. Call initialize() after changing any of the public parameters.
+ */
+class camera {
+public:
+    point3 center = point3(0, 0, 0);        // position of the camera
+    point3 look_at = point3(0, 0, -1);      // point the camera is aimed at
+    vec3 vup = vec3(0, 1, 0);               // "up" direction used to orient the camera
+    double focal_length = 1.0;              // distance from the camera center to the viewport
+    double viewport_height = 2.0;           // height of the viewport in world units
+    int image_width = 500;                  // size of the rendered image in pixels
+    int image_height = 500;
+
+    void initialize() {
+        double aspect = static_cast<double>(image_width) / static_cast<double>(image_height);
+        double viewport_width = viewport_height * aspect;
+
+        // orthonormal basis: w points backwards (away from the scene), u to the right, and v up
+        vec3 w = unit_vector(center - look_at);
+        vec3 u = unit_vector(cross(vup, w));
+        vec3 v = cross(w, u);
+
+        // horizontal and vertical axes (the vertical axis points down so that row 0 is the top of the image)
+        vec3 viewport_u = viewport_width * u;
+        vec3 viewport_v = viewport_height * -v;
+
+        // delta pixel size
+        m_pixel_delta_u = viewport_u / image_width;
+        m_pixel_delta_v = viewport_v / image_height;
+
+        // view port upper left corner and the center of pixel (0, 0)
+        point3 viewport_upper_left = center - focal_length * w - viewport_u / 2 - viewport_v / 2;
+        m_pixel00_loc = viewport_upper_left + 0.5 * (m_pixel_delta_u + m_pixel_delta_v);
+        m_w = w;
+    }
+
+    /*
+     * Pixel coordinates (x, y) where a point appears in the image, using the same convention as get_ray() (the
+     * center of pixel (xi, yi) is at (xi, yi)). Returns false for points that aren't in front of the camera.
+     */
+    bool project(const point3& p, double& x, double& y) const {
+        vec3 d = p - center;
+        double depth = -dot(d, m_w);
+        if (depth <= 0.0)
+            return false;
+        vec3 on_viewport = center + (focal_length / depth) * d - m_pixel00_loc;
+        x = dot(on_viewport, m_pixel_delta_u) / m_pixel_delta_u.length_squared();
+        y = dot(on_viewport, m_pixel_delta_v) / m_pixel_delta_v.length_squared();
+        return true;
+    }
+
+    // ray through the center of pixel (xi, yi)
+    ray get_ray(int xi, int yi) const {
+        point3 pixel_center = m_pixel00_loc + xi * m_pixel_delta_u + yi * m_pixel_delta_v;
+        return ray(center, pixel_center - center);
+    }
+
+    // ray through an offset (dx, dy) in [-0.5, 0.5) from the center of pixel (xi, yi), used to anti-alias
+    ray get_ray(int xi, int yi, double dx, double dy) const {
+        point3 pixel_sample = m_pixel00_loc + (xi + dx) * m_pixel_delta_u + (yi + dy) * m_pixel_delta_v;
+        return ray(center, pixel_sample - center);
+    }
+
+private:
+    point3 m_pixel00_loc;
+    vec3 m_pixel_delta_u;
+    vec3 m_pixel_delta_v;
+    vec3 m_w;
+};
@@ -1,69 +1,360 @@
 #include "helloworld.h"
+#include "renderer.h"
+#include "trace.h"
 
-// This variable stores the OpenGL ID for the texture used to display the output image on the screen
-GLuint output_image_tex = 0;
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <vector>
 
 /*
- * This function uploads the current image stored on the heap to the GPU so that it can be displayed on the screen. This
- * function is called every frame, so any updates to the heap image will be displayed when the frame updates. All of these
- * function calls are part of the OpenGL API.
+ * The output image is displayed as a grid of OpenGL textures ("tiles") instead of a single texture. Every graphics
+ * driver has a maximum texture size (often 16384 x 16384), so a single texture can't hold a very large render.
+ * Splitting the image also means that only the tiles that are visible in the zoomed/panned viewport have to be
+ * uploaded, and tiles that haven't been looked at recently can be removed from the GPU.
  */
-void UpdateOutputTexture() {
+struct texture_tile {
+    GLuint tex = 0;                     // OpenGL texture ID (0 if the tile isn't currently stored on the GPU)
+    int x = 0, y = 0;                   // position of the tile's upper left corner in the output image (in pixels)
+    int width = 0, height = 0;          // size of the tile in pixels (tiles on the right and bottom edges may be smaller)
+    std::vector<unsigned int> uploaded; // version of every block of the tile that is stored in the texture
+    int last_drawn = 0;                 // frame number the tile was last drawn (used to evict the oldest tiles)
+};
+
+std::vector<texture_tile> output_tiles;
+int output_tiles_x = 0;                 // number of tiles along each axis of the image
+int output_tiles_y = 0;
+int output_tile_size = 0;               // size of a full tile (limited by the driver's maximum texture size)
+int tiled_width = 0;                    // image size that the tile grid was built for
+int tiled_height = 0;
+int display_frame = 0;                  // counts calls to DrawOutputImage()
+
+// tiles are never larger than this, and at most max_resident_tiles of them are kept on the GPU
+const int max_output_tile_size = 2048;
+const int max_resident_tiles = 64;
+
+/*
+ * Changes are tracked in blocks of block_size x block_size pixels: every finished render tile raises the version of
+ * the blocks it overlaps to the image_version it was published with, and a texture tile only uploads the blocks that
+ * are newer than its copy. At most max_upload_pixels are uploaded per frame (the rest follow in the next frames), so
+ * a zoomed out view of a huge image doesn't stall the user interface while a render fills it in.
+ */
+const int block_size = 256;
+static_assert(max_output_tile_size % block_size == 0, "texture tiles must start on block boundaries");
+const size_t max_upload_pixels = size_t(4) << 20;
+std::unique_ptr<std::atomic<unsigned int>[]> output_blocks;
+int output_blocks_x = 0;
+int output_blocks_y = 0;
+
+// zoom factor (1 = the image fills the viewport) and pan offset (in screen coordinates) of the image viewer
+float view_zoom = 1.0f;
+ImVec2 view_offset = ImVec2(0.0f, 0.0f);
+
+// When the output image tracks the viewport size, a resize is only rendered once the viewport has stopped changing
+// for this long (dragging a window edge would otherwise re-render the image every frame)
+const float resize_debounce_seconds = 0.2f;
+
+// Number of tiles that are currently stored on the GPU (displayed in the user interface)
+int ResidentTileCount() {
+    return static_cast<int>(std::count_if(output_tiles.begin(), output_tiles.end(),
+        [](const texture_tile& t) { return t.tex != 0; }));
+}
+
+// Start tracking the blocks of a new output image (called while no render is running, since it frees the old blocks)
+void ResetOutputBlocks() {
+    output_blocks_x = (image_width + block_size - 1) / block_size;
+    output_blocks_y = (image_height + block_size - 1) / block_size;
+    output_blocks = std::make_unique<std::atomic<unsigned int>[]>((size_t)output_blocks_x * output_blocks_y);
+}
+
+// Raise the version of every block overlapping [x0, x1) x [y0, y1) to at least version (called by the render threads)
+void MarkOutputBlocks(int x0, int y0, int x1, int y1, unsigned int version) {
+    if (!output_blocks)
+        return;
+    int bx1 = std::min(output_blocks_x, (std::min(x1, image_width) + block_size - 1) / block_size);
+    int by1 = std::min(output_blocks_y, (std::min(y1, image_height) + block_size - 1) / block_size);
+    for (int by = std::max(y0, 0) / block_size; by < by1; by++) {
+        for (int bx = std::max(x0, 0) / block_size; bx < bx1; bx++) {
+            std::atomic<unsigned int>& block = output_blocks[(size_t)by * output_blocks_x + bx];
+            unsigned int current = block.load();
+            while (current < version && !block.compare_exchange_weak(current, version)) {}
+        }
+    }
+}
+
+/*
+ * Split the output image into a grid of tiles. This is called whenever the size of the output image changes, and
+ * deletes all of the textures from the previous grid. The textures themselves are created when a tile is first drawn.
+ */
+void BuildTileGrid() {
+
+    // ask the driver how large a texture can be (this is only done once)
+    if (output_tile_size == 0) {
+        GLint max_texture_size = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+        output_tile_size = std::min(static_cast<int>(max_texture_size), max_output_tile_size);
+    }
+
+    for (texture_tile& tile : output_tiles) {
+        if (tile.tex != 0)
+            glDeleteTextures(1, &tile.tex);
+    }
+    output_tiles.clear();
+
+    output_tiles_x = (image_width + output_tile_size - 1) / output_tile_size;
+    output_tiles_y = (image_height + output_tile_size - 1) / output_tile_size;
+    for (int ty = 0; ty < output_tiles_y; ty++) {
+        for (int tx = 0; tx < output_tiles_x; tx++) {
+            texture_tile tile;
+            tile.x = tx * output_tile_size;
+            tile.y = ty * output_tile_size;
+            tile.width = std::min(output_tile_size, image_width - tile.x);
+            tile.height = std::min(output_tile_size, image_height - tile.y);
+            tile.uploaded.assign((size_t)((tile.width + block_size - 1) / block_size) * ((tile.height + block_size - 1) / block_size), 0);
+            output_tiles.push_back(tile);
+        }
+    }
+    tiled_width = image_width;
+    tiled_height = image_height;
+}
+
+/*
+ * This function uploads the blocks of a tile that changed since they were last uploaded from the image stored on the
+ * heap to the GPU so that they can be displayed on the screen (a new texture gets all of them). The uploaded pixels are
+ * taken from the frame's budget, and it returns false if blocks are left for later frames. All of these function calls
+ * are part of the OpenGL API.
+ */
+bool UploadTile(texture_tile& tile, size_t& budget) {
+    // a new texture has to be filled completely (a single tile is allowed to go over the budget of an idle frame)
+    if (tile.tex == 0 && (size_t)tile.width * tile.height > budget && budget < max_upload_pixels)
+        return false;
+    timeline::zone zone("upload", (int64_t)tile.width * tile.height);
 
     /* OpenGL textures are given integer IDs starting at 1, so here we test to see if the ID is zero (in which case a
      * texture hasn't been created. If that's the case, this code generates a new texture ID.
      */
-    if (output_image_tex == 0)
-        glGenTextures(1, &output_image_tex);
+    bool created = false;
+    if (tile.tex == 0) {
+        glGenTextures(1, &tile.tex);
+        created = true;
+    }
 
     /* The OpenGL API is a "state machine", which means that you make global function calls to query and set parts of that
      * state. Since there can be multiple textures on the GPU, the first thing we have to do is tell OpenGL which texture
      * we want future OpenGL API calls to reference. The term for that is "binding" the texture. So here I'm just
      * setting the texture I just created as the "current" texture, so future calls will update that texture's state.
      */
-    glBindTexture(GL_TEXTURE_2D, output_image_tex);
-
-    /* These calls update the bound texture's state. All these are doing is telling OpenGL how to treat that texture.
-     * Specifically, the first two functions say what happens if we try to access regions "outside" of the texture
-     * These two functions just describe what value is returned if we access elements of the texture
-     * that are "between" pixels. For example, if I access pixel (3.5, 2.5). GL_NEAREST just says to set the returned
-     * value to the nearest pixel. This can make the image look "pixellated" if you zoom in really close, but I prefer
-     * it for scientific applications because it gives a better idea of what the data really looks like. In video games
-     * you'll usually use linear interpolation (GL_LINEAR).
-     */
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-    /* This function actually uploads the texture to the GPU. The parameters specify:
-     * 1) What texture target we are uploading (in this case the currently "bound" 2D texture)
-     * 2) The "mip-map" level of the image. I'm not using that feature so this is just 0
-     * 3) How the texture data will be stored on the GPU (in this case as a 4-channel RGBA image)
-     * 4/5) The size of the image in pixels
-     * 6) The size of the "border" around the image (there isn't one so this is 0)
-     * 7) The format of the pixel data that I'm sending to the GPU (also a 4-channel RGBA image)
-     * 8) The data type used to store the pixel data (we're using 8-but unsigned integers)
-     * 9) A pointer to the pixel data to upload to the GPU
+    glBindTexture(GL_TEXTURE_2D, tile.tex);
+
+    if (created) {
+        /* These calls update the bound texture's state. All these are doing is telling OpenGL how to treat that texture.
+         * These two functions just describe what value is returned if we access elements of the texture
+         * that are "between" pixels. For example, if I access pixel (3.5, 2.5). GL_NEAREST just says to set the returned
+         * value to the nearest pixel. This can make the image look "pixellated" if you zoom in really close, but I prefer
+         * it for scientific applications because it gives a better idea of what the data really looks like. In video games
+         * you'll usually use linear interpolation (GL_LINEAR).
+         */
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+        /* This function allocates the texture on the GPU. The parameters specify:
+         * 1) What texture target we are allocating (in this case the currently "bound" 2D texture)
+         * 2) The "mip-map" level of the image. I'm not using that feature so this is just 0
+         * 3) How the texture data will be stored on the GPU (in this case as a 4-channel RGBA image)
+         * 4/5) The size of the tile in pixels
+         * 6) The size of the "border" around the image (there isn't one so this is 0)
+         * 7) The format of the pixel data that I'm sending to the GPU (also a 4-channel RGBA image)
+         * 8) The data type used to store the pixel data (we're using 32-bit floating point values)
+         * 9) A pointer to the pixel data to upload to the GPU (nothing yet, the tile is filled in below)
+         */
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, tile.width, tile.height, 0, GL_RGBA, GL_FLOAT, nullptr);
+    }
+
+    /* Every block is a rectangle inside the much larger output image (the tiles start on block boundaries, since the
+     * tile size is a multiple of block_size), so the pixel store parameters tell OpenGL how
+     * long a full image row is and where the block starts. That way the pixels can be uploaded directly from the output
+     * image without copying them into a separate buffer first. The block's version is read before its pixels, so a
+     * render tile that finishes during the upload leaves the block newer than the texture and it is uploaded again.
      */
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, resolution, resolution, 0, GL_RGBA, GL_FLOAT, output_image_ptr);
+    int tile_blocks_x = (tile.width + block_size - 1) / block_size;
+    int first_bx = tile.x / block_size, first_by = tile.y / block_size;
+    bool complete = true;
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, image_width);
+    for (size_t b = 0; b < tile.uploaded.size(); b++) {
+        int bx = first_bx + (int)b % tile_blocks_x, by = first_by + (int)b / tile_blocks_x;
+        unsigned int version = output_blocks[(size_t)by * output_blocks_x + bx].load();
+        if (!created && version == tile.uploaded[b])
+            continue;
+        if (!created && budget == 0) {
+            complete = false;
+            break;
+        }
+        int x0 = bx * block_size, y0 = by * block_size;
+        int width = std::min(block_size, tile.x + tile.width - x0), height = std::min(block_size, tile.y + tile.height - y0);
+        glPixelStorei(GL_UNPACK_SKIP_PIXELS, x0);
+        glPixelStorei(GL_UNPACK_SKIP_ROWS, y0);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, x0 - tile.x, y0 - tile.y, width, height, GL_RGBA, GL_FLOAT, output_image_ptr);
+        tile.uploaded[b] = version;
+        budget -= std::min(budget, (size_t)width * height);
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+    return complete;
+}
+
+/*
+ * This function makes sure that every tile overlapping the visible part of the image [x0, x1) x [y0, y1) (in image
+ * pixels) is on the GPU and up to date. It is called every frame, so any updates to the heap image will be displayed
+ * when the frame updates as long as they are announced with PublishImage(). Tiles outside of the visible region are
+ * left alone, so panning around a huge image only uploads the tiles that come into view.
+ */
+void UpdateOutputTexture(int x0, int y0, int x1, int y1) {
+
+    if (tiled_width != image_width || tiled_height != image_height)
+        BuildTileGrid();
+
+    // Uploading is expensive, so it only happens for the blocks that the renderer changed, up to a budget per frame
+    size_t budget = max_upload_pixels;
+    bool pending = false;
+    for (texture_tile& tile : output_tiles) {
+        bool visible = tile.x < x1 && tile.x + tile.width > x0 && tile.y < y1 && tile.y + tile.height > y0;
+        if (!visible)
+            continue;
+        if (!UploadTile(tile, budget))
+            pending = true;
+        tile.last_drawn = display_frame;
+    }
+    if (pending)
+        RequestRedraw();                                    // keep drawing until the rest of the blocks are uploaded
+
+    // If too many tiles are stored on the GPU, delete the ones that haven't been drawn for the longest time
+    int resident = ResidentTileCount();
+    if (resident > max_resident_tiles) {
+        std::vector<texture_tile*> candidates;
+        for (texture_tile& tile : output_tiles) {
+            if (tile.tex != 0 && tile.last_drawn != display_frame)
+                candidates.push_back(&tile);
+        }
+        std::sort(candidates.begin(), candidates.end(),
+            [](const texture_tile* a, const texture_tile* b) { return a->last_drawn < b->last_drawn; });
+        for (size_t i = 0; i < candidates.size() && resident > max_resident_tiles; i++, resident--) {
+            glDeleteTextures(1, &candidates[i]->tex);
+            candidates[i]->tex = 0;
+        }
+    }
 }
 
 /* This function is called every time the user interface is updated (which happens every iteration of the main loop).
- * This displays the contents of the current output image on the screen in an ImGui window.
+ * This displays the contents of the current output image on the screen in an ImGui window. The mouse wheel zooms in
+ * and out around the cursor, dragging with the left mouse button pans the image, and a right click resets the view.
  */
 void DrawOutputImage() {
 
-    // Update the OpenGL texture (on the GPU) with the current image data in main memory
-    UpdateOutputTexture();
+    display_frame++;
 
     // Create a new ImGui window to show the image - call it whatever you want
-    ImGui::Begin("Hello World!");
+    ImGui::Begin("Hello World!", nullptr, ImGuiWindowFlags_NoScrollbar | ImGuiWindowFlags_NoScrollWithMouse);
 
     // Get the size of the window region that can be drawn to
     ImVec2 viewport_size = ImGui::GetContentRegionAvail();
 
-    // Use ImGui to render the image to the screen (we've set up ImGui to use OpenGL, so we provide an OpenGL texture to render)
-    ImGui::Image((ImTextureID)(intptr_t)output_image_tex, viewport_size);
+    /* In viewport tracking mode, the image is rendered at exactly the number of pixels covered by the viewport (ImGui
+     * sizes are in screen coordinates, so they are scaled to framebuffer pixels for high DPI displays). This way no
+     * work is wasted on pixels that get downsampled and the image is never blurred by upsampling.
+     */
+    if (track_viewport) {
+        ImVec2 scale = ImGui::GetIO().DisplayFramebufferScale;
+        int target_width = static_cast<int>(viewport_size.x * scale.x);
+        int target_height = static_cast<int>(viewport_size.y * scale.y);
+
+        static int pending_width = 0, pending_height = 0;
+        static float pending_seconds = 0.0f;
+        if (target_width > 0 && target_height > 0 && (target_width != image_width || target_height != image_height)) {
+            if (target_width != pending_width || target_height != pending_height) {
+                pending_width = target_width;               // the size changed again, so restart the timer
+                pending_height = target_height;
+                pending_seconds = 0.0f;
+            }
+            pending_seconds += ImGui::GetIO().DeltaTime;
+            if (pending_seconds >= resize_debounce_seconds)
+                ResizeImage(pending_width, pending_height);
+            else
+                RequestRedraw();                            // keep the UI drawing (even in idle mode) until the timer expires
+        }
+        else {
+            pending_width = pending_height = 0;             // nothing pending
+        }
+    }
+
+    // ImGui can't create a widget with a zero size (for example when the window is collapsed to its title bar)
+    if (viewport_size.x < 1.0f || viewport_size.y < 1.0f) {
+        ImGui::End();
+        return;
+    }
+
+    // An invisible button covering the viewport catches the mouse input used to zoom and pan the image
+    ImVec2 origin = ImGui::GetCursorScreenPos();
+    ImGui::InvisibleButton("output_image", viewport_size);
+    ImGuiIO& io = ImGui::GetIO();
+
+    // At a zoom of 1 the image is stretched to fill the viewport, and the zoom factor scales that uniformly
+    ImVec2 scale(viewport_size.x / image_width * view_zoom, viewport_size.y / image_height * view_zoom);
+
+    if (ImGui::IsItemHovered() && io.MouseWheel != 0.0f) {
+        // keep the image point under the cursor fixed while zooming
+        float image_x = (io.MousePos.x - origin.x - view_offset.x) / scale.x;
+        float image_y = (io.MousePos.y - origin.y - view_offset.y) / scale.y;
+        view_zoom = std::clamp(view_zoom * (io.MouseWheel > 0.0f ? 1.25f : 0.8f), 0.1f, 1024.0f);
+        scale = ImVec2(viewport_size.x / image_width * view_zoom, viewport_size.y / image_height * view_zoom);
+        view_offset = ImVec2(io.MousePos.x - origin.x - image_x * scale.x, io.MousePos.y - origin.y - image_y * scale.y);
+    }
+    if (ImGui::IsItemActive() && ImGui::IsMouseDragging(ImGuiMouseButton_Left))
+        view_offset = ImVec2(view_offset.x + io.MouseDelta.x, view_offset.y + io.MouseDelta.y);
+    if (ImGui::IsItemHovered() && ImGui::IsMouseClicked(ImGuiMouseButton_Right)) {
+        view_zoom = 1.0f;
+        view_offset = ImVec2(0.0f, 0.0f);
+        scale = ImVec2(viewport_size.x / image_width, viewport_size.y / image_height);
+    }
+
+    // Find the part of the image that is visible in the viewport (in image pixels) and update the tiles covering it
+    int visible_x0 = std::max(0, static_cast<int>(-view_offset.x / scale.x));
+    int visible_y0 = std::max(0, static_cast<int>(-view_offset.y / scale.y));
+    int visible_x1 = std::min(image_width, static_cast<int>((viewport_size.x - view_offset.x) / scale.x) + 1);
+    int visible_y1 = std::min(image_height, static_cast<int>((viewport_size.y - view_offset.y) / scale.y) + 1);
+    UpdateOutputTexture(visible_x0, visible_y0, visible_x1, visible_y1);
+
+    // Tiles that are visible are rendered first, starting under the mouse cursor (or in the middle of the viewport)
+    if (output_focus.order == render_focus::viewport_first) {
+        render_focus focus = output_focus;
+        focus.x0 = visible_x0;
+        focus.y0 = visible_y0;
+        focus.x1 = visible_x1;
+        focus.y1 = visible_y1;
+        if (ImGui::IsItemHovered()) {
+            focus.x = std::floor((io.MousePos.x - origin.x - view_offset.x) / scale.x);
+            focus.y = std::floor((io.MousePos.y - origin.y - view_offset.y) / scale.y);
+        }
+        else {
+            focus.x = 0.5 * (visible_x0 + visible_x1);
+            focus.y = 0.5 * (visible_y0 + visible_y1);
+        }
+        FocusRender(focus);
+    }
+
+    // Use ImGui to render the visible tiles to the screen (we've set up ImGui to use OpenGL, so we provide OpenGL textures)
+    ImDrawList* draw_list = ImGui::GetWindowDrawList();
+    draw_list->PushClipRect(origin, ImVec2(origin.x + viewport_size.x, origin.y + viewport_size.y), true);
+    for (const texture_tile& tile : output_tiles) {
+        if (tile.tex == 0 || tile.last_drawn != display_frame)
+            continue;
+        ImVec2 p0(origin.x + view_offset.x + tile.x * scale.x, origin.y + view_offset.y + tile.y * scale.y);
+        ImVec2 p1(p0.x + tile.width * scale.x, p0.y + tile.height * scale.y);
+        draw_list->AddImage((ImTextureID)(intptr_t)tile.tex, p0, p1);
+    }
+    draw_list->PopClipRect();
 
     // This is the only thing displayed in the window
     ImGui::End();
-}
\ No newline at end of file
+}
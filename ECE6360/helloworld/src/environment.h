@@ -0,0 +1,324 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "vec3.h"
+#include "simd.h"
+
+/*
+ * Environment lighting stored as a latitude-longitude (equirectangular) image. Rows span the polar angle theta
+ * from straight up (+y, row 0) to straight down (-y) and columns span the azimuth phi around the y axis.
+ *
+ * Rays that miss the scene look up their color here. The map also stores a 2D cumulative distribution (a
+ * marginal CDF over rows and a conditional CDF over the columns of each row) proportional to the luminance of
+ * each texel, so that directions can be importance sampled: bright regions like the sun are chosen far more
+ * often than dark sky, which is what makes environment-lit scenes converge quickly.
+ */
+class environment_map {
+public:
+    environment_map() {}
+
+    // bake the procedural sky gradient (blended by the y component of the direction) into a map
+    static environment_map gradient(int width, int height, const color& bottom, const color& top) {
+        environment_map env;
+        env.m_width = width;
+        env.m_height = height;
+        env.m_pixels.resize(width * height);
+        for (int yi = 0; yi < height; yi++) {
+            double y = std::cos(pi * (yi + 0.5) / height);
+            double a = 0.5 * (y + 1.0);
+            color c = (1.0 - a) * bottom + a * top;
+            for (int xi = 0; xi < width; xi++)
+                env.m_pixels[yi * width + xi] = c;
+        }
+        env.m_name = "procedural gradient";
+        env.build();
+        return env;
+    }
+
+    // load a Radiance RGBE (.hdr) file stored in the standard "-Y height +X width" orientation
+    static environment_map load_hdr(const std::string& filename) {
+        FILE* f = std::fopen(filename.c_str(), "rb");
+        if (f == nullptr)
+            throw std::runtime_error("Unable to open environment map " + filename);
+
+        // the header is a list of text lines terminated by an empty line, followed by the resolution string
+        char line[512];
+        bool rgbe = false;
+        while (std::fgets(line, sizeof(line), f) != nullptr && line[0] != '\n') {
+            if (std::string(line).find("FORMAT=32-bit_rle_rgbe") != std::string::npos)
+                rgbe = true;
+        }
+        // the resolution line is read as a line, since scanf would skip pixel bytes that look like whitespace after it
+        int width = 0, height = 0;
+        if (!rgbe || std::fgets(line, sizeof(line), f) == nullptr || std::sscanf(line, "-Y %d +X %d", &height, &width) != 2) {
+            std::fclose(f);
+            throw std::runtime_error("Unsupported HDR format in " + filename);
+        }
+        if (width <= 0 || height <= 0 || width > max_size || height > max_size || (size_t)width * height > max_texels) {
+            std::fclose(f);
+            throw std::runtime_error("Unsupported HDR size " + std::to_string(width) + " x " + std::to_string(height) +
+                " in " + filename);
+        }
+
+        environment_map env;
+        env.m_width = width;
+        env.m_height = height;
+        env.m_pixels.resize((size_t)width * height);
+
+        std::vector<unsigned char> scanline((size_t)width * 4);
+        for (int yi = 0; yi < height; yi++) {
+            if (!read_rgbe_scanline(f, scanline.data(), width)) {
+                std::fclose(f);
+                throw std::runtime_error("Truncated HDR file " + filename);
+            }
+            for (int xi = 0; xi < width; xi++) {
+                const unsigned char* p = &scanline[xi * 4];
+                double scale = p[3] == 0 ? 0.0 : std::ldexp(1.0, p[3] - 136);
+                env.m_pixels[yi * width + xi] = color(p[0] * scale, p[1] * scale, p[2] * scale);
+            }
+        }
+        std::fclose(f);
+
+        env.m_name = filename;
+        env.build();
+        return env;
+    }
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    const std::string& name() const { return m_name; }
+    bool empty() const { return m_pixels.empty(); }
+
+    // color seen along the (not necessarily normalized) direction of a ray that missed everything in the scene
+    color miss(const vec3& direction) const {
+        double len = direction.length();
+        if (!m_row_lut.empty()) {
+            // fast path: the map only varies with height, so a 1D table indexed by y replaces the trig functions
+            double s = (direction.y() / len * 0.5 + 0.5) * (lut_size - 1);
+            int i = std::clamp(static_cast<int>(s), 0, lut_size - 2);
+            double f = s - i;
+            return (1.0 - f) * m_row_lut[i] + f * m_row_lut[i + 1];
+        }
+        return lookup(direction / len);
+    }
+
+    // miss() for four directions at once (only the table or texel reads are done one lane at a time)
+    void miss4(const vec3x4& direction, float4& r, float4& g, float4& b) const {
+        alignas(16) float c[3][4];
+        if (!m_row_lut.empty()) {
+            float4 s = (direction.y / sqrt(dot(direction, direction)) * float4(0.5f) + float4(0.5f)) * float4(lut_size - 1);
+            alignas(16) float sv[4];
+            s.store(sv);
+            for (int i = 0; i < 4; i++) {
+                int j = std::clamp(static_cast<int>(sv[i]), 0, lut_size - 2);
+                double f = sv[i] - j;
+                color v = (1.0 - f) * m_row_lut[j] + f * m_row_lut[j + 1];
+                for (int ch = 0; ch < 3; ch++)
+                    c[ch][i] = (float)v[ch];
+            }
+        }
+        else {
+            alignas(16) float x[4], y[4], z[4];
+            direction.x.store(x);
+            direction.y.store(y);
+            direction.z.store(z);
+            for (int i = 0; i < 4; i++) {
+                color v = miss(vec3(x[i], y[i], z[i]));
+                for (int ch = 0; ch < 3; ch++)
+                    c[ch][i] = (float)v[ch];
+            }
+        }
+        r = float4::load(c[0]);
+        g = float4::load(c[1]);
+        b = float4::load(c[2]);
+    }
+
+    // color of the texel containing a unit direction
+    color lookup(const vec3& dir) const {
+        double u, v;
+        direction_to_uv(dir, u, v);
+        int xi = std::min(static_cast<int>(u * m_width), m_width - 1);
+        int yi = std::min(static_cast<int>(v * m_height), m_height - 1);
+        return m_pixels[yi * m_width + xi];
+    }
+
+    /*
+     * Choose a direction with probability proportional to the luminance of the map, given two uniform random
+     * numbers in [0, 1). The solid angle probability density of the returned direction is stored in pdf.
+     */
+    vec3 sample(double u1, double u2, double& pdf) const {
+        // pick a row from the marginal distribution, then a column from that row's conditional distribution
+        int yi = sample_cdf(m_marginal_cdf.data(), m_height, u1);
+        int xi = sample_cdf(&m_conditional_cdf[yi * (m_width + 1)], m_width, u2);
+
+        // jitter inside the texel by re-using the leftover fraction of each random number
+        double du = remap(m_conditional_cdf.data() + yi * (m_width + 1), xi, u2);
+        double dv = remap(m_marginal_cdf.data(), yi, u1);
+        double u = (xi + du) / m_width;
+        double v = (yi + dv) / m_height;
+
+        vec3 dir = uv_to_direction(u, v);
+        pdf = texel_pdf(xi, yi, v);
+        return dir;
+    }
+
+    // solid angle probability density of sample() returning the unit direction dir
+    double pdf(const vec3& dir) const {
+        double u, v;
+        direction_to_uv(dir, u, v);
+        int xi = std::min(static_cast<int>(u * m_width), m_width - 1);
+        int yi = std::min(static_cast<int>(v * m_height), m_height - 1);
+        return texel_pdf(xi, yi, v);
+    }
+
+    static constexpr double pi = 3.14159265358979323846;
+
+    // unit direction <-> map coordinates in [0, 1) x [0, 1)
+    static void direction_to_uv(const vec3& dir, double& u, double& v) {
+        double phi = std::atan2(dir.z(), dir.x());
+        u = (phi + pi) / (2.0 * pi);
+        v = std::acos(std::clamp(dir.y(), -1.0, 1.0)) / pi;
+    }
+    static vec3 uv_to_direction(double u, double v) {
+        double phi = 2.0 * pi * u - pi;
+        double theta = pi * v;
+        double sin_theta = std::sin(theta);
+        return vec3(sin_theta * std::cos(phi), std::cos(theta), sin_theta * std::sin(phi));
+    }
+
+private:
+    static constexpr int lut_size = 256;
+    static constexpr int max_size = 32768;                  // largest HDR width or height that is loaded
+    static constexpr size_t max_texels = size_t(1) << 28;   // largest HDR texel count (the pixels alone take 6 GB)
+
+    int m_width = 0;
+    int m_height = 0;
+    std::string m_name;
+    std::vector<color> m_pixels;
+    std::vector<double> m_marginal_cdf;             // m_height + 1 entries
+    std::vector<double> m_conditional_cdf;          // m_height rows of m_width + 1 entries
+    std::vector<double> m_row_weight;               // total weight of each row (used to compute the pdf)
+    double m_total_weight = 0.0;
+    std::vector<color> m_row_lut;                   // y-indexed lookup table (only built for height-only maps)
+
+    static double luminance(const color& c) {
+        return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+    }
+
+    // build the sampling distributions and the miss lookup table after the pixels have been filled in
+    void build() {
+        m_conditional_cdf.assign(m_height * (m_width + 1), 0.0);
+        m_marginal_cdf.assign(m_height + 1, 0.0);
+        m_row_weight.assign(m_height, 0.0);
+
+        bool rows_uniform = true;
+        for (int yi = 0; yi < m_height; yi++) {
+            // each texel is weighted by its solid angle, which shrinks towards the poles by sin(theta)
+            double sin_theta = std::sin(pi * (yi + 0.5) / m_height);
+            double* cdf = &m_conditional_cdf[yi * (m_width + 1)];
+            for (int xi = 0; xi < m_width; xi++) {
+                const color& c = m_pixels[yi * m_width + xi];
+                cdf[xi + 1] = cdf[xi] + luminance(c) * sin_theta;
+                const color& first = m_pixels[yi * m_width];
+                if (c.x() != first.x() || c.y() != first.y() || c.z() != first.z())
+                    rows_uniform = false;
+            }
+            m_row_weight[yi] = cdf[m_width];
+            normalize_cdf(cdf, m_width);
+            m_marginal_cdf[yi + 1] = m_marginal_cdf[yi] + m_row_weight[yi];
+        }
+        m_total_weight = m_marginal_cdf[m_height];
+        normalize_cdf(m_marginal_cdf.data(), m_height);
+
+        // a map that only changes with height (like the procedural sky) can be looked up from y alone
+        m_row_lut.clear();
+        if (rows_uniform) {
+            m_row_lut.resize(lut_size);
+            for (int i = 0; i < lut_size; i++) {
+                double y = std::clamp(2.0 * i / (lut_size - 1) - 1.0, -1.0, 1.0);
+                m_row_lut[i] = row_color(std::acos(y) / pi);
+            }
+        }
+    }
+
+    // linearly interpolated color between the row centers of a height-only map
+    color row_color(double v) const {
+        double s = std::clamp(v * m_height - 0.5, 0.0, m_height - 1.0);
+        int i = std::min(static_cast<int>(s), m_height - 1);
+        int j = std::min(i + 1, m_height - 1);
+        double f = s - i;
+        return (1.0 - f) * m_pixels[i * m_width] + f * m_pixels[j * m_width];
+    }
+
+    // scale a running sum into a CDF in [0, 1] (a row of black texels becomes a uniform distribution)
+    static void normalize_cdf(double* cdf, int n) {
+        double total = cdf[n];
+        for (int i = 1; i <= n; i++)
+            cdf[i] = total > 0.0 ? cdf[i] / total : static_cast<double>(i) / n;
+    }
+
+    // index of the interval [cdf[i], cdf[i + 1]) containing u
+    static int sample_cdf(const double* cdf, int n, double u) {
+        const double* it = std::upper_bound(cdf, cdf + n + 1, u);
+        return std::clamp(static_cast<int>(it - cdf) - 1, 0, n - 1);
+    }
+
+    // position of u inside the chosen interval, rescaled to [0, 1)
+    static double remap(const double* cdf, int i, double u) {
+        double width = cdf[i + 1] - cdf[i];
+        return width > 0.0 ? std::clamp((u - cdf[i]) / width, 0.0, 0.999999) : 0.5;
+    }
+
+    double texel_pdf(int xi, int yi, double v) const {
+        double sin_theta = std::sin(pi * v);
+        if (m_total_weight <= 0.0 || sin_theta <= 0.0) return 0.0;
+
+        // probability of the texel times the number of texels, converted from the unit square to solid angle
+        double p_row = m_row_weight[yi] / m_total_weight;
+        const double* cdf = &m_conditional_cdf[yi * (m_width + 1)];
+        double p_col = cdf[xi + 1] - cdf[xi];
+        return p_row * p_col * m_width * m_height / (2.0 * pi * pi * sin_theta);
+    }
+
+    // read one RGBE scanline (either the run-length encoded format or a flat array of pixels)
+    static bool read_rgbe_scanline(FILE* f, unsigned char* out, int width) {
+        unsigned char head[4];
+        if (std::fread(head, 1, 4, f) != 4) return false;
+
+        // old-style flat scanlines don't start with the 2, 2 marker
+        if (width < 8 || width > 0x7fff || head[0] != 2 || head[1] != 2 || (head[2] & 0x80)) {
+            std::copy(head, head + 4, out);
+            return std::fread(out + 4, 4, width - 1, f) == static_cast<size_t>(width - 1);
+        }
+
+        // new-style scanlines store each of the four channels separately as runs and literal spans
+        for (int c = 0; c < 4; c++) {
+            int x = 0;
+            while (x < width) {
+                int count = std::fgetc(f);
+                if (count == EOF) return false;
+                if (count > 128) {
+                    count -= 128;
+                    int value = std::fgetc(f);
+                    if (value == EOF || x + count > width) return false;
+                    for (int i = 0; i < count; i++) out[(x++) * 4 + c] = static_cast<unsigned char>(value);
+                }
+                else {
+                    if (count == 0 || x + count > width) return false;
+                    for (int i = 0; i < count; i++) {
+                        int value = std::fgetc(f);
+                        if (value == EOF) return false;
+                        out[(x++) * 4 + c] = static_cast<unsigned char>(value);
+                    }
+                }
+            }
+        }
+        return true;
+    }
+};
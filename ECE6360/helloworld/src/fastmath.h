@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cfloat>
+#include <cmath>
+#include <random>
+
+#include "vec3.h"
+
+/*
+ * Fast approximate math used by the opt-in "fast math" mode. The x86 SSE instruction set has a hardware
+ * reciprocal square root (rsqrtss) that returns an estimate with about 12 bits of precision in a single cycle.
+ * One Newton-Raphson step roughly doubles the number of correct bits, which is plenty for normalizing shading
+ * directions and is still much cheaper than a full sqrt followed by a division. On other architectures these
+ * functions fall back to the exact standard library versions.
+ */
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <immintrin.h>
+#define FASTMATH_SSE 1
+#endif
+
+// approximate 1 / sqrt(x) for x > 0 (hardware estimate refined by one Newton step)
+inline double fast_rsqrt(double x) {
+#ifdef FASTMATH_SSE
+    // the hardware estimate only exists for single precision, so values outside the float range use the exact path
+    if (x >= FLT_MIN && x <= FLT_MAX) {
+        double y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(static_cast<float>(x))));
+        return y * (1.5 - 0.5 * x * y * y);
+    }
+#endif
+    return 1.0 / std::sqrt(x);
+}
+
+// approximate sqrt(x) for x >= 0, computed as x * rsqrt(x) so that no division is required
+inline double fast_sqrt(double x) {
+    if (x <= 0.0) return 0.0;
+    return x * fast_rsqrt(x);
+}
+
+// approximate unit_vector(): a multiplication by the reciprocal length replaces the sqrt and three divisions
+inline vec3 fast_unit_vector(const vec3& v) {
+    return v * fast_rsqrt(v.length_squared());
+}
+
+// packed version of fast_rsqrt() that refines four estimates at once (one SSE instruction for all four lanes)
+inline void fast_rsqrt4(const float* x, float* out) {
+#ifdef FASTMATH_SSE
+    __m128 vx = _mm_loadu_ps(x);
+    __m128 y = _mm_rsqrt_ps(vx);
+    __m128 xyy = _mm_mul_ps(_mm_mul_ps(vx, y), y);
+    y = _mm_mul_ps(y, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(_mm_set1_ps(0.5f), xyy)));
+    _mm_storeu_ps(out, y);
+#else
+    for (int i = 0; i < 4; i++)
+        out[i] = 1.0f / std::sqrt(x[i]);
+#endif
+}
+
+// maximum relative errors of the fast functions, measured against the exact standard library versions
+struct fast_math_error {
+    double rsqrt = 0.0;
+    double sqrt = 0.0;
+    double normalize = 0.0;         // largest deviation of |fast_unit_vector(v)| from 1
+    double rsqrt4 = 0.0;            // packed single precision version
+};
+
+/*
+ * Measure the error bound of the fast math functions by comparing them to the exact versions over a large
+ * number of random inputs spanning many orders of magnitude. The random seed is fixed so the reported bound
+ * is reproducible from run to run.
+ */
+inline fast_math_error measure_fast_math_error(int samples = 1 << 18) {
+    fast_math_error err;
+    std::mt19937 rng(6360);
+    std::uniform_real_distribution<double> exponent(-12.0, 12.0);
+    std::uniform_real_distribution<double> coordinate(-1.0, 1.0);
+
+    for (int i = 0; i < samples; i++) {
+        double x = std::pow(10.0, exponent(rng));
+        double exact = 1.0 / std::sqrt(x);
+        err.rsqrt = std::fmax(err.rsqrt, std::fabs(fast_rsqrt(x) - exact) / exact);
+        err.sqrt = std::fmax(err.sqrt, std::fabs(fast_sqrt(x) - std::sqrt(x)) / std::sqrt(x));
+
+        vec3 v = std::pow(10.0, exponent(rng)) * vec3(coordinate(rng), coordinate(rng), coordinate(rng));
+        if (v.length_squared() > 0.0)
+            err.normalize = std::fmax(err.normalize, std::fabs(fast_unit_vector(v).length() - 1.0));
+    }
+
+    // the packed version only works in single precision, so test it over the normal float range
+    std::uniform_real_distribution<double> float_exponent(-30.0, 30.0);
+    for (int i = 0; i < samples; i += 4) {
+        float x[4], y[4];
+        for (int l = 0; l < 4; l++)
+            x[l] = static_cast<float>(std::pow(10.0, float_exponent(rng)));
+        fast_rsqrt4(x, y);
+        for (int l = 0; l < 4; l++) {
+            double exact = 1.0 / std::sqrt(static_cast<double>(x[l]));
+            err.rsqrt4 = std::fmax(err.rsqrt4, std::fabs(y[l] - exact) / exact);
+        }
+    }
+    return err;
+}
@@ -0,0 +1,292 @@
+#include "frame_cache.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+// layout of the start of every compressed frame, followed by one 64-bit size per block and then the blocks
+struct frame_header {
+	uint32_t magic;
+	uint32_t width;
+	uint32_t height;
+	uint32_t has_objects;
+	uint32_t blocks;
+};
+static const uint32_t frame_magic = 0x43465748;				// "HWFC"
+
+/*
+ * Run-length encode byte `shift / 8` of every value: a token with the high bit set stands for (token & 0x7f) + 1
+ * zero bytes, and any other token is followed by token + 1 literal bytes. Literal runs end at the first pair of
+ * zeros, since a single zero is cheaper to copy than to encode as a run.
+ */
+static void EncodePlane(const uint32_t* d, size_t count, int shift, std::vector<uint8_t>& out) {
+	auto byte = [&](size_t i) { return (uint8_t)(d[i] >> shift); };
+	size_t i = 0;
+	while (i < count) {
+		size_t zeros = 0;
+		while (i + zeros < count && zeros < 128 && byte(i + zeros) == 0)
+			zeros++;
+		if (zeros > 0) {
+			out.push_back((uint8_t)(0x80 | (zeros - 1)));
+			i += zeros;
+			continue;
+		}
+		size_t n = 0;
+		while (i + n < count && n < 128) {
+			if (byte(i + n) == 0 && (i + n + 1 == count || byte(i + n + 1) == 0))
+				break;
+			n++;
+		}
+		out.push_back((uint8_t)(n - 1));
+		for (size_t k = 0; k < n; k++)
+			out.push_back(byte(i + k));
+		i += n;
+	}
+}
+
+// decode one byte plane into d (which starts out zeroed), returning the end of the encoded plane
+static const uint8_t* DecodePlane(const uint8_t* in, const uint8_t* end, uint32_t* d, size_t count, int shift) {
+	size_t i = 0;
+	while (i < count) {
+		if (in >= end)
+			throw std::runtime_error("Truncated frame");
+		uint8_t token = *in++;
+		size_t n = (token & 0x7f) + 1;
+		if (n > count - i)
+			throw std::runtime_error("Corrupted frame");
+		if (token & 0x80) {
+			i += n;
+			continue;
+		}
+		if ((size_t)(end - in) < n)
+			throw std::runtime_error("Truncated frame");
+		for (size_t k = 0; k < n; k++)
+			d[i++] |= (uint32_t)*in++ << shift;
+	}
+	return in;
+}
+
+// XOR every value with the one `stride` values earlier (the same channel of the previous pixel) and encode it
+static void CompressWords(const void* values, size_t count, size_t stride, std::vector<uint8_t>& out) {
+	std::vector<uint32_t> d(count);
+	std::memcpy(d.data(), values, count * sizeof(uint32_t));
+	for (size_t i = count; i-- > stride;)
+		d[i] ^= d[i - stride];
+	for (int shift = 0; shift < 32; shift += 8)
+		EncodePlane(d.data(), count, shift, out);
+}
+
+static const uint8_t* DecompressWords(const uint8_t* in, const uint8_t* end, void* values, size_t count, size_t stride) {
+	std::vector<uint32_t> d(count, 0);
+	for (int shift = 0; shift < 32; shift += 8)
+		in = DecodePlane(in, end, d.data(), count, shift);
+	for (size_t i = stride; i < count; i++)
+		d[i] ^= d[i - stride];
+	std::memcpy(values, d.data(), count * sizeof(uint32_t));
+	return in;
+}
+
+frame_cache::~frame_cache() {
+	clear();
+}
+
+void frame_cache::set_memory_budget(size_t bytes) {
+	m_memory_budget = bytes;
+	evict();
+}
+
+void frame_cache::set_spill_directory(const std::string& directory, size_t disk_budget) {
+	while (!m_disk.empty())
+		remove_spilled(std::prev(m_disk.end()));
+	m_spill_directory = directory;
+	m_disk_budget = disk_budget;
+	if (!directory.empty())
+		std::filesystem::create_directories(directory);
+}
+
+void frame_cache::store(uint64_t key, const float* pixels, const int* objects, int width, int height, thread_pool& pool) {
+	if (m_memory_budget == 0 && m_spill_directory.empty())
+		return;
+
+	// Compress blocks of rows in parallel
+	int blocks = (height + block_rows - 1) / block_rows;
+	std::vector<std::vector<uint8_t>> compressed(blocks);
+	pool.parallel_for(blocks, [&](int b) {
+		size_t first = (size_t)b * block_rows * width;
+		size_t count = (size_t)std::min(block_rows, height - b * block_rows) * width;
+		CompressWords(pixels + first * 4, count * 4, 4, compressed[b]);
+		if (objects)
+			CompressWords(objects + first, count, 1, compressed[b]);
+	});
+
+	frame_header header = { frame_magic, (uint32_t)width, (uint32_t)height, objects != nullptr, (uint32_t)blocks };
+	size_t size = sizeof(header) + blocks * sizeof(uint64_t);
+	for (const auto& c : compressed)
+		size += c.size();
+	entry e{ key, std::vector<uint8_t>(size) };
+	uint8_t* p = e.data.data();
+	std::memcpy(p, &header, sizeof(header));
+	p += sizeof(header);
+	for (const auto& c : compressed) {
+		uint64_t block_size = c.size();
+		std::memcpy(p, &block_size, sizeof(block_size));
+		p += sizeof(block_size);
+	}
+	for (const auto& c : compressed) {
+		std::memcpy(p, c.data(), c.size());
+		p += c.size();
+	}
+	m_uncompressed_bytes += (size_t)width * height * (objects ? 5 : 4) * sizeof(float);
+	m_compressed_bytes += size;
+
+	// a newer frame with the same key replaces the old one
+	if (auto it = m_memory_index.find(key); it != m_memory_index.end()) {
+		m_memory_bytes -= it->second->data.size();
+		m_memory.erase(it->second);
+		m_memory_index.erase(it);
+	}
+	if (auto it = m_disk_index.find(key); it != m_disk_index.end())
+		remove_spilled(it->second);
+	insert(std::move(e));
+}
+
+bool frame_cache::fetch(uint64_t key, float* pixels, int* objects, int width, int height, thread_pool& pool,
+	bool* restored_objects) {
+	if (restored_objects)
+		*restored_objects = false;
+
+	// Bring a spilled frame back into memory (a file that can't be read is a miss)
+	if (m_memory_index.count(key) == 0 && m_disk_index.count(key) != 0) {
+		auto spilled_it = m_disk_index[key];
+		std::ifstream in(spill_filename(key), std::ios::binary);
+		entry e{ key, std::vector<uint8_t>(spilled_it->bytes) };
+		bool read = in && in.read(reinterpret_cast<char*>(e.data.data()), e.data.size()) && in.gcount() == (std::streamsize)e.data.size();
+		in.close();
+		remove_spilled(spilled_it);
+		if (read)
+			insert(std::move(e));
+	}
+
+	auto it = m_memory_index.find(key);
+	if (it == m_memory_index.end()) {
+		m_misses++;
+		return false;
+	}
+	const std::vector<uint8_t>& data = it->second->data;
+
+	// Check the header and the block table before decompressing anything
+	frame_header header;
+	if (data.size() < sizeof(header)) {
+		m_misses++;
+		return false;
+	}
+	std::memcpy(&header, data.data(), sizeof(header));
+	int blocks = (height + block_rows - 1) / block_rows;
+	if (header.magic != frame_magic || header.width != (uint32_t)width || header.height != (uint32_t)height ||
+		header.blocks != (uint32_t)blocks || data.size() < sizeof(header) + blocks * sizeof(uint64_t)) {
+		m_misses++;
+		return false;
+	}
+	std::vector<size_t> offsets(blocks + 1);
+	offsets[0] = sizeof(header) + blocks * sizeof(uint64_t);
+	for (int b = 0; b < blocks; b++) {
+		uint64_t block_size;
+		std::memcpy(&block_size, data.data() + sizeof(header) + b * sizeof(uint64_t), sizeof(block_size));
+		if (block_size > data.size() - offsets[b]) {
+			m_misses++;
+			return false;
+		}
+		offsets[b + 1] = offsets[b] + block_size;
+	}
+
+	std::atomic<bool> corrupted = false;
+	pool.parallel_for(blocks, [&](int b) {
+		size_t first = (size_t)b * block_rows * width;
+		size_t count = (size_t)std::min(block_rows, height - b * block_rows) * width;
+		const uint8_t* in = data.data() + offsets[b];
+		const uint8_t* end = data.data() + offsets[b + 1];
+		try {
+			in = DecompressWords(in, end, pixels + first * 4, count * 4, 4);
+			if (header.has_objects && objects)
+				DecompressWords(in, end, objects + first, count, 1);
+		}
+		catch (const std::runtime_error&) {
+			corrupted = true;
+		}
+	});
+	if (corrupted) {
+		m_memory_bytes -= data.size();
+		m_memory.erase(it->second);
+		m_memory_index.erase(it);
+		m_misses++;
+		return false;
+	}
+
+	m_memory.splice(m_memory.begin(), m_memory, it->second);
+	m_hits++;
+	if (restored_objects)
+		*restored_objects = header.has_objects && objects;
+	return true;
+}
+
+void frame_cache::clear() {
+	m_memory.clear();
+	m_memory_index.clear();
+	m_memory_bytes = 0;
+	while (!m_disk.empty())
+		remove_spilled(std::prev(m_disk.end()));
+}
+
+void frame_cache::insert(entry e) {
+	m_memory_bytes += e.data.size();
+	m_memory.push_front(std::move(e));
+	m_memory_index[m_memory.front().key] = m_memory.begin();
+	evict();
+}
+
+// drop (or spill) the least recently used frames until the cache is within its memory budget
+void frame_cache::evict() {
+	while (m_memory_bytes > m_memory_budget && !m_memory.empty()) {
+		entry& e = m_memory.back();
+		if (!m_spill_directory.empty())
+			spill(e);
+		m_memory_bytes -= e.data.size();
+		m_memory_index.erase(e.key);
+		m_memory.pop_back();
+	}
+}
+
+// write a frame to the spill directory (a frame that can't be written is dropped)
+void frame_cache::spill(entry& e) {
+	if (e.data.size() > m_disk_budget)
+		return;
+	{
+		std::ofstream out(spill_filename(e.key), std::ios::binary);
+		if (!out.write(reinterpret_cast<const char*>(e.data.data()), e.data.size()))
+			return;
+	}
+	m_disk.push_front(spilled{ e.key, e.data.size() });
+	m_disk_index[e.key] = m_disk.begin();
+	m_disk_bytes += e.data.size();
+	while (m_disk_bytes > m_disk_budget)
+		remove_spilled(std::prev(m_disk.end()));
+}
+
+void frame_cache::remove_spilled(std::list<spilled>::iterator it) {
+	std::error_code error;
+	std::filesystem::remove(spill_filename(it->key), error);
+	m_disk_bytes -= it->bytes;
+	m_disk_index.erase(it->key);
+	m_disk.erase(it);
+}
+
+std::string frame_cache::spill_filename(uint64_t key) const {
+	char name[32];
+	std::snprintf(name, sizeof(name), "%016llx.frame", (unsigned long long)key);
+	return (std::filesystem::path(m_spill_directory) / name).string();
+}
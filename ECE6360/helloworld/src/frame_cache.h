@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+class thread_pool;
+
+/*
+ * A 64-bit FNV-1a hash of everything that determines a rendered frame (the scene version, the camera, the render
+ * settings, ...). Values are added one at a time, so padding bytes inside structures never end up in the hash.
+ */
+class frame_key {
+public:
+    template <typename T>
+    frame_key& add(const T& value) {
+        static_assert(std::is_arithmetic_v<T>, "add the members of a structure one at a time");
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&value);
+        for (size_t i = 0; i < sizeof(T); i++) {
+            m_hash ^= bytes[i];
+            m_hash *= 1099511628211ull;
+        }
+        return *this;
+    }
+
+    uint64_t value() const { return m_hash; }
+
+private:
+    uint64_t m_hash = 14695981039346656037ull;
+};
+
+/*
+ * A least-recently-used cache of finished frames (the RGBA image and the pixel -> object map), so that going back to
+ * a view or a setting that was already rendered shows it immediately instead of rendering it again.
+ *
+ * Frames are compressed losslessly: every 32-bit value is XORed with the same channel of the pixel to its left, so
+ * smooth and flat regions (the background, the alpha channel, the object map) turn into zeros, then the bytes are
+ * split into planes and runs of zeros are encoded as a single byte. The image is compressed in independent blocks of
+ * rows on the thread pool. Frames are evicted from memory when the memory budget is exceeded; if a spill directory
+ * is set they are written there instead of being dropped (up to a separate disk budget) and read back on a hit.
+ *
+ * The cache is only used from the main thread.
+ */
+class frame_cache {
+public:
+    static constexpr int block_rows = 32;       // rows of pixels compressed together
+
+    explicit frame_cache(size_t memory_budget = size_t(256) << 20) : m_memory_budget(memory_budget) {}
+    ~frame_cache();
+    frame_cache(const frame_cache&) = delete;
+    frame_cache& operator=(const frame_cache&) = delete;
+
+    // change the budget (frames are evicted immediately if the cache is over the new budget)
+    void set_memory_budget(size_t bytes);
+    size_t memory_budget() const { return m_memory_budget; }
+
+    // spill evicted frames to files in this directory (an empty name turns spilling off)
+    void set_spill_directory(const std::string& directory, size_t disk_budget = size_t(2) << 30);
+    const std::string& spill_directory() const { return m_spill_directory; }
+
+    // compress a frame and store it (objects can be null)
+    void store(uint64_t key, const float* pixels, const int* objects, int width, int height, thread_pool& pool);
+
+    /*
+     * Decompress a frame into the buffers, returning false if there is no frame with this key and size. The objects
+     * are only written if the frame was stored with them, which is reported in restored_objects.
+     */
+    bool fetch(uint64_t key, float* pixels, int* objects, int width, int height, thread_pool& pool,
+        bool* restored_objects = nullptr);
+
+    void clear();
+
+    size_t frames() const { return m_memory.size(); }
+    size_t memory_bytes() const { return m_memory_bytes; }
+    size_t spilled_frames() const { return m_disk.size(); }
+    size_t disk_bytes() const { return m_disk_bytes; }
+    size_t hits() const { return m_hits; }
+    size_t misses() const { return m_misses; }
+    double compression_ratio() const { return m_compressed_bytes ? (double)m_uncompressed_bytes / m_compressed_bytes : 0.0; }
+
+private:
+    struct entry {
+        uint64_t key;
+        std::vector<uint8_t> data;              // header, block sizes, and compressed blocks (also the file format)
+    };
+    struct spilled {
+        uint64_t key;
+        size_t bytes;
+    };
+
+    size_t m_memory_budget;
+    size_t m_memory_bytes = 0;
+    std::list<entry> m_memory;                  // most recently used first
+    std::unordered_map<uint64_t, std::list<entry>::iterator> m_memory_index;
+
+    std::string m_spill_directory;
+    size_t m_disk_budget = 0;
+    size_t m_disk_bytes = 0;
+    std::list<spilled> m_disk;                  // most recently spilled first
+    std::unordered_map<uint64_t, std::list<spilled>::iterator> m_disk_index;
+
+    size_t m_hits = 0;
+    size_t m_misses = 0;
+    size_t m_uncompressed_bytes = 0;            // totals of every stored frame (for the compression ratio)
+    size_t m_compressed_bytes = 0;
+
+    void insert(entry e);
+    void evict();
+    void spill(entry& e);
+    void remove_spilled(std::list<spilled>::iterator it);
+    std::string spill_filename(uint64_t key) const;
+};
@@ -1,4 +1,169 @@
 #include "helloworld.h"
+#include "fastmath.h"
+#include "environment.h"
+#include "renderer.h"
+#include "volume.h"
+#include "isosurface.h"
+#include "medium.h"
+#include "tubes.h"
+#include "sdf.h"
+#include "snapshot.h"
+#include "latency.h"
+#include "allocation.h"
+#include "trace.h"
+#include "frame_cache.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <iostream>
+#include <string>
+
+/*
+ * Controls for direct volume rendering: load the procedural test volume and edit the transfer function. Render
+ * threads may still be reading the current volume, so a new transfer function is applied to a copy that shares
+ * the voxels, and every change is published as a new scene version (see UpdateScene()).
+ */
+void DrawVolumeControls() {
+	ImGui::Separator();
+	if (!world.vol) {
+		if (ImGui::Button("Load Procedural Volume")) {
+			world.vol = volume::procedural(256, image_renderer->pool());
+			world.iso = std::make_shared<isosurface>(world.vol);
+			UpdateMedium();
+			world.spheres.clear();
+			UpdateScene();
+		}
+		if (ImGui::Button("Load Smoke Volume")) {
+			world.vol = volume::procedural_smoke(128, image_renderer->pool());
+			world.iso = std::make_shared<isosurface>(world.vol);
+			UpdateMedium();
+			world.volume_mode = scene::volume_medium;
+			world.spheres.clear();
+			UpdateScene();
+		}
+		return;
+	}
+
+	ImGui::Text("Volume: %s (%d x %d x %d)", world.vol->name().c_str(), world.vol->nx(), world.vol->ny(), world.vol->nz());
+
+	// The isosurface only needs the rays to be traced again when the iso-value changes (there is no mesh to rebuild)
+	const char* modes[] = { "Direct Volume Rendering", "Isosurface", "Participating Medium" };
+	float iso_value = (float)world.iso_value;
+	bool retrace = ImGui::Combo("Mode", &world.volume_mode, modes, 3);
+	if (world.volume_mode == scene::volume_isosurface) {
+		retrace |= ImGui::SliderFloat("Iso-value", &iso_value, 0.0f, 1.0f);
+		ImGui::Text("Octree Levels: %d", world.iso ? world.iso->levels() : 0);
+	}
+	if (retrace) {
+		world.iso_value = iso_value;
+		UpdateScene();
+	}
+	if (world.volume_mode == scene::volume_isosurface)
+		return;
+
+	// The medium is only simulated by the path tracer (the preview shows it with the transfer function below)
+	if (world.volume_mode == scene::volume_medium) {
+		float density = (float)world.medium_density;
+		float albedo = (float)world.medium_albedo.x();
+		bool changed = ImGui::SliderFloat("Density", &density, 0.0f, 200.0f, "%.1f", ImGuiSliderFlags_Logarithmic);
+		changed |= ImGui::SliderFloat("Albedo", &albedo, 0.0f, 1.0f);
+		if (changed) {
+			world.medium_density = density;
+			world.medium_albedo = color(albedo, albedo, albedo);
+			UpdateMedium();
+			UpdateScene();
+		}
+		if (render_options.mode != render_settings::path_tracing)
+			ImGui::Text("Switch to path tracing to see scattering in the medium");
+		return;
+	}
+
+	transfer_function tf = world.vol->get_transfer_function();
+	float step_factor = (float)world.vol->step_factor();
+	const char* colormaps[] = { "Grayscale", "Fire", "Cool-Warm" };
+	bool changed = ImGui::Combo("Colormap", &tf.colormap, colormaps, 3);
+	changed |= ImGui::SliderFloat("Opacity Start", &tf.low, 0.0f, 1.0f);
+	changed |= ImGui::SliderFloat("Opacity End", &tf.high, 0.0f, 1.0f);
+	changed |= ImGui::SliderFloat("Max Opacity", &tf.max_opacity, 0.0f, 1.0f);
+	changed |= ImGui::SliderFloat("Step (voxels)", &step_factor, 0.1f, 2.0f);
+	if (changed) {
+		world.vol = world.vol->with_transfer_function(tf, step_factor);
+		UpdateScene();
+	}
+	ImGui::Text("Empty Macrocells: %.1f%%", world.vol->empty_fraction() * 100.0);
+}
+
+/*
+ * Edit the spheres in the scene. Moving or resizing a sphere only re-renders the pixels that the change can affect
+ * (see UpdateSphere()), so small edits show up almost immediately even in large images.
+ */
+void DrawSphereControls() {
+	static int selected = 0;
+	ImGui::Separator();
+	ImGui::Text("Spheres: %d", (int)world.spheres.size());
+	if (ImGui::Button("Add Sphere"))
+		UpdateSphere((int)world.spheres.size(), sphere{ point3(0.0, -0.3, -1.2), 0.15 });
+	if (world.spheres.empty())
+		return;
+
+	selected = std::clamp(selected, 0, (int)world.spheres.size() - 1);
+	ImGui::SliderInt("Sphere", &selected, 0, (int)world.spheres.size() - 1);
+	sphere s = world.spheres[selected];
+	float center[3] = { (float)s.center.x(), (float)s.center.y(), (float)s.center.z() };
+	float radius = (float)s.radius;
+	bool changed = ImGui::DragFloat3("Center", center, 0.01f);
+	changed |= ImGui::DragFloat("Radius", &radius, 0.005f, 0.01f, 2.0f);
+	if (changed) {
+		s.center = point3(center[0], center[1], center[2]);
+		s.radius = radius;
+		UpdateSphere(selected, s);
+	}
+	ImGui::Text("Last update: %zu pixels (%.1f%%)", last_update_pixels,
+		100.0 * last_update_pixels / std::max(1, image_width * image_height));
+}
+
+// Controls for the streamline tubes: load the procedural fiber bundles and switch between capsules and cylinders
+void DrawTubeControls() {
+	ImGui::Separator();
+	if (!world.tubes) {
+		if (ImGui::Button("Load Procedural Fibers")) {
+			world.tubes = tube_set::procedural_fibers(3000, 200, 0.002);
+			world.spheres.clear();
+			UpdateScene();
+		}
+		return;
+	}
+
+	ImGui::Text("Tubes: %zu segments, %zu BVH nodes, %.1f MB", world.tubes->segment_count(), world.tubes->node_count(),
+		world.tubes->memory_bytes() / (1024.0 * 1024.0));
+	int shape = world.tubes->shape;
+	const char* shapes[] = { "Capsules", "Cylinders" };
+	if (ImGui::Combo("Tube Shape", &shape, shapes, 2)) {
+		auto tubes = std::make_shared<tube_set>(*world.tubes);
+		tubes->shape = shape;
+		world.tubes = tubes;
+		UpdateScene();
+	}
+}
+
+// Implicit surfaces: load the signed distance field demo (it replaces the default sphere)
+void DrawSdfControls() {
+	ImGui::Separator();
+	if (!world.sdf) {
+		if (ImGui::Button("Load SDF Demo")) {
+			world.sdf = sdf_scene::demo();
+			world.spheres.clear();
+			UpdateScene();
+		}
+		return;
+	}
+	ImGui::Text("SDF: %zu nodes, %zu bounding boxes", world.sdf->node_count(), world.sdf->bound_count());
+	if (ImGui::Button("Remove SDF")) {
+		world.sdf = nullptr;
+		UpdateScene();
+	}
+}
 
 /*
  * This function is a starting point for creating your own user interface. I just create a UI window and
@@ -11,6 +176,160 @@ void DrawInterfaceWindow() {
 	// Display the render time for a single pass through the main loop
 	ImGui::Text("Render Time: %fms", frame_seconds * 1000);
 
+	// Show the progress of the background render of the output image
+	if (current_render) {
+		ImGui::Text("Image Render: %.1fms (%d/%d tiles)", current_render->elapsed_seconds() * 1000,
+			(int)current_render->tiles_done(), (int)current_render->tile_count());
+	}
+	else if (output_frame_cached) {
+		ImGui::Text("Image Render: shown from the frame cache");
+	}
+
+	// What the user waits for: the time from an input event (or the start of a render) to its first tile and to
+	// the converged image, along with the distribution of the input latencies so far
+	if (ImGui::CollapsingHeader("Latency")) {
+		const char* origin = render_latency.from_input() ? "input" : "render start";
+		double first = render_latency.first_tile_seconds(), converged = render_latency.converged_seconds();
+		ImGui::Text("Last render from %s: first tile %s, converged %s", origin,
+			first < 0.0 ? "-" : (std::to_string((int)std::ceil(first * 1000.0)) + " ms").c_str(),
+			converged < 0.0 ? "-" : (std::to_string((int)std::ceil(converged * 1000.0)) + " ms").c_str());
+		const latency_histogram* histograms[] = { &render_latency.input_to_first_tile, &render_latency.input_to_converged };
+		const char* names[] = { "Input to first tile", "Input to converged" };
+		for (int h = 0; h < 2; h++) {
+			const latency_histogram& hist = *histograms[h];
+			ImGui::Text("%s: %zu samples, p50 %.1f ms, p95 %.1f ms, p99 %.1f ms", names[h], hist.count(),
+				hist.percentile(0.5) * 1000.0, hist.percentile(0.95) * 1000.0, hist.percentile(0.99) * 1000.0);
+			float counts[latency_histogram::bucket_count];
+			for (int i = 0; i < latency_histogram::bucket_count; i++)
+				counts[i] = (float)hist.buckets()[i];
+			ImGui::PlotHistogram(names[h], counts, latency_histogram::bucket_count, 0, "0.1 ms - 100 s (log)", 0.0f,
+				FLT_MAX, ImVec2(0.0f, 40.0f));
+		}
+		if (ImGui::Button("Log Latency Histograms"))
+			render_latency.print(std::cout);
+	}
+
+	// Heap allocations by phase (the per-pixel render path should never allocate)
+	if (ImGui::CollapsingHeader("Allocations")) {
+		if (!allocation_tracker::enabled()) {
+			ImGui::Text("Not compiled in (configure with -DHELLOWORLD_TRACK_ALLOCATIONS=ON)");
+		}
+		else {
+			for (int p = 0; p < allocation_tracker::phase_count; p++)
+				ImGui::Text("%-14s %10llu (%.1f MB)", allocation_tracker::phase_name(p),
+					(unsigned long long)allocation_tracker::allocations(p), allocation_tracker::bytes(p) / (1024.0 * 1024.0));
+			if (ImGui::Button("Log Allocations"))
+				allocation_tracker::print(std::cout);
+		}
+	}
+
+	// Record a timeline of what every thread is doing and save it as a Chrome trace
+	if (ImGui::CollapsingHeader("Timeline")) {
+		static std::string trace_status;
+		bool recording = timeline::enabled();
+		if (ImGui::Checkbox("Record", &recording)) {
+			timeline::name_thread("main");
+			timeline::enable(recording);
+		}
+		if (ImGui::Button("Save Trace")) {
+			try {
+				timeline::write_chrome_trace(trace_filename);
+				trace_status = "Saved " + trace_filename;
+			}
+			catch (const std::exception& e) {
+				trace_status = e.what();
+			}
+		}
+		if (!trace_status.empty())
+			ImGui::Text("%s", trace_status.c_str());
+	}
+
+	// Finished images are cached, so returning to a view or setting doesn't render it again
+	if (ImGui::CollapsingHeader("Frame Cache")) {
+		ImGui::Text("In memory: %d frames, %.1f MB", (int)rendered_frames.frames(), rendered_frames.memory_bytes() / (1024.0 * 1024.0));
+		if (!rendered_frames.spill_directory().empty())
+			ImGui::Text("On disk: %d frames, %.1f MB", (int)rendered_frames.spilled_frames(), rendered_frames.disk_bytes() / (1024.0 * 1024.0));
+		ImGui::Text("Hits: %d  Misses: %d  Compression: %.1fx", (int)rendered_frames.hits(), (int)rendered_frames.misses(),
+			rendered_frames.compression_ratio());
+		int budget_mb = (int)(rendered_frames.memory_budget() >> 20);
+		if (ImGui::SliderInt("Budget (MB)", &budget_mb, 0, 4096))
+			rendered_frames.set_memory_budget((size_t)budget_mb << 20);
+		if (ImGui::Button("Clear Frame Cache"))
+			rendered_frames.clear();
+	}
+
+	// Choose between the quick preview and the progressive path tracer
+	const char* render_modes[] = { "Preview", "Path Tracing" };
+	bool rerender = ImGui::Combo("Render Mode", &render_options.mode, render_modes, 2);
+	if (render_options.mode == render_settings::path_tracing) {
+		rerender |= ImGui::SliderInt("Samples/Pixel", &render_options.samples_per_pixel, 1, 1024);
+		rerender |= ImGui::SliderInt("Max Depth", &render_options.max_depth, 1, 32);
+		rerender |= ImGui::Checkbox("Path Guiding", &render_options.guiding);
+		if (current_render && current_render->guide())
+			ImGui::Text("Guide: %d iterations, %d cells", current_render->guide()->iterations(),
+				(int)current_render->guide()->current()->leaf_count());
+		rerender |= ImGui::SliderInt("Caustic Photons", &render_options.photons, 0, 1000000, "%d", ImGuiSliderFlags_Logarithmic);
+		if (current_render) {
+			std::shared_ptr<const photon_map> photons = current_render->photons();
+			if (photons && photons->built())
+				ImGui::Text("Photons: %d stored, radius %.4f", (int)photons->size(), photons->radius());
+		}
+		rerender |= ImGui::SliderInt("Cache After Bounce", &render_options.radiance_cache, 0, 4, render_options.radiance_cache ? "%d" : "off");
+		if (current_render && current_render->cache())
+			ImGui::Text("Radiance cache: %d cells", (int)current_render->cache()->cells());
+		rerender |= ImGui::Checkbox("Reservoir Resampling", &render_options.resampling);
+		if (current_render)
+			ImGui::Text("Pass: %d/%d", (int)(current_render->tiles_done() * current_render->passes() /
+				std::max<size_t>(current_render->tile_count(), 1)), current_render->passes());
+	}
+	if (rerender)
+		DrawSquare();
+
+	// Render the tiles in the middle of the image first, or the ones the user is looking at in the image viewer
+	render_focus focus = output_focus;
+	const char* tile_orders[] = { "Center Out", "Viewport First" };
+	if (ImGui::Combo("Tile Order", &focus.order, tile_orders, 2))
+		FocusRender(focus);
+
+	/*
+	 * Toggle the approximate normalization and square root functions (the image is re-rendered when this changes).
+	 * The render threads read the flag, so it is only changed once the current render has stopped.
+	 */
+	bool use_fast_math = fast_math;
+	if (ImGui::Checkbox("Fast Math", &use_fast_math)) {
+		CancelRender();
+		fast_math = use_fast_math;
+		DrawSquare();
+	}
+	ImGui::Text("Max relative error: rsqrt %.2e, sqrt %.2e, normalize %.2e",
+		fast_math_bound.rsqrt, fast_math_bound.sqrt, fast_math_bound.normalize);
+	ImGui::Text("Packed rsqrt (2 x 2 ray packets): %.2e", fast_math_bound.rsqrt4);
+
+	// Render at the size of the image viewport, or at the fixed resolution
+	if (ImGui::Checkbox("Match Viewport Size", &track_viewport) && !track_viewport)
+		ResizeImage(resolution, resolution);
+	ImGui::Text("Image Size: %d x %d", image_width, image_height);
+	ImGui::Text("Zoom: %.2fx (scroll to zoom, drag to pan, right click to reset)", view_zoom);
+	ImGui::Text("GPU Tiles: %d resident", ResidentTileCount());
+
+	// Sleep between input events instead of redrawing the interface continuously
+	ImGui::Checkbox("Idle Mode", &idle_mode);
+
+	// Show where the background lighting comes from
+	ImGui::Text("Environment: %s (%d x %d)", environment.name().c_str(), environment.width(), environment.height());
+
+	// Edits publish new scene versions, older ones live on until the renders that use them are done
+	ImGui::Text("Scene Version: %llu (%d in memory)", (unsigned long long)scene_versions.version(), scene_versions.live_versions());
+
+	// The scene file is reloaded automatically whenever it is saved
+	if (!scene_filename.empty())
+		ImGui::Text("Scene: %s (%s)", scene_filename.c_str(), scene_status.c_str());
+
+	DrawSphereControls();
+	DrawVolumeControls();
+	DrawTubeControls();
+	DrawSdfControls();
+
 	// This is the only thing displayed in the window
 	ImGui::End();
 }
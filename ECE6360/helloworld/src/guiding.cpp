@@ -0,0 +1,198 @@
+#include "guiding.h"
+#include "sampling.h"
+
+#include <algorithm>
+#include <array>
+
+std::shared_ptr<guide_tree> guide_tree::refine() const {
+	auto next = std::make_shared<guide_tree>();
+
+	// The first tree covers the box of the vertices seen so far (padded a little, so that no side is empty)
+	if (m_nodes.empty()) {
+		for (int a = 0; a < 3; a++) {
+			double lo = m_bound_lo[a].load(), hi = m_bound_hi[a].load();
+			if (!(lo <= hi))
+				return next;									// no vertices yet: keep learning the box
+			double pad = 0.01 * (hi - lo) + 1e-3;
+			next->m_lo[a] = lo - pad;
+			next->m_hi[a] = hi + pad;
+		}
+		next->m_nodes.push_back(node{ -1, 0 });
+		next->m_leaves = std::make_unique<leaf_data[]>(1);
+		next->m_leaf_count = 1;
+		std::fill(next->m_leaves[0].pdf, next->m_leaves[0].pdf + bin_count, 0.0f);
+		std::fill(next->m_leaves[0].cdf, next->m_leaves[0].cdf + bin_count, 0.0f);
+		return next;
+	}
+	next->m_lo = m_lo;
+	next->m_hi = m_hi;
+
+	// Learn the distribution of every leaf from its training data (or keep the previous one if it got too few samples)
+	struct distribution {
+		std::array<float, bin_count> pdf;
+		bool trained;
+	};
+	std::vector<distribution> learned(m_leaf_count);
+	for (size_t l = 0; l < m_leaf_count; l++) {
+		const leaf_data& leaf = m_leaves[l];
+		double total = 0.0;
+		for (int b = 0; b < bin_count; b++)
+			total += leaf.flux[b].load(std::memory_order_relaxed);
+		if (leaf.samples.load(std::memory_order_relaxed) >= (uint32_t)min_samples && total > 0.0) {
+			// blur the bins with their neighbors (phi wraps around) so that one lucky sample doesn't make a spike
+			const int n = direction_bins;
+			for (int row = 0; row < n; row++) {
+				for (int column = 0; column < n; column++) {
+					double sum = 0.0, weight = 0.0;
+					for (int dr = -1; dr <= 1; dr++) {
+						if (row + dr < 0 || row + dr >= n)
+							continue;
+						for (int dc = -1; dc <= 1; dc++) {
+							double w = (dr == 0 ? 2.0 : 1.0) * (dc == 0 ? 2.0 : 1.0);
+							sum += w * leaf.flux[(row + dr) * n + (column + dc + n) % n].load(std::memory_order_relaxed);
+							weight += w;
+						}
+					}
+					learned[l].pdf[row * n + column] = (float)(sum / weight);
+				}
+			}
+
+			// and keep a little of the uniform distribution, so that no direction is left out entirely
+			double blurred = 0.0;
+			for (int b = 0; b < bin_count; b++)
+				blurred += learned[l].pdf[b];
+			for (int b = 0; b < bin_count; b++)
+				learned[l].pdf[b] = (float)((1.0 - uniform_fraction) * learned[l].pdf[b] / blurred + uniform_fraction / bin_count);
+			learned[l].trained = true;
+		}
+		else {
+			std::copy(leaf.pdf, leaf.pdf + bin_count, learned[l].pdf.begin());
+			learned[l].trained = leaf.trained;
+		}
+	}
+
+	/*
+	 * Copy the tree, splitting every leaf that received many samples. A leaf with n samples is split k times, so
+	 * that each of its 2^k new leaves can expect fewer than split_samples samples (assuming the next iteration
+	 * traces as many paths through it). The new leaves start out with the distribution learned by the old leaf.
+	 */
+	std::vector<int> source;											// old leaf of every new leaf
+	size_t leaves = m_leaf_count;
+	auto copy = [&](auto&& self, int old_index, int new_index, int depth) -> void {
+		const node& old = m_nodes[old_index];
+		if (old.child >= 0) {
+			int child = (int)next->m_nodes.size();
+			next->m_nodes[new_index].child = child;
+			next->m_nodes.resize(next->m_nodes.size() + 2);
+			self(self, old.child, child, depth + 1);
+			self(self, old.child + 1, child + 1, depth + 1);
+			return;
+		}
+		uint32_t samples = m_leaves[old.leaf].samples.load(std::memory_order_relaxed);
+		int splits = 0;
+		while ((samples >> splits) > (uint32_t)split_samples && depth + splits < max_depth &&
+			leaves + ((size_t)2 << splits) - 1 <= (size_t)max_leaves)
+			splits++;
+		leaves += ((size_t)1 << splits) - 1;
+		auto split = [&](auto&& split_self, int index, int remaining) -> void {
+			if (remaining == 0) {
+				next->m_nodes[index].leaf = (int)source.size();
+				source.push_back(old.leaf);
+				return;
+			}
+			int child = (int)next->m_nodes.size();
+			next->m_nodes[index].child = child;
+			next->m_nodes.resize(next->m_nodes.size() + 2);
+			split_self(split_self, child, remaining - 1);
+			split_self(split_self, child + 1, remaining - 1);
+		};
+		split(split, new_index, splits);
+	};
+	next->m_nodes.resize(1);
+	copy(copy, 0, 0, 0);
+
+	next->m_leaf_count = source.size();
+	next->m_leaves = std::make_unique<leaf_data[]>(source.size());
+	for (size_t l = 0; l < source.size(); l++) {
+		leaf_data& leaf = next->m_leaves[l];
+		const distribution& d = learned[source[l]];
+		float sum = 0.0f;
+		for (int b = 0; b < bin_count; b++) {
+			leaf.pdf[b] = d.pdf[b];
+			sum += d.pdf[b];
+			leaf.cdf[b] = sum;
+		}
+		leaf.trained = d.trained && sum > 0.0f;
+	}
+	return next;
+}
+
+int guide_tree::leaf_at(const point3& p) const {
+	if (m_nodes.empty())
+		return -1;
+	point3 lo = m_lo, hi = m_hi;
+	int index = 0;
+	for (int depth = 0; m_nodes[index].child >= 0; depth++) {
+		int axis = depth % 3;
+		double mid = 0.5 * (lo[axis] + hi[axis]);
+		if (p[axis] < mid) {
+			hi[axis] = mid;
+			index = m_nodes[index].child;
+		}
+		else {
+			lo[axis] = mid;
+			index = m_nodes[index].child + 1;
+		}
+	}
+	return m_nodes[index].leaf;
+}
+
+// bin of a unit direction: rows along cos(theta) = z, columns along phi
+int guide_tree::bin_of(const vec3& dir) {
+	int row = std::clamp((int)((dir.z() + 1.0) * 0.5 * direction_bins), 0, direction_bins - 1);
+	double phi = std::atan2(dir.y(), dir.x()) + pi;
+	int column = std::clamp((int)(phi / (2.0 * pi) * direction_bins), 0, direction_bins - 1);
+	return row * direction_bins + column;
+}
+
+vec3 guide_tree::sample(int leaf, rng& gen, double& pdf) const {
+	const leaf_data& l = m_leaves[leaf];
+	float u = (float)gen.next() * l.cdf[bin_count - 1];
+	int bin = std::min((int)(std::upper_bound(l.cdf, l.cdf + bin_count, u) - l.cdf), bin_count - 1);
+	pdf = l.pdf[bin] / l.cdf[bin_count - 1] * bin_count / (4.0 * pi);
+
+	// uniform within the bin (uniform in cos(theta) and phi is uniform in solid angle)
+	double z = -1.0 + 2.0 * ((bin / direction_bins) + gen.next()) / direction_bins;
+	double phi = 2.0 * pi * ((bin % direction_bins) + gen.next()) / direction_bins - pi;
+	double r = std::sqrt(std::max(0.0, 1.0 - z * z));
+	return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+double guide_tree::pdf(int leaf, const vec3& dir) const {
+	const leaf_data& l = m_leaves[leaf];
+	return l.pdf[bin_of(dir)] / l.cdf[bin_count - 1] * bin_count / (4.0 * pi);
+}
+
+void guide_tree::record(int leaf, const vec3& dir, double weighted_radiance) {
+	leaf_data& l = m_leaves[leaf];
+	l.flux[bin_of(dir)].fetch_add((float)weighted_radiance, std::memory_order_relaxed);
+	l.samples.fetch_add(1, std::memory_order_relaxed);
+}
+
+void guide_tree::include(const point3& p) {
+	// the box stops growing quickly, so after the first few vertices these are only loads
+	for (int a = 0; a < 3; a++) {
+		double lo = m_bound_lo[a].load(std::memory_order_relaxed);
+		while (p[a] < lo && !m_bound_lo[a].compare_exchange_weak(lo, p[a], std::memory_order_relaxed)) {}
+		double hi = m_bound_hi[a].load(std::memory_order_relaxed);
+		while (p[a] > hi && !m_bound_hi[a].compare_exchange_weak(hi, p[a], std::memory_order_relaxed)) {}
+	}
+}
+
+void path_guide::pass_started(int pass) {
+	// iterations end when passes 1, 2, 4, 8, ... start, so every iteration is as long as all of the previous ones
+	if (pass > 0 && (pass & (pass - 1)) == 0) {
+		m_tree.store(current()->refine());
+		m_iterations++;
+	}
+}
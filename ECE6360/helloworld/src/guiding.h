@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "vec3.h"
+
+class rng;
+
+/*
+ * Path guiding: the path tracer learns where the light arriving at each part of the scene comes from, and samples
+ * those directions instead of (or rather, in addition to) cosine-weighted directions. This helps most when the light
+ * reaches a surface through a small opening or by bouncing off a small bright area, which cosine sampling rarely
+ * finds. The structure follows "Practical Path Guiding" (Müller et al. 2017) in a simplified form:
+ *
+ *   - Space is divided by a binary tree over the bounding box of the path vertices, split at the middle along x,
+ *     y, z in turn. A leaf is split when it receives more training samples than split_samples, so the tree is
+ *     finest where most paths go.
+ *   - Every leaf stores a directional distribution over the sphere: a grid of direction_bins x direction_bins bins
+ *     over (cos theta, phi), which is an equal-area mapping, so every bin covers the same solid angle.
+ *   - Rendering is split into iterations that double in length (they end when passes 1, 2, 4, 8, ... start). During
+ *     an iteration paths sample from the distributions learned in the previous iterations and record the radiance
+ *     they find into training bins. When the iteration ends, a new tree is built from the training data.
+ *
+ * A tree is read and trained by every render thread at the same time. The sampling distributions never change once
+ * the tree is built, and training only adds to atomic counters, so no locks are needed. Tiles hold a reference to
+ * the tree they started with, so a tree that is replaced stays alive until its last tile finishes (samples that are
+ * recorded after the new tree was built are lost, which only wastes a little training data).
+ *
+ * The guided directions are combined with cosine sampling (with probability guided_fraction each path vertex
+ * samples the learned distribution), and the combined density is used for the BRDF weight and for multiple
+ * importance sampling with the environment, so the image stays unbiased whatever the tree has learned. Since the
+ * tree depends on the order in which threads finish their samples, guided images are not bit-for-bit reproducible.
+ */
+class guide_tree {
+public:
+    static constexpr int direction_bins = 16;                   // bins along cos(theta) and along phi
+    static constexpr int bin_count = direction_bins * direction_bins;
+    static constexpr int split_samples = 4000;                  // training samples that make a leaf split
+    static constexpr int min_samples = 64;                      // fewest samples a distribution is learned from
+    static constexpr int max_depth = 24;
+    static constexpr int max_leaves = 8192;
+    static constexpr double guided_fraction = 0.5;
+    static constexpr double uniform_fraction = 0.1;             // part of every learned distribution that is uniform
+
+    // an empty tree (used for the first iteration, which only learns the bounding box of the scene)
+    guide_tree() = default;
+
+    // the tree for the next iteration, built from the training data of this one
+    std::shared_ptr<guide_tree> refine() const;
+
+    // index of the leaf that contains p (-1 while the tree is empty)
+    int leaf_at(const point3& p) const;
+
+    // true if the leaf has a learned distribution (otherwise only cosine sampling is used)
+    bool trained(int leaf) const { return leaf >= 0 && m_leaves[leaf].trained; }
+
+    // sample a direction from the leaf's distribution and return its density (per solid angle)
+    vec3 sample(int leaf, rng& gen, double& pdf) const;
+    double pdf(int leaf, const vec3& dir) const;
+
+    // record the radiance that arrived from direction dir (divided by the density it was sampled with)
+    void record(int leaf, const vec3& dir, double weighted_radiance);
+
+    // grow the bounding box of the path vertices (the box the next tree is built in)
+    void include(const point3& p);
+
+    size_t leaf_count() const { return m_leaf_count; }
+
+private:
+    struct node {
+        int child = -1;                     // index of the first of two children (-1 for a leaf)
+        int leaf = -1;                      // index into m_leaves (leaves only)
+    };
+    struct leaf_data {
+        float pdf[bin_count];               // probability of each bin (zero while untrained)
+        float cdf[bin_count];               // running sum of pdf (for sampling)
+        bool trained = false;
+        std::atomic<float> flux[bin_count]; // training: sum of recorded radiance per bin
+        std::atomic<uint32_t> samples;      // training: number of recorded samples
+    };
+
+    point3 m_lo, m_hi;                      // box of the root node
+    std::vector<node> m_nodes;
+    std::unique_ptr<leaf_data[]> m_leaves;
+    size_t m_leaf_count = 0;
+    std::atomic<double> m_bound_lo[3] = { INFINITY, INFINITY, INFINITY };
+    std::atomic<double> m_bound_hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+
+    static int bin_of(const vec3& dir);
+};
+
+/*
+ * The guiding state of one render job: the current tree, replaced whenever an iteration ends. The job's scheduler
+ * calls pass_started() for every new pass, and every tile reads current() once before it traces its paths.
+ */
+class path_guide {
+public:
+    path_guide() : m_tree(std::make_shared<guide_tree>()) {}
+
+    std::shared_ptr<guide_tree> current() const { return m_tree.load(); }
+
+    void pass_started(int pass);
+
+    int iterations() const { return m_iterations; }
+
+private:
+    std::atomic<std::shared_ptr<guide_tree>> m_tree;
+    std::atomic<int> m_iterations = 0;
+};
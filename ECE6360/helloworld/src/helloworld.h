@@ -14,10 +14,50 @@
 // used to time events (currently only the main loop is timed)
 #include <chrono>
 
+// the image version counter is shared between the renderer and the user interface
+#include <atomic>
+#include <memory>
+#include <string>
+
 extern float* output_image_ptr;
 extern int resolution;
+extern int image_width;
+extern int image_height;
 extern float frame_seconds;
+extern std::atomic<bool> fast_math;
+extern struct fast_math_error fast_math_bound;
+extern class environment_map environment;
+extern bool idle_mode;
+extern std::atomic<unsigned int> image_version;
+extern bool track_viewport;
+extern float view_zoom;
+extern std::shared_ptr<class render_job> current_render;
+extern class scene world;
+template <typename T> class snapshot_store;
+extern snapshot_store<class scene> scene_versions;
+extern std::unique_ptr<class renderer> image_renderer;
+extern struct render_settings render_options;
+extern struct render_focus output_focus;
+extern size_t last_update_pixels;
+extern class latency_tracker render_latency;
+extern std::string scene_filename;
+extern std::string scene_status;
+extern std::string trace_filename;
+extern class frame_cache rendered_frames;
+extern bool output_frame_cached;
 
 void ImGuiRender();
 void DrawOutputImage();
-void UpdateOutputTexture();
\ No newline at end of file
+void UpdateOutputTexture(int x0, int y0, int x1, int y1);
+int ResidentTileCount();
+void ResetOutputBlocks();
+void MarkOutputBlocks(int x0, int y0, int x1, int y1, unsigned int version);
+void DrawSquare();
+void UpdateScene();
+void CancelRender();
+void FocusRender(const struct render_focus& focus);
+void PublishImage(int x0 = 0, int y0 = 0, int x1 = 1 << 30, int y1 = 1 << 30);
+void RequestRedraw();
+void ResizeImage(int width, int height);
+void UpdateMedium();
+void UpdateSphere(int index, const struct sphere& s);
\ No newline at end of file
@@ -0,0 +1,345 @@
+#include "isosurface.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+isosurface::isosurface(std::shared_ptr<const volume> vol) : m_vol(std::move(vol)) {
+	timeline::zone zone("octree build");
+
+	// The leaves of the octree are the volume's macrocells, which already store their min/max values
+	octree_level leaves;
+	for (int a = 0; a < 3; a++)
+		leaves.n[a] = m_vol->cells(a);
+	leaves.cell_size = volume::macrocell_size;
+	for (int cz = 0; cz < leaves.n[2]; cz++) {
+		for (int cy = 0; cy < leaves.n[1]; cy++) {
+			for (int cx = 0; cx < leaves.n[0]; cx++) {
+				leaves.min.push_back(m_vol->cell_min(cx, cy, cz));
+				leaves.max.push_back(m_vol->cell_max(cx, cy, cz));
+			}
+		}
+	}
+	m_levels.push_back(std::move(leaves));
+
+	// Every parent stores the range of its (up to) 2 x 2 x 2 children, until a single root node is left
+	while (m_levels.back().n[0] > 1 || m_levels.back().n[1] > 1 || m_levels.back().n[2] > 1) {
+		const octree_level& child = m_levels.back();
+		octree_level parent;
+		for (int a = 0; a < 3; a++)
+			parent.n[a] = (child.n[a] + 1) / 2;
+		parent.cell_size = child.cell_size * 2;
+		parent.min.assign((size_t)parent.n[0] * parent.n[1] * parent.n[2], std::numeric_limits<float>::max());
+		parent.max.assign(parent.min.size(), std::numeric_limits<float>::lowest());
+		for (int z = 0; z < child.n[2]; z++) {
+			for (int y = 0; y < child.n[1]; y++) {
+				for (int x = 0; x < child.n[0]; x++) {
+					size_t c = ((size_t)z * child.n[1] + y) * child.n[0] + x;
+					size_t p = ((size_t)(z / 2) * parent.n[1] + y / 2) * parent.n[0] + x / 2;
+					parent.min[p] = std::min(parent.min[p], child.min[c]);
+					parent.max[p] = std::max(parent.max[p], child.max[c]);
+				}
+			}
+		}
+		m_levels.push_back(std::move(parent));
+	}
+}
+
+bool isosurface::intersect(const ray& r, double tmin, double tmax, double iso_value, hit_record& rec) const {
+	traversal tr;
+	tr.g0 = m_vol->to_grid(r.origin());
+	vec3 spacing = m_vol->spacing();
+	tr.gd = vec3(r.direction().x() / spacing.x(), r.direction().y() / spacing.y(), r.direction().z() / spacing.z());
+	tr.iso = iso_value;
+
+	if (!intersect_node((int)m_levels.size() - 1, 0, 0, 0, tmin, tmax, tr))
+		return false;
+
+	// The surface normal is the gradient of the trilinear field at the hit point, facing the viewer
+	vec3 g = tr.g_hit;
+	int i = std::clamp((int)std::floor(g.x()), 0, m_vol->nx() - 2);
+	int j = std::clamp((int)std::floor(g.y()), 0, m_vol->ny() - 2);
+	int k = std::clamp((int)std::floor(g.z()), 0, m_vol->nz() - 2);
+	double fx = g.x() - i, fy = g.y() - j, fz = g.z() - k;
+	double c[2][2][2];
+	for (int dz = 0; dz < 2; dz++)
+		for (int dy = 0; dy < 2; dy++)
+			for (int dx = 0; dx < 2; dx++)
+				c[dx][dy][dz] = m_vol->voxel(i + dx, j + dy, k + dz);
+	double wx[2] = { 1 - fx, fx }, wy[2] = { 1 - fy, fy }, wz[2] = { 1 - fz, fz };
+	double gx = 0, gy = 0, gz = 0;
+	for (int a = 0; a < 2; a++) {
+		for (int b = 0; b < 2; b++) {
+			gx += (c[1][a][b] - c[0][a][b]) * wy[a] * wz[b];
+			gy += (c[a][1][b] - c[a][0][b]) * wx[a] * wz[b];
+			gz += (c[a][b][1] - c[a][b][0]) * wx[a] * wy[b];
+		}
+	}
+	vec3 gradient(gx / spacing.x(), gy / spacing.y(), gz / spacing.z());
+	if (gradient.length_squared() == 0.0)
+		gradient = -r.direction();
+	vec3 normal = unit_vector(gradient);
+	if (dot(normal, r.direction()) > 0.0)
+		normal = -normal;
+
+	rec.t = tr.t_hit;
+	rec.p = r.at(tr.t_hit);
+	rec.normal = normal;
+	return true;
+}
+
+bool isosurface::clip_box(const vec3& lo, const vec3& hi, const traversal& tr, double& t0, double& t1) const {
+	for (int a = 0; a < 3; a++) {
+		if (tr.gd[a] == 0.0) {
+			if (tr.g0[a] < lo[a] || tr.g0[a] > hi[a])
+				return false;
+			continue;
+		}
+		double inv = 1.0 / tr.gd[a];
+		double ta = (lo[a] - tr.g0[a]) * inv;
+		double tb = (hi[a] - tr.g0[a]) * inv;
+		if (inv < 0.0) std::swap(ta, tb);
+		t0 = std::max(t0, ta);
+		t1 = std::min(t1, tb);
+	}
+	return t0 <= t1;
+}
+
+bool isosurface::intersect_node(int level, int x, int y, int z, double t0, double t1, traversal& tr) const {
+	const octree_level& lvl = m_levels[level];
+	size_t idx = ((size_t)z * lvl.n[1] + y) * lvl.n[0] + x;
+	if (tr.iso < lvl.min[idx] || tr.iso > lvl.max[idx])
+		return false;										// the surface can't pass through this node
+
+	int n[3] = { m_vol->nx(), m_vol->ny(), m_vol->nz() };
+	int xyz[3] = { x, y, z };
+	vec3 lo, hi;
+	for (int a = 0; a < 3; a++) {
+		lo[a] = (double)xyz[a] * lvl.cell_size;
+		hi[a] = (double)std::min((xyz[a] + 1) * lvl.cell_size, n[a] - 1);
+	}
+	if (!clip_box(lo, hi, tr, t0, t1))
+		return false;
+
+	if (level == 0)
+		return intersect_leaf(x, y, z, t0, t1, tr);
+
+	/*
+	 * Visit the children front to back: flipping the bits of the child index for every negative direction component
+	 * orders the children along the ray, so the first child that contains a hit contains the closest hit.
+	 */
+	const octree_level& children = m_levels[level - 1];
+	int mask = (tr.gd.x() < 0.0 ? 1 : 0) | (tr.gd.y() < 0.0 ? 2 : 0) | (tr.gd.z() < 0.0 ? 4 : 0);
+	for (int c = 0; c < 8; c++) {
+		int o = c ^ mask;
+		int cx = 2 * x + (o & 1), cy = 2 * y + ((o >> 1) & 1), cz = 2 * z + ((o >> 2) & 1);
+		if (cx >= children.n[0] || cy >= children.n[1] || cz >= children.n[2])
+			continue;
+		if (intersect_node(level - 1, cx, cy, cz, t0, t1, tr))
+			return true;
+	}
+	return false;
+}
+
+bool isosurface::intersect_leaf(int x, int y, int z, double t0, double t1, traversal& tr) const {
+
+	// Range of voxel cells covered by this macrocell
+	int n[3] = { m_vol->nx(), m_vol->ny(), m_vol->nz() };
+	int xyz[3] = { x, y, z };
+	int first[3], last[3];
+	for (int a = 0; a < 3; a++) {
+		first[a] = xyz[a] * volume::macrocell_size;
+		last[a] = std::min((xyz[a] + 1) * volume::macrocell_size, n[a] - 1) - 1;
+	}
+
+	// 3D-DDA through the voxel cells, starting at the cell containing the entry point
+	vec3 entry = tr.g0 + t0 * tr.gd;
+	int cell[3], step[3];
+	double t_next[3], t_delta[3];
+	for (int a = 0; a < 3; a++) {
+		cell[a] = std::clamp((int)std::floor(entry[a]), first[a], last[a]);
+		if (tr.gd[a] > 0.0) {
+			step[a] = 1;
+			t_next[a] = (cell[a] + 1 - tr.g0[a]) / tr.gd[a];
+			t_delta[a] = 1.0 / tr.gd[a];
+		}
+		else if (tr.gd[a] < 0.0) {
+			step[a] = -1;
+			t_next[a] = (cell[a] - tr.g0[a]) / tr.gd[a];
+			t_delta[a] = -1.0 / tr.gd[a];
+		}
+		else {
+			step[a] = 0;
+			t_next[a] = t_delta[a] = std::numeric_limits<double>::infinity();
+		}
+	}
+
+	double t = t0;
+	while (t < t1) {
+		int a = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+		double t_exit = std::min(t_next[a], t1);
+		if (intersect_cell(cell[0], cell[1], cell[2], t, t_exit, tr))
+			return true;
+		t = t_exit;
+		cell[a] += step[a];
+		if (cell[a] < first[a] || cell[a] > last[a])
+			break;
+		t_next[a] += t_delta[a];
+	}
+	return false;
+}
+
+// product of two polynomials (coefficients in increasing order of degree)
+static void poly_mul(const double* p, int np, const double* q, int nq, double* out) {
+	for (int i = 0; i < np + nq - 1; i++)
+		out[i] = 0.0;
+	for (int i = 0; i < np; i++)
+		for (int j = 0; j < nq; j++)
+			out[i + j] += p[i] * q[j];
+}
+
+bool isosurface::intersect_cell(int i, int j, int k, double t0, double t1, traversal& tr) const {
+	if (t1 <= t0)
+		return false;
+
+	double c[2][2][2];
+	double cmin = std::numeric_limits<double>::max(), cmax = std::numeric_limits<double>::lowest();
+	for (int dz = 0; dz < 2; dz++) {
+		for (int dy = 0; dy < 2; dy++) {
+			for (int dx = 0; dx < 2; dx++) {
+				c[dx][dy][dz] = m_vol->voxel(i + dx, j + dy, k + dz);
+				cmin = std::min(cmin, c[dx][dy][dz]);
+				cmax = std::max(cmax, c[dx][dy][dz]);
+			}
+		}
+	}
+	if (tr.iso < cmin || tr.iso > cmax)
+		return false;
+
+	/*
+	 * Along the ray segment, parameterized by u in [0, 1], the cell-local coordinates are o + u * d. Each trilinear
+	 * weight is linear in u, so interpolating along x, then y, then z produces a cubic polynomial in u.
+	 */
+	double len = t1 - t0;
+	vec3 o = tr.g0 + t0 * tr.gd - vec3(i, j, k);
+	vec3 d = len * tr.gd;
+	double wx[2][2] = { { 1 - o.x(), -d.x() }, { o.x(), d.x() } };
+	double wy[2][2] = { { 1 - o.y(), -d.y() }, { o.y(), d.y() } };
+	double wz[2][2] = { { 1 - o.z(), -d.z() }, { o.z(), d.z() } };
+
+	double quad[2][3];
+	for (int dz = 0; dz < 2; dz++) {
+		double lin[2][2];
+		for (int dy = 0; dy < 2; dy++) {
+			lin[dy][0] = c[0][dy][dz] * wx[0][0] + c[1][dy][dz] * wx[1][0];
+			lin[dy][1] = c[0][dy][dz] * wx[0][1] + c[1][dy][dz] * wx[1][1];
+		}
+		double a[3], b[3];
+		poly_mul(lin[0], 2, wy[0], 2, a);
+		poly_mul(lin[1], 2, wy[1], 2, b);
+		for (int e = 0; e < 3; e++)
+			quad[dz][e] = a[e] + b[e];
+	}
+	double a[4], b[4], f[4];
+	poly_mul(quad[0], 3, wz[0], 2, a);
+	poly_mul(quad[1], 3, wz[1], 2, b);
+	for (int e = 0; e < 4; e++)
+		f[e] = a[e] + b[e];
+	f[0] -= tr.iso;
+
+	auto eval = [&](double u) { return ((f[3] * u + f[2]) * u + f[1]) * u + f[0]; };
+
+	// The first root inside the segment is the hit (one Newton step cleans up the round-off of the closed form)
+	double roots[3];
+	int count = solve_cubic(f[3], f[2], f[1], f[0], roots);
+	const double eps = 1e-9;
+	double u_hit = -1.0;
+	for (int r = 0; r < count; r++) {
+		if (roots[r] >= -eps && roots[r] <= 1.0 + eps) {
+			u_hit = std::clamp(roots[r], 0.0, 1.0);
+			break;
+		}
+	}
+
+	// Nearly degenerate polynomials can lose a root to round-off, so a sign change is bisected as a fallback
+	if (u_hit < 0.0) {
+		double lo = 0.0, hi = 1.0, flo = eval(lo);
+		if (flo * eval(hi) > 0.0)
+			return false;
+		for (int it = 0; it < 40; it++) {
+			double mid = 0.5 * (lo + hi), fmid = eval(mid);
+			if ((fmid <= 0.0) == (flo <= 0.0)) { lo = mid; flo = fmid; }
+			else hi = mid;
+		}
+		u_hit = 0.5 * (lo + hi);
+	}
+	else {
+		double df = (3.0 * f[3] * u_hit + 2.0 * f[2]) * u_hit + f[1];
+		if (df != 0.0)
+			u_hit = std::clamp(u_hit - eval(u_hit) / df, 0.0, 1.0);
+	}
+
+	tr.t_hit = t0 + u_hit * len;
+	tr.g_hit = tr.g0 + tr.t_hit * tr.gd;
+	return true;
+}
+
+int solve_cubic(double a3, double a2, double a1, double a0, double roots[3]) {
+	double scale = std::max({ std::fabs(a3), std::fabs(a2), std::fabs(a1), std::fabs(a0) });
+	if (scale == 0.0)
+		return 0;
+	const double tiny = 1e-12 * scale;
+
+	// Degenerate cases: quadratic and linear equations
+	if (std::fabs(a3) < tiny) {
+		if (std::fabs(a2) < tiny) {
+			if (std::fabs(a1) < tiny)
+				return 0;
+			roots[0] = -a0 / a1;
+			return 1;
+		}
+		double disc = a1 * a1 - 4.0 * a2 * a0;
+		if (disc < 0.0)
+			return 0;
+		// this form avoids the cancellation in (-b + sqrt(disc)) when b is large
+		double q = -0.5 * (a1 + std::copysign(std::sqrt(disc), a1));
+		roots[0] = q / a2;
+		if (q == 0.0)
+			return 1;
+		roots[1] = a0 / q;
+		if (roots[0] > roots[1])
+			std::swap(roots[0], roots[1]);
+		return 2;
+	}
+
+	// Normalize and substitute s = y - b / 3 to get the depressed cubic y^3 + p y + q = 0
+	double b = a2 / a3, c = a1 / a3, d = a0 / a3;
+	double p = c - b * b / 3.0;
+	double q = 2.0 * b * b * b / 27.0 - b * c / 3.0 + d;
+	double shift = -b / 3.0;
+	double disc = q * q / 4.0 + p * p * p / 27.0;
+
+	int count;
+	if (disc > 0.0) {
+		// one real root (Cardano's formula)
+		double sq = std::sqrt(disc);
+		roots[0] = std::cbrt(-q / 2.0 + sq) + std::cbrt(-q / 2.0 - sq) + shift;
+		count = 1;
+	}
+	else if (p == 0.0) {
+		roots[0] = shift;									// triple root
+		count = 1;
+	}
+	else {
+		// three real roots (trigonometric method)
+		const double pi = 3.14159265358979323846;
+		double m = 2.0 * std::sqrt(-p / 3.0);
+		double theta = std::acos(std::clamp(3.0 * q / (p * m), -1.0, 1.0)) / 3.0;
+		for (int r = 0; r < 3; r++)
+			roots[r] = m * std::cos(theta - 2.0 * pi * r / 3.0) + shift;
+		count = 3;
+	}
+	std::sort(roots, roots + count);
+	return count;
+}
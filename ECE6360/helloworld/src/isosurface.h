@@ -0,0 +1,56 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "ray.h"
+#include "scene.h"
+#include "vec3.h"
+#include "volume.h"
+
+/*
+ * Direct ray casting of an isosurface of a volume (the surface where the trilinearly interpolated field equals the
+ * iso-value). No triangle mesh is extracted: rays are intersected with the field itself, so changing the iso-value
+ * only requires tracing the rays again.
+ *
+ * A min/max octree is built on top of the volume's macrocells. Its leaves are the macrocells, and every parent
+ * stores the range of its 2 x 2 x 2 children. Rays visit the octree front to back and skip any node whose range
+ * doesn't contain the iso-value. Inside a leaf the ray steps through the individual voxel cells, and for each cell
+ * that can contain the surface the field along the ray (a cubic polynomial in t) is solved analytically.
+ */
+class isosurface {
+public:
+    explicit isosurface(std::shared_ptr<const volume> vol);
+
+    // closest intersection with the iso-value surface in [tmin, tmax] (the ray direction must be unit length)
+    bool intersect(const ray& r, double tmin, double tmax, double iso_value, hit_record& rec) const;
+
+    int levels() const { return (int)m_levels.size(); }
+
+private:
+    struct octree_level {
+        int n[3] = { 0, 0, 0 };             // number of nodes along each axis
+        int cell_size = 0;                  // width of a node in voxels
+        std::vector<float> min, max;
+    };
+
+    std::shared_ptr<const volume> m_vol;
+    std::vector<octree_level> m_levels;     // level 0 holds the macrocells, the last level is the root
+
+    // state shared by the recursive traversal of a single ray
+    struct traversal {
+        vec3 g0;                            // ray origin in grid coordinates
+        vec3 gd;                            // ray direction in grid coordinates (t is still the world distance)
+        double iso = 0.0;
+        double t_hit = 0.0;
+        vec3 g_hit;
+    };
+
+    bool intersect_node(int level, int x, int y, int z, double t0, double t1, traversal& tr) const;
+    bool intersect_leaf(int x, int y, int z, double t0, double t1, traversal& tr) const;
+    bool intersect_cell(int i, int j, int k, double t0, double t1, traversal& tr) const;
+    bool clip_box(const vec3& lo, const vec3& hi, const traversal& tr, double& t0, double& t1) const;
+};
+
+// real roots of a3 s^3 + a2 s^2 + a1 s + a0 = 0 in ascending order (returns the number of roots)
+int solve_cubic(double a3, double a2, double a1, double a0, double roots[3]);
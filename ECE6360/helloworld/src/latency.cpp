@@ -0,0 +1,112 @@
+#include "latency.h"
+#include "renderer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+void latency_histogram::add(double seconds) {
+	int bucket = 0;
+	if (seconds > min_seconds)
+		bucket = std::min(bucket_count - 1, (int)std::floor(std::log2(seconds / min_seconds) * buckets_per_octave));
+	m_buckets[bucket]++;
+	m_count++;
+	m_last = seconds;
+	m_max = std::max(m_max, seconds);
+}
+
+void latency_histogram::clear() {
+	*this = latency_histogram();
+}
+
+double latency_histogram::bucket_edge(int i) {
+	return min_seconds * std::exp2((double)i / buckets_per_octave);
+}
+
+double latency_histogram::percentile(double p) const {
+	if (m_count == 0)
+		return 0.0;
+	size_t rank = std::max<size_t>(1, (size_t)std::ceil(p * m_count));
+	size_t seen = 0;
+	for (int i = 0; i < bucket_count; i++) {
+		seen += m_buckets[i];
+		if (seen >= rank)
+			return std::min(bucket_edge(i + 1), m_max);
+	}
+	return m_max;
+}
+
+void latency_histogram::print(std::ostream& out, const std::string& name) const {
+	out << name << ": " << m_count << " samples";
+	if (m_count == 0) {
+		out << "\n";
+		return;
+	}
+	char line[160];
+	std::snprintf(line, sizeof(line), ", p50 %.1f ms, p95 %.1f ms, p99 %.1f ms, max %.1f ms\n", percentile(0.5) * 1000.0,
+		percentile(0.95) * 1000.0, percentile(0.99) * 1000.0, m_max * 1000.0);
+	out << line;
+
+	unsigned int largest = *std::max_element(m_buckets.begin(), m_buckets.end());
+	for (int i = 0; i < bucket_count; i++) {
+		if (m_buckets[i] == 0)
+			continue;
+		int bar = (int)std::ceil(40.0 * m_buckets[i] / largest);
+		std::snprintf(line, sizeof(line), "  %9.2f - %9.2f ms %6u ", bucket_edge(i) * 1000.0, bucket_edge(i + 1) * 1000.0,
+			m_buckets[i]);
+		out << line << std::string(bar, '#') << "\n";
+	}
+}
+
+void latency_tracker::input() {
+	if (!m_input_pending) {
+		m_input_pending = true;
+		m_input = clock::now();
+	}
+}
+
+void latency_tracker::render_started() {
+	m_start = clock::now();
+	m_from_input = m_input_pending;
+	m_origin = m_from_input ? m_input : m_start;
+	m_first_tile_ns = 0;
+	m_first_tile_recorded = false;
+	m_converged_recorded = false;
+	m_active = true;
+}
+
+void latency_tracker::tile_published() {
+	// only the first tile counts (the time is offset by 1 ns so that 0 can mean "no tile yet")
+	int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - m_start).count() + 1;
+	int64_t none = 0;
+	m_first_tile_ns.compare_exchange_strong(none, ns);
+}
+
+void latency_tracker::update(const render_job& job) {
+	if (!m_active)
+		return;
+
+	int64_t ns = m_first_tile_ns;
+	if (!m_first_tile_recorded && ns > 0) {
+		clock::time_point first = m_start + std::chrono::nanoseconds(ns - 1);
+		m_first_tile_seconds = std::chrono::duration<double>(first - m_origin).count();
+		start_to_first_tile.add(std::chrono::duration<double>(first - m_start).count());
+		if (m_from_input)
+			input_to_first_tile.add(m_first_tile_seconds);
+		m_first_tile_recorded = true;
+	}
+
+	// a render that is cancelled before its last tile never converges (the render that replaced it is measured instead)
+	if (!m_converged_recorded && job.finished() && job.tiles_done() == job.tile_count()) {
+		m_converged_seconds = std::chrono::duration<double>(m_start - m_origin).count() + job.elapsed_seconds();
+		if (m_from_input)
+			input_to_converged.add(m_converged_seconds);
+		m_converged_recorded = true;
+	}
+}
+
+void latency_tracker::print(std::ostream& out) const {
+	input_to_first_tile.print(out, "Input to first tile");
+	input_to_converged.print(out, "Input to converged image");
+	start_to_first_tile.print(out, "Render start to first tile");
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+class render_job;
+
+/*
+ * A histogram of durations with logarithmically spaced buckets (four per factor of two, so every bucket is about
+ * 19% wider than the one before it), covering 0.1 ms to about 100 s. Latencies span several orders of magnitude, so
+ * linear buckets would either lump every interactive update into the first bucket or need thousands of them.
+ */
+class latency_histogram {
+public:
+    static constexpr int buckets_per_octave = 4;
+    static constexpr int bucket_count = 80;
+    static constexpr double min_seconds = 1e-4;
+
+    void add(double seconds);
+    void clear();
+
+    size_t count() const { return m_count; }
+    double last() const { return m_last; }                  // most recent duration (in seconds)
+    double max() const { return m_max; }
+
+    // duration that fraction p of the measurements didn't exceed (the upper edge of the bucket it falls into)
+    double percentile(double p) const;
+
+    const std::array<unsigned int, bucket_count>& buckets() const { return m_buckets; }
+
+    // lower edge of bucket i in seconds (everything shorter than min_seconds is counted in bucket 0)
+    static double bucket_edge(int i);
+
+    // write the non-empty buckets as a text histogram, one bucket per line
+    void print(std::ostream& out, const std::string& name) const;
+
+private:
+    std::array<unsigned int, bucket_count> m_buckets{};
+    size_t m_count = 0;
+    double m_last = 0.0;
+    double m_max = 0.0;
+};
+
+/*
+ * Measures what the user actually waits for, instead of how long one pass through the main loop takes: the time
+ * from an input event to the first rendered tile of the image it causes, and to the finished (converged) image.
+ * Renders that aren't caused by input (a scene file reload, the first render) are measured from the time they
+ * start.
+ *
+ * Input events are timestamped as they arrive. A render that is started in the same pass through the main loop as
+ * the input is attributed to the earliest of those events, since that is how long the user has been waiting.
+ * Everything is called from the main thread except tile_published(), which render threads call.
+ */
+class latency_tracker {
+public:
+    using clock = std::chrono::steady_clock;
+
+    latency_histogram input_to_first_tile;      // includes the time the input waited for the UI to handle it
+    latency_histogram input_to_converged;
+    latency_histogram start_to_first_tile;      // every render, including the ones not caused by input
+
+    // an input event arrived (called from the GLFW callbacks)
+    void input();
+
+    // a new pass through the main loop starts (input from earlier passes has either started a render or not)
+    void new_frame() { m_input_pending = false; }
+
+    // a render of the output image is starting
+    void render_started();
+
+    // a tile of the current render was finished (called by render threads)
+    void tile_published();
+
+    // record the first tile and the convergence of the current render once they happen
+    void update(const render_job& job);
+
+    // seconds since the last render started, or -1 if it hasn't reached that point yet
+    double first_tile_seconds() const { return m_first_tile_recorded ? m_first_tile_seconds : -1.0; }
+    double converged_seconds() const { return m_converged_recorded ? m_converged_seconds : -1.0; }
+    bool from_input() const { return m_from_input; }
+
+    // write all of the histograms as text
+    void print(std::ostream& out) const;
+
+private:
+    bool m_input_pending = false;
+    clock::time_point m_input;                  // first input event of the current pass through the main loop
+
+    bool m_active = false;                      // a render has been started
+    bool m_from_input = false;                  // the current render was started by input
+    clock::time_point m_origin;                 // input event (or render start) the latencies are measured from
+    clock::time_point m_start;
+    std::atomic<int64_t> m_first_tile_ns = 0;   // time of the first tile since m_start (0 until there is one)
+
+    bool m_first_tile_recorded = false;
+    bool m_converged_recorded = false;
+    double m_first_tile_seconds = 0.0;
+    double m_converged_seconds = 0.0;
+};
@@ -30,44 +30,137 @@
 
 #include "ray.h"
 #include "vec3.h"
-
+#include "fastmath.h"
+#include "environment.h"
+#include "camera.h"
+#include "scene.h"
+#include "renderer.h"
+#include "isosurface.h"
+#include "medium.h"
+#include "tubes.h"
+#include "sdf.h"
+#include "scene_file.h"
+#include "snapshot.h"
+#include "latency.h"
+#include "allocation.h"
+#include "trace.h"
+#include "frame_cache.h"
+
+#include <algorithm>
+#include <atomic>
 #include <cmath>
-
-int resolution = 500;					// resolution of the output image (you can add a user interface element to change this)
-float* output_image_ptr = nullptr;		// pointer to the output image data (if you change the resolution make sure to change this!)
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+int resolution = 500;					// resolution of the output image when it isn't tracking the viewport size
+int image_width = resolution;			// actual size of the output image in pixels
+int image_height = resolution;
+float* output_image_ptr = nullptr;		// pointer to the output image data (use ResizeImage() to change the size)
 float frame_seconds = 0.0f;		// time it takes to go through the main "game" loop (directly translates to frame rate or fps)
+std::atomic<bool> fast_math = false;		// use the approximate rsqrt/sqrt functions in fastmath.h (only changed while nothing renders)
+fast_math_error fast_math_bound;		// measured error bound of the fast math functions (displayed in the user interface)
+environment_map environment;			// background seen by rays that miss the scene (HDR map or the baked sky gradient)
+bool idle_mode = true;					// sleep until there is input or a new image instead of redrawing the UI continuously
+std::atomic<unsigned int> image_version = 0;	// incremented every time the renderer publishes new pixels
+bool track_viewport = false;			// render at exactly the size of the ImGui viewport instead of resolution x resolution
+
+// number of UI frames that still have to be drawn after the last input event (ImGui needs a few to settle)
+int ui_frames_pending = 0;
+const int ui_frames_after_input = 3;
+
+// longest time the main loop sleeps in idle mode before checking for new pixels anyway
+const double idle_timeout_seconds = 0.25;
+
+/*
+ * Tell the main loop that the pixels [x0, x1) x [y0, y1) of the output image (all of it by default) have changed. This
+ * can be called from any thread: glfwPostEmptyEvent() wakes the main loop up if it is currently sleeping in
+ * glfwWaitEventsTimeout().
+ */
+void PublishImage(int x0, int y0, int x1, int y1) {
+	MarkOutputBlocks(x0, y0, x1, y1, ++image_version);
+	glfwPostEmptyEvent();
+}
 
-// camera parameters
-auto focal_length = 1.0;
-auto viewport_height = 2.0;
-auto viewport_width = 2.0;
-point3 camera_center = point3(0, 0, 0);
+// Keep the UI drawing for a few frames (called for every input event, and whenever the UI has to catch up)
+void RequestRedraw() {
+	ui_frames_pending = ui_frames_after_input;
+}
+
+// time from input events to the images they cause (shown in the UI)
+latency_tracker render_latency;
+
+// file the timeline of zones is written to (--trace FILE, or the Save Trace button)
+std::string trace_filename = "trace.json";
+
+// Called by every GLFW input callback below: the event is timestamped and the UI is redrawn until it reflects it
+void NoteInput() {
+	render_latency.input();
+	RequestRedraw();
+}
+
+/*
+ * Register callbacks that note any input event. These have to be installed before ImGui is initialized, because
+ * ImGui saves the existing callbacks and chains to them from its own, so both ImGui and this program see the events.
+ */
+void InstallRedrawCallbacks(GLFWwindow* window) {
+	glfwSetCursorPosCallback(window, [](GLFWwindow*, double, double) { NoteInput(); });
+	glfwSetMouseButtonCallback(window, [](GLFWwindow*, int, int, int) { NoteInput(); });
+	glfwSetScrollCallback(window, [](GLFWwindow*, double, double) { NoteInput(); });
+	glfwSetKeyCallback(window, [](GLFWwindow*, int, int, int, int) { NoteInput(); });
+	glfwSetCharCallback(window, [](GLFWwindow*, unsigned int) { NoteInput(); });
+	glfwSetCursorEnterCallback(window, [](GLFWwindow*, int) { NoteInput(); });
+	glfwSetWindowFocusCallback(window, [](GLFWwindow*, int) { NoteInput(); });
+	glfwSetWindowSizeCallback(window, [](GLFWwindow*, int, int) { NoteInput(); });
+	glfwSetWindowRefreshCallback(window, [](GLFWwindow*) { NoteInput(); });
+}
 
-// horizontal and vertical axes
-vec3 viewport_u = vec3(viewport_width, 0, 0);
-vec3 viewport_v = vec3(0, -viewport_height, 0);
+// camera used to render the output image (its image size always matches the output image)
+camera main_camera;
 
-// delta pixel size
-auto pixel_delta_u = viewport_u / resolution;
-auto pixel_delta_v = viewport_v / resolution;
+/*
+ * The scene, the renderer (which owns the render threads), and the render job currently filling the output image.
+ * The user interface edits `world`, which is only ever touched by the main thread. Renders never read it directly:
+ * an edited scene is published as a new immutable version (see UpdateScene()) and every render job pins the version
+ * it started with, so edits don't have to wait for the render threads and never change a scene under them.
+ */
+scene world = scene::default_scene();
+snapshot_store<scene> scene_versions;
+std::unique_ptr<renderer> image_renderer;
+std::shared_ptr<render_job> current_render;
+render_settings render_options;			// preview or progressive path tracing (and the sample counts)
+std::vector<int> output_objects;		// object seen by each pixel of the output image (recorded by the preview renderer)
+render_focus output_focus;				// which tiles of the output image are rendered first (updated by the image viewer)
+size_t last_update_pixels = 0;			// number of pixels re-rendered by the last object edit (shown in the UI)
 
-// view port upper left corner
-point3 viewport_upper_left = camera_center - viewport_u / 2 - viewport_v / 2 - vec3(0, 0, focal_length);
+/*
+ * Finished output images are kept in a cache keyed by everything that determines them, so switching back to a view
+ * or a setting that was already rendered shows the old image instead of rendering it again.
+ */
+frame_cache rendered_frames;
+uint64_t output_frame_key = 0;			// key of the image the current render produces
+bool output_frame_cached = false;		// the output image came from the cache, or has been stored in it
+bool output_objects_valid = false;		// output_objects was restored from the cache along with the output image
 
-// Pixel 0, 0
-auto pixel00_loc = viewport_upper_left + 0.5 * (pixel_delta_u + pixel_delta_v);
+// scene file given on the command line, watched for changes so that edits show up without restarting
+std::string scene_filename;
+scene_description loaded_scene;
+std::unique_ptr<file_watcher> scene_watcher;
+std::string scene_status;				// result of the last (re)load (shown in the UI)
 
 /*
  * Create a placeholder image that's simple, but looks interesting enough so that you know the code is working correctly.
  */
 void DummyImage() {
-	for (int yi = 0; yi < resolution; yi++) {							// iterate through each pixel in the image
-		for (int xi = 0; xi < resolution; xi++) {
-			float r = (float)xi / (float)resolution;					// calculate red, green, and blue values that depend on pixel position
-			float g = (float)yi / (float)resolution;
-			float b = (float)(resolution - xi) / (float)resolution;
+	for (int yi = 0; yi < image_height; yi++) {							// iterate through each pixel in the image
+		for (int xi = 0; xi < image_width; xi++) {
+			float r = (float)xi / (float)image_width;					// calculate red, green, and blue values that depend on pixel position
+			float g = (float)yi / (float)image_height;
+			float b = (float)(image_width - xi) / (float)image_width;
 
-			int idx = yi * resolution * 4 + xi * 4;						// calculate the starting position for the current pixel
+			size_t idx = ((size_t)yi * image_width + xi) * 4;			// calculate the starting position for the current pixel
 			output_image_ptr[idx + 0] = r;								// update the red, green, blue, and alpha channels in the image
 			output_image_ptr[idx + 1] = g;
 			output_image_ptr[idx + 2] = b;
@@ -76,74 +169,559 @@ void DummyImage() {
 	}
 }
 
-double HitSphere(const point3& s, float r, const ray& rt) {
-	auto p = rt.origin();
-	auto v = rt.direction();
+// Called by a render thread after every finished tile of the output image (only the textures it covers are uploaded again)
+void OutputTileDone(const render_tile& tile) {
+	render_latency.tile_published();
+	PublishImage(tile.x0, tile.y0, tile.x1, tile.y1);
+}
+
+/*
+ * Hash of everything the output image depends on: the scene version (every edit publishes a new one), the camera,
+ * the image size, and the render settings. The environment map is loaded once at startup, so it isn't included.
+ */
+uint64_t FrameKey() {
+	frame_key key;
+	key.add(scene_versions.version()).add(image_width).add(image_height).add(fast_math.load());
+	for (const vec3& v : { main_camera.center, main_camera.look_at, main_camera.vup })
+		key.add(v.x()).add(v.y()).add(v.z());
+	key.add(main_camera.focal_length).add(main_camera.viewport_height);
+	key.add(render_options.mode);
+	if (render_options.mode == render_settings::path_tracing)			// the preview ignores the sample counts
+		key.add(render_options.samples_per_pixel).add(render_options.samples_per_pass).add(render_options.max_depth)
+			.add(render_options.guiding).add(render_options.photons).add(render_options.radiance_cache)
+			.add(render_options.resampling);
+	return key.value();
+}
+
+/*
+ * Store the output image in the frame cache once its render has finished every tile. Only the preview records which
+ * object each pixel sees, so the object map is stored with preview frames only.
+ */
+void CacheFinishedFrame() {
+	if (output_frame_cached || !current_render || !current_render->finished() ||
+		current_render->tiles_done() != current_render->tile_count())
+		return;
+	bool preview = render_options.mode == render_settings::preview && !output_objects.empty();
+	rendered_frames.store(output_frame_key, output_image_ptr, preview ? output_objects.data() : nullptr, image_width,
+		image_height, image_renderer->pool());
+	output_frame_cached = true;
+}
 
-	auto a = dot(v, v);
-	auto b = 2.0 * dot(v, s-p);
-	auto c = dot(s - p, s - p) - r * r;
+/*
+ * Render the output image. The render runs in the background on the renderer's thread pool, and every finished tile
+ * is published so that the image fills in while the user interface stays responsive. Any render that is still running
+ * is cancelled first, since its tiles would overwrite the new image. An image that is in the frame cache is shown
+ * without rendering anything.
+ */
+void DrawSquare() {
+	CancelRender();
+	output_frame_key = FrameKey();
+	output_frame_cached = rendered_frames.fetch(output_frame_key, output_image_ptr, output_objects.data(), image_width,
+		image_height, image_renderer->pool(), &output_objects_valid);
+	if (output_frame_cached) {
+		current_render.reset();
+		last_update_pixels = 0;
+		PublishImage();
+		return;
+	}
+	std::vector<render_view> views = { render_view{ main_camera, output_image_ptr, output_objects.data() } };
+	render_latency.render_started();
+	current_render = image_renderer->start(scene_versions.pin(), views, render_options, OutputTileDone, output_focus);
+	last_update_pixels = (size_t)image_width * image_height;
+}
 
-	auto h = b * b - 4 * a * c;
+/*
+ * Replace spheres (given as pairs of index and new sphere, an index equal to the number of spheres adds a new one)
+ * and re-render only the pixels that the edits can change. In the preview every pixel only depends on its primary
+ * ray, so the pixels that change are the ones that saw an edited sphere before the edit (found in the pixel -> object
+ * map recorded by the last render) and the ones that can see it afterwards (inside the projection of its new
+ * bounding box). Everything else keeps its color.
+ *
+ * Path traced pixels depend on shadows and reflections from anywhere in the scene, and an incomplete image has an
+ * incomplete object map, so in those cases the whole image is rendered again. An image restored from the frame cache
+ * has a complete map if it was stored with one.
+ */
+void UpdateSpheres(const std::vector<std::pair<int, sphere>>& edits) {
+	bool finished = output_objects_valid || (current_render && current_render->tiles_done() == current_render->tile_count());
+	bool map_valid = finished && render_options.mode == render_settings::preview && !output_objects.empty();
+	for (const auto& [index, s] : edits) {
+		if (index >= (int)world.spheres.size())
+			world.spheres.push_back(s);
+		else
+			world.spheres[index] = s;
+	}
+	if (!map_valid) {
+		UpdateScene();
+		return;
+	}
 
-	if (h < 0)
-	{
-		return -1.0;
+	static std::vector<unsigned char> mask;
+	mask.assign((size_t)image_width * image_height, 0);
+	for (const auto& [index, s] : edits) {
+		// conservative screen rectangle of the sphere's bounding box (the whole image if part of it is behind the camera)
+		double x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+		bool visible = true;
+		for (int corner = 0; corner < 8; corner++) {
+			vec3 offset((corner & 1) ? s.radius : -s.radius, (corner & 2) ? s.radius : -s.radius, (corner & 4) ? s.radius : -s.radius);
+			double x, y;
+			if (!main_camera.project(s.center + offset, x, y)) {
+				visible = false;
+				break;
+			}
+			x0 = std::min(x0, x); x1 = std::max(x1, x);
+			y0 = std::min(y0, y); y1 = std::max(y1, y);
+		}
+		int rx0 = visible ? std::max(0, (int)std::floor(x0) - 1) : 0;
+		int ry0 = visible ? std::max(0, (int)std::floor(y0) - 1) : 0;
+		int rx1 = visible ? std::min(image_width - 1, (int)std::ceil(x1) + 1) : image_width - 1;
+		int ry1 = visible ? std::min(image_height - 1, (int)std::ceil(y1) + 1) : image_height - 1;
+
+		for (int yi = 0; yi < image_height; yi++) {
+			for (int xi = 0; xi < image_width; xi++) {
+				size_t p = (size_t)yi * image_width + xi;
+				bool inside = xi >= rx0 && xi <= rx1 && yi >= ry0 && yi <= ry1;
+				mask[p] |= inside || output_objects[p] == index;
+			}
+		}
 	}
+	size_t dirty = 0;
+	for (unsigned char m : mask)
+		dirty += m;
+
+	// the pixels outside of the mask are kept, so the previous job has to stop writing them before the new one starts
+	CancelRender();
+	render_view view{ main_camera, output_image_ptr, output_objects.data(), mask.data() };
+	std::shared_ptr<const scene> version = scene_versions.publish(world);
+	output_frame_key = FrameKey();
+	output_frame_cached = false;
+	output_objects_valid = false;
+	render_latency.render_started();
+	current_render = image_renderer->start(std::move(version), { view }, render_options, OutputTileDone, output_focus);
+	last_update_pixels = dirty;
+}
+
+// Publish the edited scene as a new version and render it
+void UpdateScene() {
+	allocation_tracker::scope phase(allocation_tracker::scene);
+	scene_versions.publish(world);
+	DrawSquare();
+}
 
-	return (b - std::sqrt(h)) / (2.0 * a);
+// Replace sphere `index` (or add a new sphere if index is the number of spheres)
+void UpdateSphere(int index, const sphere& s) {
+	UpdateSpheres({ { index, s } });
 }
 
-// r(t) = a + t*b
-// s(t) = (s - a)(s - a) - r^2 = 0
+/*
+ * Load the scene file given with --scene. Its spheres replace the scene's spheres and its segments are drawn as
+ * tubes. The description is kept so that ReloadScene() can tell what changed when the file is saved again.
+ */
+void LoadScene(const std::string& filename) {
+	loaded_scene = scene_description::load(filename);
+	scene_filename = filename;
+	world.materials = loaded_scene.materials;
+	world.spheres = loaded_scene.spheres;
+	world.tubes = loaded_scene.make_tubes();
+	scene_watcher = std::make_unique<file_watcher>(filename);
+	scene_status = "loaded " + std::to_string(loaded_scene.spheres.size()) + " spheres, " +
+		std::to_string(loaded_scene.segments.size()) + " segments";
+}
 
-color RayColor(const ray& r) {
-	auto t = HitSphere(point3(0, 0, -1), 0.5, r);
-	
-	if (t > 0.0) {
-		vec3 normal = unit_vector(r.at(t) - point3(0, 0, -1));
-		return 0.5 * (normal + 1.0);
+/*
+ * Reload the scene file after it was saved and apply only the differences to the scene. Moved spheres are
+ * re-rendered with UpdateSpheres(), which only touches the pixels they cover. Moved tube segments are written into
+ * the existing BVH, which is refit instead of rebuilt (only subtrees that became too loose are rebuilt). Anything
+ * else, like removed objects or changed materials, replaces that part of the scene and renders the whole image.
+ * A file that can't be parsed (often because it is saved halfway through an edit) is reported and the current scene
+ * is kept.
+ */
+void ReloadScene() {
+	allocation_tracker::scope phase(allocation_tracker::scene);
+	scene_description next;
+	try {
+		next = scene_description::load(scene_filename);
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Scene not reloaded: " << e.what() << std::endl;
+		scene_status = e.what();
+		return;
+	}
+	scene_changes changes = scene_changes::diff(loaded_scene, next);
+	loaded_scene = next;
+	if (changes.empty())
+		return;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	bool full = changes.materials || changes.spheres_removed;
+	world.materials = next.materials;
+	if (changes.spheres_removed)
+		world.spheres = next.spheres;
+
+	int rebuilt = 0;
+	bool tubes_changed = !changes.segments.empty() || changes.tube_shape;
+	if (changes.segment_count || (tubes_changed && (!world.tubes || world.tubes->segment_count() != next.segments.size()))) {
+		world.tubes = next.make_tubes();
+		full = true;
+	}
+	else if (tubes_changed) {
+		// older scene versions may still be rendering with the current tubes, so the update is applied to a copy
+		auto tubes = std::make_shared<tube_set>(*world.tubes);
+		rebuilt = tubes->update(changes.segments);
+		tubes->shape = next.tube_shape;
+		world.tubes = tubes;
+		full = true;
 	}
 
-	// BlendedValue = (1-a)*StartValue + a*EndValue
-	auto unit_direction = unit_vector(r.direction());
+	if (full) {
+		for (const auto& [index, s] : changes.spheres) {
+			if (index >= (int)world.spheres.size())
+				world.spheres.push_back(s);
+			else
+				world.spheres[index] = s;
+		}
+		UpdateScene();
+	}
+	else {
+		UpdateSpheres(changes.spheres);
+	}
 
-	auto a = 0.5 * (unit_direction.y() + 1.0);
+	std::chrono::duration<double, std::milli> update = std::chrono::high_resolution_clock::now() - start;
+	scene_status = "reloaded: " + std::to_string(changes.spheres.size()) + " spheres, " +
+		std::to_string(changes.segments.size()) + " segments changed (" + std::to_string(rebuilt) +
+		" subtrees rebuilt, " + std::to_string((int)std::ceil(update.count())) + " ms)";
+}
 
-	auto start_color = color(1.0, 1.0, 1.0);		// white
-	auto end_color = color(0.5, 0.7, 1.0);		// light blue
+/*
+ * Rebuild the participating medium (and its majorant grid) from the scene volume after the volume, density, or
+ * albedo changes. The old medium stays alive as long as a scene version that is still rendering uses it.
+ */
+void UpdateMedium() {
+	world.fog = world.vol ? std::make_shared<medium>(world.vol, world.medium_density, world.medium_albedo) : nullptr;
+}
 
-	return (1.0 - a) * start_color + a * end_color;
+/*
+ * Change which tiles are rendered first. The tiles of the current render that haven't been started yet are reordered,
+ * so zooming into a part of the image that is still rendering moves that part to the front of the queue.
+ */
+void FocusRender(const render_focus& focus) {
+	if (focus == output_focus)
+		return;
+	output_focus = focus;
+	if (current_render && !current_render->finished())
+		current_render->prioritize(output_focus);
 }
 
-void DrawSquare() {
-	for (int yi = 0; yi < resolution; yi++) {							// iterate through each pixel in the image
-		for (int xi = 0; xi < resolution; xi++) {
-			auto pixel_center = pixel00_loc + xi * pixel_delta_u + yi * pixel_delta_v;
-			auto ray_direction = pixel_center - camera_center;
-			ray r = ray(camera_center, ray_direction);
-
-			auto pixel = RayColor(r);
-
-			int idx = yi * resolution * 4 + xi * 4;						// calculate the starting position for the current pixel
-			output_image_ptr[idx + 0] = pixel.x();						// update the red
-			output_image_ptr[idx + 1] = pixel.y();
-			output_image_ptr[idx + 2] = pixel.z();
-			output_image_ptr[idx + 3] = 1.0f;
-		}
+// Stop the background render (if there is one) and wait for its threads to let go of the output image
+void CancelRender() {
+	if (current_render) {
+		current_render->cancel();
+		current_render->wait();
 	}
 }
 
 void DrawSphere() {
-	for (int yi = 0; yi < resolution; yi++) {							// iterate through each pixel in the image
-		for (int xi = 0; xi < resolution; xi++) {
+	for (int yi = 0; yi < image_height; yi++) {							// iterate through each pixel in the image
+		for (int xi = 0; xi < image_width; xi++) {
+
+		}
+	}
+}
+
+/*
+ * Change the size of the output image: this re-allocates the image on the heap, updates the camera so that the
+ * viewport matches the new aspect ratio, and renders the image again. Sizes are clamped to at least one pixel.
+ */
+void ResizeImage(int width, int height) {
+	width = std::max(width, 1);
+	height = std::max(height, 1);
+	if (output_image_ptr != nullptr && width == image_width && height == image_height)
+		return;
+
+	CancelRender();
+	delete[] output_image_ptr;
+	image_width = width;
+	image_height = height;
+	output_image_ptr = new float[(size_t)image_width * image_height * 4];
+	output_objects.assign((size_t)image_width * image_height, render_view::no_object);
+	ResetOutputBlocks();
+
+	main_camera.image_width = image_width;
+	main_camera.image_height = image_height;
+	main_camera.initialize();
 
+	DrawSquare();
+}
+
+/*
+ * Build the cameras for a multi-view render. Supported view sets are:
+ *   orbit:N  N cameras evenly spaced on a circle around the scene (for multi-view figures)
+ *   stereo   a left/right eye pair separated horizontally
+ *   cube     the six faces of a cube map centered at the main camera (90 degree field of view each)
+ */
+std::vector<camera> MakeViewSet(const std::string& name, int size) {
+	std::vector<camera> cameras;
+	camera base = main_camera;
+	base.image_width = size;
+	base.image_height = size;
+
+	if (name.rfind("orbit:", 0) == 0) {
+		int n = std::max(1, std::stoi(name.substr(6)));
+		double radius = (base.center - base.look_at).length();
+		for (int i = 0; i < n; i++) {
+			double angle = 2.0 * environment_map::pi * i / n;
+			camera c = base;
+			c.center = base.look_at + radius * vec3(std::sin(angle), 0.0, std::cos(angle));
+			cameras.push_back(c);
+		}
+	}
+	else if (name == "stereo") {
+		const double eye_separation = 0.065;
+		for (double side : { -0.5, 0.5 }) {
+			camera c = base;
+			c.center = base.center + vec3(side * eye_separation, 0.0, 0.0);
+			c.look_at = base.look_at + vec3(side * eye_separation, 0.0, 0.0);
+			cameras.push_back(c);
+		}
+	}
+	else if (name == "cube") {
+		const vec3 directions[6] = { vec3(1, 0, 0), vec3(-1, 0, 0), vec3(0, 1, 0), vec3(0, -1, 0), vec3(0, 0, 1), vec3(0, 0, -1) };
+		const vec3 ups[6] = { vec3(0, 1, 0), vec3(0, 1, 0), vec3(0, 0, -1), vec3(0, 0, 1), vec3(0, 1, 0), vec3(0, 1, 0) };
+		for (int i = 0; i < 6; i++) {
+			camera c = base;
+			c.look_at = base.center + directions[i];
+			c.vup = ups[i];
+			c.focal_length = 1.0;
+			c.viewport_height = 2.0;
+			cameras.push_back(c);
 		}
 	}
+	else {
+		throw std::runtime_error("Unknown view set " + name + " (expected orbit:N, stereo, or cube)");
+	}
+
+	for (camera& c : cameras)
+		c.initialize();
+	return cameras;
+}
+
+// Write a view to its file once the event says that its last tile is finished
+static task<void> WriteWhenRendered(async_event& rendered, std::string filename, const float* pixels, int size) {
+	co_await rendered;
+	co_await image_renderer->write_image_async(std::move(filename), pixels, size, size);
+}
+
+// Render every view in one job, and set the event of a view when the last of its tile passes is finished
+static task<void> RenderViews(std::shared_ptr<const scene> scene_version, std::vector<render_view> views,
+	std::vector<std::atomic<size_t>>& remaining, async_event* rendered) {
+	co_await image_renderer->render_async(std::move(scene_version), std::move(views), render_options,
+		[&remaining, rendered](const render_tile& tile) {
+			if (--remaining[tile.view] == 0)
+				rendered[tile.view].set();
+		});
+}
+
+/*
+ * Render a set of views without opening a window and save each one as <prefix>_<index>.ppm. All of the views are
+ * rendered as a single job: they share the scene and the thread pool, and the tiles from all views are scheduled
+ * together so the threads stay busy until the last tile of the last view is finished.
+ *
+ * Writing the files is a second stage of tasks that overlaps with the render: the job counts the finished tiles of
+ * every view, and a view is queued for writing on the pool as soon as all of its tile passes are done. Threads that
+ * run out of tiles near the end of the job pick up the writes, so the render threads never wait for the disk.
+ */
+static task<void> RenderViewPipeline(std::shared_ptr<const scene> scene_version, std::vector<render_view> views,
+	std::vector<std::string> filenames, int size) {
+	size_t tiles = (size_t)(size + renderer::tile_size - 1) / renderer::tile_size;
+	std::vector<std::atomic<size_t>> remaining(views.size());
+	for (std::atomic<size_t>& r : remaining)
+		r = tiles * tiles * render_options.passes();
+	std::unique_ptr<async_event[]> rendered = std::make_unique<async_event[]>(views.size());
+
+	std::vector<task<void>> stages;
+	for (size_t i = 0; i < views.size(); i++)
+		stages.push_back(WriteWhenRendered(rendered[i], filenames[i], views[i].pixels, size));
+	stages.push_back(RenderViews(std::move(scene_version), views, remaining, rendered.get()));
+	co_await WhenAll(std::move(stages));
+}
+
+void RenderViewSet(const std::string& name, int size, const std::string& prefix) {
+	std::vector<camera> cameras = MakeViewSet(name, size);
+	std::vector<std::vector<float>> images(cameras.size(), std::vector<float>((size_t)size * size * 4));
+
+	std::vector<render_view> views;
+	std::vector<std::string> filenames;
+	for (size_t i = 0; i < cameras.size(); i++) {
+		views.push_back(render_view{ cameras[i], images[i].data() });
+		char filename[512];
+		std::snprintf(filename, sizeof(filename), "%s_%02d.ppm", prefix.c_str(), (int)i);
+		filenames.push_back(filename);
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+	SyncWait(RenderViewPipeline(scene_versions.pin(), views, filenames, size));
+	std::chrono::duration<float> duration = std::chrono::high_resolution_clock::now() - start;
+	std::cout << "Rendered and saved " << views.size() << " views in " << duration.count() * 1000 << "ms using "
+		<< image_renderer->thread_count() << " threads" << std::endl;
 }
 
 int main(int argc, const char* argv[]) {
 
+	/*
+	 * Command line options:
+	 *   --env sky.hdr          use an HDR latitude-longitude image as the environment
+	 *   --views SET            render a set of views (orbit:N, stereo, or cube) to PPM files and exit without a window
+	 *   --view-size N          size of each view in pixels (default 512)
+	 *   --output PREFIX        file name prefix of the rendered views (default "view")
+	 *   --volume FILE          render a raw scalar volume named like "name_256x256x256_uint8.raw" (or "procedural", "smoke")
+	 *   --iso VALUE            render the isosurface of the volume at VALUE (in [0, 1]) instead of the whole volume
+	 *   --medium DENSITY       path trace the volume as a participating medium with the given density
+	 *   --path-trace SPP       path trace the image with SPP samples per pixel instead of showing the preview
+	 *   --guiding              learn where the light comes from while path tracing and sample those directions
+	 *   --photons N            trace N photons per pass through glass spheres to render their caustics
+	 *   --radiance-cache N     end paths after N bounces with the light cached for the surface they reach
+	 *   --restir               resample the direct light with reservoirs reused between pixels and passes
+	 *   --fast-math            normalize and intersect spheres with the approximate rsqrt/sqrt functions (see fastmath.h)
+	 *   --fibers FILE          draw polylines ("x y z" per line, blank lines between polylines) as tubes (or "procedural")
+	 *   --fiber-radius R       radius of the tubes (default 0.002)
+	 *   --cylinders            draw the tube segments as flat-capped cylinders instead of capsules
+	 *   --sdf                  replace the default sphere with a demo of implicit (signed distance field) surfaces
+	 *   --scene FILE           load spheres and tube segments from a scene file, and reload it whenever it is saved
+	 *   --check-allocations    abort if the per-pixel render path allocates memory (needs HELLOWORLD_TRACK_ALLOCATIONS)
+	 *   --frame-cache MB       memory budget of the cache of finished output images (default 256, 0 turns it off)
+	 *   --frame-cache-dir DIR  write images evicted from the frame cache to DIR instead of dropping them
+	 *   --trace FILE           record a timeline of the render, BVH builds, uploads and UI, and write it to FILE at exit
+	 *                          as a Chrome trace (open it in chrome://tracing or https://ui.perfetto.dev)
+	 */
+	std::string env_filename;
+	std::string view_set;
+	std::string view_prefix = "view";
+	std::string volume_filename;
+	std::string fibers_filename;
+	std::string scene_file;
+	bool check_allocations = false;
+	bool write_trace = false;
+	double fiber_radius = 0.002;
+	int tube_shape = tube_set::capsule;
+	int view_size = 512;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--env" && i + 1 < argc)
+			env_filename = argv[++i];
+		else if (arg == "--views" && i + 1 < argc)
+			view_set = argv[++i];
+		else if (arg == "--view-size" && i + 1 < argc)
+			view_size = std::max(1, std::atoi(argv[++i]));
+		else if (arg == "--output" && i + 1 < argc)
+			view_prefix = argv[++i];
+		else if (arg == "--volume" && i + 1 < argc)
+			volume_filename = argv[++i];
+		else if (arg == "--iso" && i + 1 < argc) {
+			world.volume_mode = scene::volume_isosurface;
+			world.iso_value = std::atof(argv[++i]);
+		}
+		else if (arg == "--medium" && i + 1 < argc) {
+			world.volume_mode = scene::volume_medium;
+			world.medium_density = std::atof(argv[++i]);
+		}
+		else if (arg == "--fibers" && i + 1 < argc)
+			fibers_filename = argv[++i];
+		else if (arg == "--fiber-radius" && i + 1 < argc)
+			fiber_radius = std::atof(argv[++i]);
+		else if (arg == "--cylinders")
+			tube_shape = tube_set::cylinder;
+		else if (arg == "--sdf") {
+			world.sdf = sdf_scene::demo();
+			world.spheres.clear();
+		}
+		else if (arg == "--scene" && i + 1 < argc)
+			scene_file = argv[++i];
+		else if (arg == "--check-allocations") {
+			check_allocations = true;
+			allocation_tracker::fail_on_pixel_allocation(true);
+		}
+		else if (arg == "--frame-cache" && i + 1 < argc)
+			rendered_frames.set_memory_budget((size_t)std::max(0, std::atoi(argv[++i])) << 20);
+		else if (arg == "--frame-cache-dir" && i + 1 < argc)
+			rendered_frames.set_spill_directory(argv[++i]);
+		else if (arg == "--trace" && i + 1 < argc) {
+			trace_filename = argv[++i];
+			write_trace = true;
+			timeline::enable(true);
+			timeline::name_thread("main");
+		}
+		else if (arg == "--guiding")
+			render_options.guiding = true;
+		else if (arg == "--photons" && i + 1 < argc)
+			render_options.photons = std::max(0, std::atoi(argv[++i]));
+		else if (arg == "--radiance-cache" && i + 1 < argc)
+			render_options.radiance_cache = std::max(0, std::atoi(argv[++i]));
+		else if (arg == "--restir")
+			render_options.resampling = true;
+		else if (arg == "--fast-math")
+			fast_math = true;
+		else if (arg == "--path-trace" && i + 1 < argc) {
+			render_options.mode = render_settings::path_tracing;
+			render_options.samples_per_pixel = std::max(1, std::atoi(argv[++i]));
+		}
+	}
+
+	/*
+	 * The background is either an HDR latitude-longitude image passed on the command line (--env sky.hdr) or the
+	 * procedural sky gradient blended from white at the bottom to light blue at the top, baked into the same
+	 * format so that both can be importance sampled.
+	 */
+	if (env_filename.empty())
+		environment = environment_map::gradient(512, 256, color(1.0, 1.0, 1.0), color(0.5, 0.7, 1.0));
+	else
+		environment = environment_map::load_hdr(env_filename);
+
+	// Start the render threads (one per hardware thread)
+	image_renderer = std::make_unique<renderer>();
+
+	// A volume replaces the default sphere (the volume file is memory-mapped, so only the parts that are needed are read)
+	if (!volume_filename.empty()) {
+		if (volume_filename == "procedural")
+			world.vol = volume::procedural(256, image_renderer->pool());
+		else if (volume_filename == "smoke")
+			world.vol = volume::procedural_smoke(128, image_renderer->pool());
+		else
+			world.vol = volume::load_raw(volume_filename, image_renderer->pool());
+		world.iso = std::make_shared<isosurface>(world.vol);
+		UpdateMedium();
+		world.spheres.clear();
+	}
+
+	// Streamlines are drawn as tubes directly from their segments (there is no triangle mesh)
+	if (!fibers_filename.empty()) {
+		if (fibers_filename == "procedural")
+			world.tubes = tube_set::procedural_fibers(3000, 200, fiber_radius);
+		else
+			world.tubes = tube_set::load_polylines(fibers_filename, fiber_radius);
+		world.tubes->shape = tube_shape;
+		world.spheres.clear();
+	}
+
+	if (!scene_file.empty())
+		LoadScene(scene_file);
+
+	// the scene is complete, so it becomes the first version that renders see
+	scene_versions.publish(world);
+
+	// Batch rendering doesn't need a window, the user interface, or even a graphics card
+	if (!view_set.empty()) {
+		RenderViewSet(view_set, view_size, view_prefix);
+		if (fast_math) {
+			fast_math_error bound = measure_fast_math_error();
+			std::cout << "Fast math max relative error: rsqrt " << bound.rsqrt << ", sqrt " << bound.sqrt << ", normalize "
+				<< bound.normalize << ", packed rsqrt " << bound.rsqrt4 << std::endl;
+		}
+		if (check_allocations)
+			allocation_tracker::print(std::cout);
+		if (write_trace)
+			timeline::write_chrome_trace(trace_filename);
+		return 0;
+	}
+
 	/*
 	* GLFW is the window manager that we will be using. Its job is to create
 	* an "OpenGL context", which is a region of the screen that is used as
@@ -175,6 +753,9 @@ int main(int argc, const char* argv[]) {
 	*/
 	glfwMakeContextCurrent(window);
 
+	// Watch for input events so that idle mode knows when the user interface has to be redrawn
+	InstallRedrawCallbacks(window);
+
 	/*
 	* Now we're going to initialize the ImGui library. This is a really cool library that
 	* uses OpenGL (or any graphics API) to render standard graphical user interface components.
@@ -208,10 +789,6 @@ int main(int argc, const char* argv[]) {
 		throw std::runtime_error("Failed to initialize GLEW");
 
 
-	/*
-	 * Allocate space on the heap to store the image that will be displayed on the screen.
-	 */
-	output_image_ptr = new float[resolution * resolution * 4];
 
 	/*
 	 * This function creates a placeholder image so that you see a result on the screen the first time you run it.
@@ -220,7 +797,13 @@ int main(int argc, const char* argv[]) {
 	 */
 	// DummyImage();
 
-	DrawSquare();
+	// Measure how far the fast math approximations can deviate from the exact functions so the user knows the cost of enabling them
+	fast_math_bound = measure_fast_math_error();
+
+	/*
+	 * Allocate space on the heap to store the image that will be displayed on the screen and render it.
+	 */
+	ResizeImage(resolution, resolution);
 
 
 	/*
@@ -230,17 +813,50 @@ int main(int argc, const char* argv[]) {
 	* keyboard, etc.) and updates variables based on callback functions that you define. This loop runs
 	* continuously until you kill the program (ex. by pressing the X button to close the window).
 	*/
+	unsigned int drawn_image_version = 0;
+	ui_frames_pending = ui_frames_after_input;
 	while (!glfwWindowShouldClose(window)) {
-		auto start = std::chrono::high_resolution_clock::now();
 
-		// This function checks potential input sources (keyboard, mouse, etc.) and executes callback functions
-		glfwPollEvents();
+		/*
+		 * This function checks potential input sources (keyboard, mouse, etc.) and executes callback functions.
+		 * In idle mode the thread sleeps until an event arrives (or the renderer posts one) instead of spinning
+		 * through the loop, which would keep a CPU core and the GPU busy redrawing an image that hasn't changed.
+		 */
+		render_latency.new_frame();
+		if (idle_mode)
+			glfwWaitEventsTimeout(idle_timeout_seconds);
+		else
+			glfwPollEvents();
+
+		// Note when the current render shows its first tile and when it has converged
+		if (current_render)
+			render_latency.update(*current_render);
+		CacheFinishedFrame();
+
+		// Apply edits to the scene file (the render it starts publishes an image, so the frame below isn't skipped)
+		if (scene_watcher && scene_watcher->changed())
+			ReloadScene();
+
+		// Skip the frame if there hasn't been any input and the renderer hasn't published new pixels
+		unsigned int current_image_version = image_version;
+		if (idle_mode && ui_frames_pending == 0 && current_image_version == drawn_image_version)
+			continue;
+		drawn_image_version = current_image_version;
+		if (ui_frames_pending > 0)
+			ui_frames_pending--;
+
+		timeline::zone frame_zone("frame");
+		auto start = std::chrono::high_resolution_clock::now();
 
 		// This function tells OpenGL to clear the window (in this case it writes the color "black" to all pixels)
 		glClear(GL_COLOR_BUFFER_BIT);
 
 		// This function is defined in the helloworld_gui.cpp file and renders the user interface
-		ImGuiRender();
+		{
+			timeline::zone zone("ImGui");
+			allocation_tracker::scope phase(allocation_tracker::interface);
+			ImGuiRender();
+		}
 
 		/*
 		* This function takes advantage of a concept called "double buffering". There is a region
@@ -251,7 +867,10 @@ int main(int argc, const char* argv[]) {
 		* computer monitor. This function switches the memory pointers so that the information on the monitor
 		* is updated immediately.
 		*/
-		glfwSwapBuffers(window);                    // swap the double buffer
+		{
+			timeline::zone zone("swap");
+			glfwSwapBuffers(window);                // swap the double buffer
+		}
 
 		auto end = std::chrono::high_resolution_clock::now();
 		std::chrono::duration<float> duration = end - start;
@@ -262,9 +881,13 @@ int main(int argc, const char* argv[]) {
 	* All of these functions just destroy the stuff that we've created to make sure that there aren't any
 	* memory leaks.
 	*/
+	CancelRender();									// Stop the background render before the output image is freed
+	if (write_trace)
+		timeline::write_chrome_trace(trace_filename);
 	ImGui_ImplOpenGL3_Shutdown();					// Shut down ImGui's connection with OpenGL
 	ImGui_ImplGlfw_Shutdown();						// Shut down ImGui's connection with GLFW
 	ImGui::DestroyContext();                        // Clear the ImGui user interface
 	glfwDestroyWindow(window);                      // Destroy the GLFW rendering window
 	glfwTerminate();                                // Terminate GLFW
+	delete[] output_image_ptr;                      // Free the output image
 }
\ No newline at end of file
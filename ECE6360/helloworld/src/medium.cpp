@@ -0,0 +1,118 @@
+#include "medium.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+medium::medium(std::shared_ptr<const volume> vol, double density, const color& albedo)
+	: m_vol(std::move(vol)), m_density(density), m_albedo(albedo) {
+	timeline::zone zone("majorant grid build");
+
+	// The macrocell maxima bound the trilinear field inside each cell, so scaling them gives a valid majorant
+	for (int a = 0; a < 3; a++)
+		m_n[a] = m_vol->cells(a);
+	m_majorant.resize((size_t)m_n[0] * m_n[1] * m_n[2]);
+	for (int z = 0; z < m_n[2]; z++)
+		for (int y = 0; y < m_n[1]; y++)
+			for (int x = 0; x < m_n[0]; x++)
+				m_majorant[((size_t)z * m_n[1] + y) * m_n[0] + x] = m_density * m_vol->cell_max(x, y, z);
+}
+
+template <typename F>
+void medium::traverse(const ray& r, double t0, double t1, F&& segment) const {
+	double b0, b1;
+	if (!m_vol->intersect_box(r, b0, b1))
+		return;
+	t0 = std::max(t0, b0);
+	t1 = std::min(t1, b1);
+	if (t0 >= t1)
+		return;
+
+	// Same 3D-DDA as the volume renderer, in grid coordinates with t measured in world units
+	const int size = volume::macrocell_size;
+	vec3 spacing = m_vol->spacing();
+	vec3 g0 = m_vol->to_grid(r.origin());
+	vec3 gd(r.direction().x() / spacing.x(), r.direction().y() / spacing.y(), r.direction().z() / spacing.z());
+	vec3 entry = g0 + t0 * gd;
+	int cell[3], step[3];
+	double t_next[3], t_delta[3];
+	for (int a = 0; a < 3; a++) {
+		cell[a] = std::clamp((int)std::floor(entry[a] / size), 0, m_n[a] - 1);
+		if (gd[a] > 0.0) {
+			step[a] = 1;
+			t_next[a] = ((cell[a] + 1) * size - g0[a]) / gd[a];
+			t_delta[a] = size / gd[a];
+		}
+		else if (gd[a] < 0.0) {
+			step[a] = -1;
+			t_next[a] = (cell[a] * size - g0[a]) / gd[a];
+			t_delta[a] = -size / gd[a];
+		}
+		else {
+			step[a] = 0;
+			t_next[a] = t_delta[a] = std::numeric_limits<double>::infinity();
+		}
+	}
+
+	double t = t0;
+	while (t < t1) {
+		int a = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+		double t_exit = std::min(t_next[a], t1);
+		double majorant = m_majorant[((size_t)cell[2] * m_n[1] + cell[1]) * m_n[0] + cell[0]];
+		if (majorant > 0.0 && !segment(t, t_exit, majorant))
+			return;
+		t = t_exit;
+		cell[a] += step[a];
+		if (cell[a] < 0 || cell[a] >= m_n[a])
+			return;
+		t_next[a] += t_delta[a];
+	}
+}
+
+bool medium::sample_collision(const ray& r, double tmax, rng& gen, double& t_collision) const {
+	bool collided = false;
+	traverse(r, 0.0, tmax, [&](double t0, double t1, double majorant) {
+		/*
+		 * Sample tentative collisions with the constant majorant of this cell. Exponential distances are memoryless,
+		 * so a tentative collision beyond the cell boundary is simply discarded and sampling continues in the next cell
+		 * with that cell's majorant. A tentative collision is real with probability sigma_t / majorant.
+		 */
+		double t = t0;
+		for (;;) {
+			t -= std::log(1.0 - gen.next()) / majorant;
+			if (t >= t1)
+				return true;								// continue with the next cell
+			if (gen.next() * majorant < sigma_t(r.at(t))) {
+				t_collision = t;
+				collided = true;
+				return false;
+			}
+		}
+	});
+	return collided;
+}
+
+double medium::transmittance(const ray& r, double tmax, rng& gen) const {
+	double T = 1.0;
+	traverse(r, 0.0, tmax, [&](double t0, double t1, double majorant) {
+		// Every tentative collision multiplies the transmittance by the probability that it is a null collision
+		double t = t0;
+		for (;;) {
+			t -= std::log(1.0 - gen.next()) / majorant;
+			if (t >= t1)
+				return true;
+			T *= 1.0 - std::min(1.0, sigma_t(r.at(t)) / majorant);
+
+			// Russian roulette keeps rays through thick media from tracking collisions that barely matter
+			if (T < 0.1) {
+				if (gen.next() < 0.5) {
+					T = 0.0;
+					return false;
+				}
+				T *= 2.0;
+			}
+		}
+	});
+	return T;
+}
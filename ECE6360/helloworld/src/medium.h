@@ -0,0 +1,50 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "ray.h"
+#include "sampling.h"
+#include "vec3.h"
+#include "volume.h"
+
+/*
+ * A participating medium whose extinction is the scene volume scaled by a density, with an isotropic phase function.
+ * Collisions are sampled with delta tracking against a per-macrocell majorant grid (see sample_collision()).
+ */
+class medium {
+public:
+    medium(std::shared_ptr<const volume> vol, double density, const color& albedo);
+
+    double density() const { return m_density; }
+    const color& albedo() const { return m_albedo; }
+
+    // extinction coefficient at a point
+    double sigma_t(const point3& p) const {
+        vec3 g = m_vol->to_grid(p);
+        return m_density * m_vol->sample(g.x(), g.y(), g.z());
+    }
+
+    /*
+     * Delta tracking: sample the distance to the next real collision along a ray with a unit length direction.
+     * Returns false if the ray leaves the medium (or reaches tmax) without colliding.
+     */
+    bool sample_collision(const ray& r, double tmax, rng& gen, double& t_collision) const;
+
+    // Ratio tracking: unbiased estimate of the transmittance between the ray origin and tmax
+    double transmittance(const ray& r, double tmax, rng& gen) const;
+
+private:
+    std::shared_ptr<const volume> m_vol;
+    double m_density;
+    color m_albedo;
+    int m_n[3] = { 0, 0, 0 };               // majorant grid resolution (matches the volume's macrocells)
+    std::vector<double> m_majorant;
+
+    /*
+     * Walk the majorant grid between t0 and t1, calling segment(t_enter, t_exit, majorant) for every cell the ray
+     * passes through. The walk stops early if segment() returns false.
+     */
+    template <typename F>
+    void traverse(const ray& r, double t0, double t1, F&& segment) const;
+};
@@ -0,0 +1,454 @@
+#include "helloworld.h"
+#include "renderer.h"
+#include "environment.h"
+#include "medium.h"
+#include "sampling.h"
+#include "guiding.h"
+#include "photons.h"
+#include "radiance_cache.h"
+#include "restir.h"
+#include "allocation.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+
+/*
+ * Fraction of the light arriving from direction dir at point p that isn't blocked by a surface or absorbed and
+ * scattered away by the participating medium (estimated with ratio tracking, so it is random but unbiased)
+ */
+double Visibility(const point3& p, const vec3& dir, const scene& world, bool use_medium, rng& gen) {
+	ray shadow(p, dir);
+	hit_record rec;
+	if (HitScene(shadow, world, rec))
+		return 0.0;
+	return use_medium ? world.fog->transmittance(shadow, INFINITY, gen) : 1.0;
+}
+
+/*
+ * Next event estimation: sample a direction from the environment map and add its contribution, weighted against
+ * the chance that the scattering direction (with probability density scatter_pdf) would have found it as well.
+ * f_cos is the BSDF or phase function times the cosine term for that direction, and returns zero if the direction
+ * can't be scattered into.
+ */
+template <typename F>
+color SampleEnvironment(const point3& p, const scene& world, bool use_medium, rng& gen, F&& f_cos) {
+	double light_pdf;
+	vec3 dir = environment.sample(gen.next(), gen.next(), light_pdf);
+	if (light_pdf <= 0.0)
+		return color(0, 0, 0);
+	double scatter_pdf;
+	color f = f_cos(dir, scatter_pdf);
+	if (f.x() <= 0.0 && f.y() <= 0.0 && f.z() <= 0.0)
+		return color(0, 0, 0);
+	double visibility = Visibility(p, dir, world, use_medium, gen);
+	if (visibility <= 0.0)
+		return color(0, 0, 0);
+	return visibility * power_heuristic(light_pdf, scatter_pdf) / light_pdf * f * environment.lookup(dir);
+}
+
+/*
+ * Direct light from the environment at a pixel's first surface, chosen by reservoir resampling (see restir.h):
+ * candidates from the environment are merged with the pixel's reservoir and a few neighbors', and the one direction
+ * that is kept gets a shadow ray. Returns the light times the cosine and 1/pi (the caller multiplies by the albedo),
+ * and stores the new reservoir for the pixel's next sample.
+ */
+static color ResampleEnvironment(const point3& p, const vec3& n, double depth, const scene& world, bool use_medium, rng& gen,
+	const direct_reuse& reuse) {
+	auto target = [&](const vec3& dir) {
+		double cos_theta = dot(n, dir);
+		return cos_theta > 0.0 ? luminance(environment.lookup(dir)) * cos_theta : 0.0;
+	};
+
+	light_reservoir r = {};
+	for (int a = 0; a < 3; a++)
+		r.normal[a] = (float)n[a];
+	r.depth = (float)depth;
+	for (int i = 0; i < light_reservoir::candidates; i++) {
+		double light_pdf;
+		vec3 dir = environment.sample(gen.next(), gen.next(), light_pdf);
+		if (light_pdf > 0.0)
+			r.update(dir, target(dir) / light_pdf, gen.next());
+		r.count += 1.0f;
+	}
+
+	// Merging a reservoir weighs its direction by the target here, its contribution weight, and its candidate count
+	auto merge = [&](const light_reservoir& other) {
+		if (!other.similar(n, depth))
+			return;
+		float count = std::min(other.count, light_reservoir::max_history * light_reservoir::candidates);
+		vec3 dir = other.direction();
+		r.update(dir, target(dir) * other.weight * count, gen.next());
+		r.count += count;
+	};
+	merge(*reuse.pixel);
+	for (int i = 0; i < light_reservoir::neighbors; i++) {
+		int x = std::clamp(reuse.x + (int)(gen.next() * (2 * light_reservoir::radius + 1)) - light_reservoir::radius, 0, reuse.tile_width - 1);
+		int y = std::clamp(reuse.y + (int)(gen.next() * (2 * light_reservoir::radius + 1)) - light_reservoir::radius, 0, reuse.tile_height - 1);
+		if (x != reuse.x || y != reuse.y)
+			merge(reuse.previous[y * reuse.tile_width + x]);
+	}
+
+	vec3 dir = r.direction();
+	double t = r.weight_sum > 0.0f ? target(dir) : 0.0;
+	r.weight = t > 0.0 ? (float)(r.weight_sum / (r.count * t)) : 0.0f;
+	*reuse.pixel = r;
+	double visibility = r.weight > 0.0f ? Visibility(p, dir, world, use_medium, gen) : 0.0;
+	if (visibility <= 0.0)
+		return color(0, 0, 0);
+	return visibility * r.weight * dot(n, dir) / pi * environment.lookup(dir);
+}
+
+// Surface vertices of a path, for training the guide and the radiance cache once the path has ended
+struct path_log {
+	// surface vertices to train the guide with (the radiance and throughput when the path left them)
+	struct guide_vertex {
+		int leaf;
+		vec3 dir;
+		double cos_theta;
+		double pdf;
+		color radiance;
+		color throughput;
+	};
+	guide_vertex vertices[32];
+	int vertex_count = 0;
+
+	// surface vertices to add to the radiance cache (the radiance and throughput when the path arrived)
+	struct cache_vertex {
+		uint64_t cell;
+		color radiance;
+		color throughput;
+	};
+	cache_vertex cache_vertices[32];
+	int cache_vertex_count = 0;
+};
+
+// A path between two bounces
+struct path_state {
+	ray current;
+	point3 camera;									// origin of the camera ray (cache cells are sized by the distance to it)
+	color radiance;
+	color throughput;
+	double scatter_pdf;								// zero for camera rays and glass (there is nothing to weight against)
+	bool diffuse;									// the last bounce that wasn't glass was diffuse (with a photon map)
+	bool caustic;									// ... and glass came after it (light the photons carry)
+	bool resampled;									// the last bounce was diffuse and resampled its direct light
+	int depth;
+	rng* gen;
+	direct_reuse reuse;								// reuse.pixel is null without reservoir reuse
+	path_log* log;									// null without a guide tree or a radiance cache
+	hit_record rec;									// the surface the current ray hits
+	double t_collision;								// ... or where it scatters in the medium
+};
+
+// What every path of a render shares
+struct path_context {
+	const scene& world;
+	const render_settings& settings;
+	guide_tree* guide;
+	const photon_map* photons;
+	radiance_cache* cache;
+	bool use_medium;
+};
+
+// What a path runs into at its next bounce (the groups that path_batch shades one after another)
+enum path_group { path_ended = 0, path_medium, path_escaped, path_glass, path_diffuse, path_group_count };
+
+static void StartPath(path_state& p, const ray& r, rng& gen, const direct_reuse* reuse, path_log* log) {
+	p.current = ray(r.origin(), unit_vector(r.direction()));
+	p.camera = r.origin();
+	p.radiance = color(0, 0, 0);
+	p.throughput = color(1, 1, 1);
+	p.scatter_pdf = 0.0;
+	p.diffuse = p.caustic = p.resampled = false;
+	p.depth = 0;
+	p.gen = &gen;
+	p.reuse = reuse ? *reuse : direct_reuse();
+	p.log = log;
+	if (log)
+		log->vertex_count = log->cache_vertex_count = 0;
+}
+
+// Trace the current ray of a path and return the group of its next bounce
+static int NextEvent(path_state& p, const path_context& ctx) {
+	p.rec = hit_record();
+	bool hit = HitScene(p.current, ctx.world, p.rec);
+
+	// Delta tracking decides if the ray scatters in the medium before it reaches the surface
+	if (ctx.use_medium && ctx.world.fog->sample_collision(p.current, hit ? p.rec.t : INFINITY, *p.gen, p.t_collision))
+		return p.depth >= ctx.settings.max_depth ? path_ended : path_medium;
+	if (!hit)
+		return p.caustic || p.resampled ? path_ended : path_escaped;
+	if (p.depth >= ctx.settings.max_depth)
+		return path_ended;
+	const material& m = ctx.world.materials[std::clamp(p.rec.material, 0, (int)ctx.world.materials.size() - 1)];
+	return m.type == material::dielectric ? path_glass : path_diffuse;
+}
+
+static void ShadeMedium(path_state& p, const path_context& ctx) {
+	rng& gen = *p.gen;
+
+	// every collision scatters, and the throughput is weighted by the albedo (the fraction that isn't absorbed)
+	p.throughput = p.throughput * ctx.world.fog->albedo();
+	point3 x = p.current.at(p.t_collision);
+	const double phase = 1.0 / (4.0 * pi);
+	p.radiance += p.throughput * SampleEnvironment(x, ctx.world, ctx.use_medium, gen, [&](const vec3&, double& pdf) {
+		pdf = phase;
+		return color(phase, phase, phase);
+	});
+
+	// the isotropic phase function is sampled exactly, so the throughput doesn't change
+	p.current = ray(x, sample_uniform_sphere(gen.next(), gen.next()));
+	p.scatter_pdf = phase;
+	p.diffuse = p.caustic = p.resampled = false;
+}
+
+static void ShadeEscaped(path_state& p) {
+	vec3 dir = p.current.direction();
+	double weight = p.scatter_pdf > 0.0 ? power_heuristic(p.scatter_pdf, environment.pdf(dir)) : 1.0;
+	p.radiance += weight * p.throughput * environment.lookup(dir);
+}
+
+static void ShadeGlass(path_state& p, const path_context& ctx) {
+	const hit_record& rec = p.rec;
+	const material& m = ctx.world.materials[std::clamp(rec.material, 0, (int)ctx.world.materials.size() - 1)];
+	bool inside;
+	vec3 dir = scatter_dielectric(p.current.direction(), rec.normal, m.ior, p.gen->next(), inside);
+	p.current = ray(rec.p + (inside ? -surface_epsilon : surface_epsilon) * rec.normal, unit_vector(dir));
+	p.throughput = p.throughput * m.albedo;
+	p.scatter_pdf = 0.0;
+	p.caustic = p.diffuse;
+	p.resampled = false;
+}
+
+// Lambertian reflection from the side of the surface the ray arrived from (returns false if the path ends there)
+static bool ShadeDiffuse(path_state& p, const path_context& ctx) {
+	const hit_record& rec = p.rec;
+	const material& m = ctx.world.materials[std::clamp(rec.material, 0, (int)ctx.world.materials.size() - 1)];
+	guide_tree* guide = ctx.guide;
+	rng& gen = *p.gen;
+	vec3 n = dot(rec.normal, p.current.direction()) < 0.0 ? rec.normal : -rec.normal;
+	point3 x = rec.p + surface_epsilon * n;
+
+	// After enough bounces the path ends with the light the cache has learned for this cell
+	if (ctx.cache) {
+		uint64_t cell = radiance_cache::key(rec.p, n, (rec.p - p.camera).length());
+		color cached;
+		if (p.depth >= ctx.settings.radiance_cache && ctx.cache->lookup(cell, cached)) {
+			p.radiance += p.throughput * cached;
+			return false;
+		}
+		if (p.log && p.log->cache_vertex_count < 32)
+			p.log->cache_vertices[p.log->cache_vertex_count++] = path_log::cache_vertex{ cell, p.radiance, p.throughput };
+	}
+	if (ctx.photons) {
+		p.radiance += p.throughput * m.albedo / pi * ctx.photons->irradiance(rec.p, n);
+		p.diffuse = true;
+		p.caustic = false;
+	}
+
+	// A guided bounce picks the learned distribution or the cosine distribution, so its density is the mix
+	int leaf = guide ? guide->leaf_at(x) : -1;
+	if (guide && leaf < 0)
+		guide->include(x);
+	bool guided = guide && guide->trained(leaf);
+	auto surface_pdf = [&](const vec3& dir) {
+		double cos_pdf = std::max(0.0, dot(n, dir)) / pi;
+		if (!guided)
+			return cos_pdf;
+		return guide_tree::guided_fraction * guide->pdf(leaf, dir) + (1.0 - guide_tree::guided_fraction) * cos_pdf;
+	};
+	p.resampled = p.reuse.pixel && p.depth == 0;
+	if (p.resampled) {
+		p.radiance += p.throughput * m.albedo * ResampleEnvironment(x, n, rec.t, ctx.world, ctx.use_medium, gen, p.reuse);
+	}
+	else {
+		p.radiance += p.throughput * SampleEnvironment(x, ctx.world, ctx.use_medium, gen, [&](const vec3& dir, double& pdf) {
+			double cos_theta = std::max(0.0, dot(n, dir));
+			pdf = surface_pdf(dir);
+			return cos_theta / pi * m.albedo;
+		});
+	}
+
+	vec3 dir;
+	if (guided && gen.next() < guide_tree::guided_fraction) {
+		double guide_pdf;
+		dir = guide->sample(leaf, gen, guide_pdf);
+	}
+	else {
+		dir = onb(n).to_world(sample_cosine_hemisphere(gen.next(), gen.next()));
+	}
+	p.scatter_pdf = surface_pdf(dir);
+	if (!guided) {
+		// cosine-weighted sampling cancels the cosine and 1/pi of the BRDF, leaving only the albedo
+		p.throughput = p.throughput * m.albedo;
+	}
+	else {
+		double cos_theta = dot(n, dir);
+		if (cos_theta <= 0.0 || p.scatter_pdf <= 0.0)
+			return false;									// guided into the surface, where the BRDF is zero
+		p.throughput = p.throughput * m.albedo * (cos_theta / pi / p.scatter_pdf);
+	}
+	p.current = ray(x, dir);
+	if (leaf >= 0 && p.log && p.log->vertex_count < 32)
+		p.log->vertices[p.log->vertex_count++] = path_log::guide_vertex{ leaf, dir, dot(n, dir), p.scatter_pdf, p.radiance, p.throughput };
+	return true;
+}
+
+// Russian roulette stops paths that can't contribute much, and boosts the survivors to stay unbiased
+static bool Survive(path_state& p) {
+	if (p.depth >= 3) {
+		double survive = std::min(0.95, std::max({ p.throughput.x(), p.throughput.y(), p.throughput.z() }));
+		if (p.gen->next() >= survive)
+			return false;
+		p.throughput /= survive;
+	}
+	return true;
+}
+
+// Shade the bounce that NextEvent() found (returns false once the path has ended)
+static bool Shade(path_state& p, int group, const path_context& ctx) {
+	bool alive = false;
+	switch (group) {
+	case path_medium:
+		ShadeMedium(p, ctx);
+		alive = Survive(p);
+		break;
+	case path_escaped:
+		ShadeEscaped(p);
+		break;
+	case path_glass:
+		ShadeGlass(p, ctx);
+		alive = true;										// specular bounces don't count toward Russian roulette
+		break;
+	case path_diffuse:
+		alive = ShadeDiffuse(p, ctx) && Survive(p);
+		break;
+	}
+	p.depth++;
+	return alive;
+}
+
+// Train the guide tree and the radiance cache with the vertices of a path that has ended
+static void FinishPath(const path_state& p, const path_context& ctx) {
+	if (!p.log)
+		return;
+
+	/*
+	 * The radiance a vertex received from its scattering direction is what the rest of the path collected, divided
+	 * by the throughput up to (and including) that bounce. It is recorded divided by the density of the direction,
+	 * so that the sum in every bin estimates the radiance from that bin rather than how often it was sampled.
+	 */
+	for (int v = 0; v < p.log->vertex_count; v++) {
+		const path_log::guide_vertex& g = p.log->vertices[v];
+		color incident(0, 0, 0);
+		for (int ch = 0; ch < 3; ch++)
+			incident[ch] = g.throughput[ch] > 0.0 ? (p.radiance[ch] - g.radiance[ch]) / g.throughput[ch] : 0.0;
+		ctx.guide->record(g.leaf, g.dir, luminance(incident) * g.cos_theta / g.pdf);
+	}
+
+	// The light a surface sent back along the path is what the path collected after it, divided by the throughput there
+	for (int v = 0; v < p.log->cache_vertex_count; v++) {
+		const path_log::cache_vertex& c = p.log->cache_vertices[v];
+		color outgoing(0, 0, 0);
+		for (int ch = 0; ch < 3; ch++)
+			outgoing[ch] = c.throughput[ch] > 0.0 ? (p.radiance[ch] - c.radiance[ch]) / c.throughput[ch] : 0.0;
+		ctx.cache->record(c.cell, outgoing);
+	}
+}
+
+/*
+ * Estimate the light arriving along a ray with a unidirectional path tracer. Surfaces are Lambertian, the only light
+ * source is the environment, and the scene volume can act as a participating medium with an isotropic phase function.
+ * At every scattering event the environment is sampled directly, and both strategies (light sampling and scattering
+ * into the environment) are combined with multiple importance sampling so bright and dim maps both converge well.
+ *
+ * Glass reflects or refracts the path; those bounces are perfectly specular, so there is nothing to sample the
+ * environment for (a shadow ray through glass is blocked) and the environment found after them gets full weight.
+ *
+ * With a guide tree (see guiding.h), surface bounces also sample the directions the tree has learned, and every
+ * surface vertex records the radiance the rest of the path found into the tree once the path has ended. With a photon
+ * map (see photons.h), every diffuse surface adds the caustic light of the photons around it, and light that reaches
+ * the environment through glass right after a diffuse bounce is left out, since the photons already carry it.
+ *
+ * With a radiance cache (see radiance_cache.h), a path that reaches a diffuse surface after settings.radiance_cache
+ * bounces ends there with the cached light of the surface's cell (if the cell has learned it), and every diffuse
+ * surface the path visits adds the light it sent back along the path to its cell.
+ *
+ * With reservoir reuse (see restir.h), the direct light at the first surface of a camera ray is resampled instead of
+ * sampled with multiple importance sampling, and the environment that its scattered ray finds is left out.
+ *
+ * A bounce is split into NextEvent() (what the ray runs into) and Shade() (what happens there), so that path_batch
+ * can run the same bounces for a whole tile of paths at once.
+ */
+color PathTrace(const ray& r, const scene& world, const render_settings& settings, rng& gen, guide_tree* guide,
+	const photon_map* photons, radiance_cache* cache, const direct_reuse* reuse) {
+	path_context ctx{ world, settings, guide, photons, cache, world.fog && world.vol && world.volume_mode == scene::volume_medium };
+	path_log log;
+	path_state p;
+	StartPath(p, r, gen, reuse, &log);
+	while (Shade(p, NextEvent(p, ctx), ctx)) {}
+	FinishPath(p, ctx);
+	return p.radiance;
+}
+
+path_batch::path_batch() : m_paths(std::make_unique<path_state[]>(capacity)) {}
+
+path_batch::~path_batch() = default;
+
+path_batch& path_batch::thread(bool logs) {
+	static thread_local std::unique_ptr<path_batch> batch;
+	if (!batch || (logs && !batch->m_logs)) {
+		// allocated once per thread, so the pixels phase still doesn't allocate
+		allocation_tracker::scope phase(allocation_tracker::render_setup);
+		if (!batch)
+			batch.reset(new path_batch());
+		if (logs)
+			batch->m_logs = std::make_unique<path_log[]>(capacity);
+	}
+	return *batch;
+}
+
+void path_batch::start(int i, const ray& r, rng& gen, const direct_reuse* reuse) {
+	StartPath(m_paths[i], r, gen, reuse, m_logs ? &m_logs[i] : nullptr);
+}
+
+const color& path_batch::radiance(int i) const {
+	return m_paths[i].radiance;
+}
+
+void path_batch::trace(int count, const scene& world, const render_settings& settings, guide_tree* guide,
+	const photon_map* photons, radiance_cache* cache) {
+	path_context ctx{ world, settings, guide, photons, cache, world.fog && world.vol && world.volume_mode == scene::volume_medium };
+	int alive = count;
+	for (int i = 0; i < count; i++)
+		m_alive[i] = i;
+
+	while (alive > 0) {
+		// Trace every path that is still going and sort the paths by what they ran into (a counting sort)
+		int group_start[path_group_count + 1] = {};
+		for (int k = 0; k < alive; k++) {
+			m_group[k] = (unsigned char)NextEvent(m_paths[m_alive[k]], ctx);
+			group_start[m_group[k] + 1]++;
+		}
+		int next[path_group_count];
+		for (int g = 0; g < path_group_count; g++) {
+			group_start[g + 1] += group_start[g];
+			next[g] = group_start[g];
+		}
+		for (int k = 0; k < alive; k++)
+			m_sorted[next[m_group[k]]++] = m_alive[k];
+
+		// Shade one group after another, keeping the paths that go on for the next bounce
+		alive = 0;
+		for (int g = 0; g < path_group_count; g++) {
+			for (int k = group_start[g]; k < group_start[g + 1]; k++) {
+				path_state& p = m_paths[m_sorted[k]];
+				if (Shade(p, g, ctx))
+					m_alive[alive++] = m_sorted[k];
+				else
+					FinishPath(p, ctx);
+			}
+		}
+	}
+}
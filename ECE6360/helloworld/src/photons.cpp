@@ -0,0 +1,187 @@
+#include "helloworld.h"
+#include "photons.h"
+#include "renderer.h"
+#include "environment.h"
+#include "sampling.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cmath>
+
+photon_map::photon_map(const scene& world, int photons, int pass, int max_depth)
+	: m_world(&world), m_pass(pass), m_max_depth(max_depth), m_emitted(std::max(photons, 0)) {
+
+	// Bounding sphere of the glass spheres (the photons are aimed at it)
+	point3 lo(INFINITY, INFINITY, INFINITY), hi(-INFINITY, -INFINITY, -INFINITY);
+	bool glass = false;
+	for (const sphere& s : world.spheres) {
+		if (s.material < 0 || s.material >= (int)world.materials.size() || world.materials[s.material].type != material::dielectric)
+			continue;
+		for (int a = 0; a < 3; a++) {
+			lo[a] = std::min(lo[a], s.center[a] - s.radius);
+			hi[a] = std::max(hi[a], s.center[a] + s.radius);
+		}
+		glass = true;
+	}
+	if (glass) {
+		m_center = 0.5 * (lo + hi);
+		for (const sphere& s : world.spheres) {
+			if (s.material >= 0 && s.material < (int)world.materials.size() && world.materials[s.material].type == material::dielectric)
+				m_bound = std::max(m_bound, (s.center - m_center).length() + s.radius);
+		}
+	}
+
+	// Progressive photon mapping: the area of the lookup disk shrinks by (i + alpha) / (i + 1) after pass i
+	double area = initial_radius * initial_radius;
+	for (int i = 1; i <= pass; i++)
+		area *= (i + alpha) / (i + 1);
+	m_radius = std::sqrt(area) * m_bound;
+
+	int batches = glass && m_emitted > 0 ? (m_emitted + batch_size - 1) / batch_size : 0;
+	m_batches.resize(batches);
+	m_built = batches == 0;
+}
+
+void photon_map::build() {
+	for (int b = m_next_batch++; b < (int)m_batches.size(); b = m_next_batch++) {
+		trace_batch(b);
+		bool last;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			last = ++m_batches_done == (int)m_batches.size();
+		}
+		if (last) {
+			build_grid();
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_built = true;
+			}
+			m_built_cv.notify_all();
+		}
+	}
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_built_cv.wait(lock, [this] { return m_built; });
+}
+
+// Trace the photons of one batch from the environment through the glass to the first diffuse surface
+void photon_map::trace_batch(int batch) {
+	timeline::zone zone("photons", batch);
+	const scene& world = *m_world;
+	std::vector<photon>& stored = m_batches[batch];
+	int first = batch * batch_size;
+	int last = std::min(first + batch_size, m_emitted);
+	double disk_area = pi * m_bound * m_bound;
+	for (int i = first; i < last; i++) {
+		rng gen((uint64_t)m_pass, (uint64_t)i, 0, 1);					// pixel samples use d = 0
+
+		// A direction toward the sky, and a point on the disk facing it just outside of the glass
+		double light_pdf;
+		vec3 to_light = environment.sample(gen.next(), gen.next(), light_pdf);
+		if (light_pdf <= 0.0)
+			continue;
+		vec3 dir = -to_light;
+		onb frame(dir);
+		double r = m_bound * std::sqrt(gen.next());
+		double phi = 2.0 * pi * gen.next();
+		point3 origin = m_center - m_bound * dir + frame.to_world(vec3(r * std::cos(phi), r * std::sin(phi), 0.0));
+
+		// the photon only exists if nothing blocks the sky behind the disk
+		hit_record rec;
+		if (HitScene(ray(origin, to_light), world, rec))
+			continue;
+		color power = environment.lookup(to_light) * (disk_area / (light_pdf * m_emitted));
+
+		ray current(origin, dir);
+		bool specular = false;
+		for (int depth = 0; depth <= m_max_depth; depth++) {
+			if (!HitScene(current, world, rec))
+				break;
+			const material& m = world.materials[std::clamp(rec.material, 0, (int)world.materials.size() - 1)];
+			if (m.type != material::dielectric) {
+				if (specular) {
+					photon p;
+					for (int a = 0; a < 3; a++) {
+						p.position[a] = (float)rec.p[a];
+						p.direction[a] = (float)current.direction()[a];
+						p.power[a] = (float)power[a];
+					}
+					stored.push_back(p);
+				}
+				break;
+			}
+			bool inside;
+			vec3 next = scatter_dielectric(current.direction(), rec.normal, m.ior, gen.next(), inside);
+			point3 p = rec.p + (inside ? -surface_epsilon : surface_epsilon) * rec.normal;
+			power = power * m.albedo;
+			current = ray(p, unit_vector(next));
+			specular = true;
+		}
+	}
+}
+
+// Sort the photons of every batch by bucket (a counting sort, so photons of the same bucket end up next to each other)
+void photon_map::build_grid() {
+	size_t count = 0;
+	for (const auto& b : m_batches)
+		count += b.size();
+	uint32_t buckets = 1;
+	while (buckets < count)
+		buckets <<= 1;
+	m_bucket_mask = buckets - 1;
+
+	double cell = 2.0 * m_radius;
+	auto bucket_of = [&](const photon& p) {
+		return bucket((int64_t)std::floor(p.position[0] / cell), (int64_t)std::floor(p.position[1] / cell),
+			(int64_t)std::floor(p.position[2] / cell));
+	};
+	m_bucket_start.assign((size_t)buckets + 1, 0);
+	for (const auto& b : m_batches)
+		for (const photon& p : b)
+			m_bucket_start[bucket_of(p) + 1]++;
+	for (uint32_t i = 0; i < buckets; i++)
+		m_bucket_start[i + 1] += m_bucket_start[i];
+
+	std::vector<uint32_t> next(m_bucket_start.begin(), m_bucket_start.end() - 1);
+	m_photons.resize(count);
+	for (auto& b : m_batches) {
+		for (const photon& p : b)
+			m_photons[next[bucket_of(p)]++] = p;
+		std::vector<photon>().swap(b);							// the batches aren't needed anymore
+	}
+}
+
+uint32_t photon_map::bucket(int64_t x, int64_t y, int64_t z) const {
+	uint64_t h = (uint64_t)x * 73856093ull ^ (uint64_t)y * 19349663ull ^ (uint64_t)z * 83492791ull;
+	return (uint32_t)(hash64(h) & m_bucket_mask);
+}
+
+color photon_map::irradiance(const point3& p, const vec3& n) const {
+	if (m_photons.empty())
+		return color(0, 0, 0);
+
+	// The lookup disk fits in the 2 x 2 x 2 cells starting at the cell of p - radius (cells are two radii wide)
+	double cell = 2.0 * m_radius;
+	int64_t base[3];
+	for (int a = 0; a < 3; a++)
+		base[a] = (int64_t)std::floor((p[a] - m_radius) / cell);
+	uint32_t visited[8];
+	int visited_count = 0;
+	double r2 = m_radius * m_radius;
+	color sum(0, 0, 0);
+	for (int c = 0; c < 8; c++) {
+		uint32_t b = bucket(base[0] + (c & 1), base[1] + ((c >> 1) & 1), base[2] + (c >> 2));
+		if (std::find(visited, visited + visited_count, b) != visited + visited_count)
+			continue;											// two cells that share a bucket are only read once
+		visited[visited_count++] = b;
+		for (uint32_t i = m_bucket_start[b]; i < m_bucket_start[b + 1]; i++) {
+			const photon& ph = m_photons[i];
+			vec3 d(ph.position[0] - p.x(), ph.position[1] - p.y(), ph.position[2] - p.z());
+			if (d.length_squared() > r2)
+				continue;
+			if (ph.direction[0] * n.x() + ph.direction[1] * n.y() + ph.direction[2] * n.z() >= 0.0)
+				continue;										// arrived on the other side of the surface
+			sum += color(ph.power[0], ph.power[1], ph.power[2]);
+		}
+	}
+	return sum / (pi * r2);
+}
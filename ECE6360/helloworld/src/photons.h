@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "vec3.h"
+
+class scene;
+
+/*
+ * Caustics: light that reaches a diffuse surface after being refracted or reflected by glass. A path traced from the
+ * camera can only find it by bouncing off the diffuse surface in exactly the direction that the glass focuses toward
+ * the sky, which almost never happens, so caustics stay noisy for thousands of samples. A photon map traces the same
+ * paths the other way: photons leave the environment toward the glass, follow its reflections and refractions, and
+ * are stored where they land on a diffuse surface. The caustic light at a point is then the power of the photons
+ * within a small radius divided by the area of that disk.
+ *
+ *   - Photons are emitted from a disk facing the bounding sphere of the glass spheres, with directions sampled from
+ *     the environment map, so every photon heads for the glass (other objects only get caustics through spheres).
+ *     Photons that hit a diffuse surface before any glass are dropped, since the path tracer already finds that light.
+ *   - Every pass of a progressive render traces a new set of photons and estimates with a smaller radius
+ *     (progressive photon mapping, Knaus and Zwicker 2011): the radius of pass i shrinks by a factor of
+ *     (i + alpha) / (i + 1) in area, so the average over the passes converges to the right image while only one map
+ *     per pass in flight is ever in memory.
+ *   - The photons of a map are traced in batches by all of the render threads that reach the pass (see build()).
+ *     Each photon has its own random seed, so the map does not depend on which thread traced which batch.
+ *   - Lookups use a hash grid: the photons are sorted by the hash of their grid cell (cells are as large as the
+ *     lookup disk), so a lookup reads the photons of at most 8 cells, each stored contiguously.
+ *
+ * The path tracer adds the photon estimate at every diffuse surface, and ignores light that reaches the environment
+ * through glass right after a diffuse bounce, since that is the light the photons carry (see PathTrace()).
+ */
+class photon_map {
+public:
+    static constexpr int batch_size = 4096;                 // photons traced by one thread at a time
+    static constexpr double initial_radius = 0.02;          // radius of the first pass (relative to the glass bounds)
+    static constexpr double alpha = 2.0 / 3.0;              // fraction of the photons kept by every pass
+
+    // the map of one pass of a render (nothing is traced until build() is called)
+    photon_map(const scene& world, int photons, int pass, int max_depth);
+
+    /*
+     * Trace batches of photons until none are left, then wait for the other threads to finish theirs. Every thread
+     * that needs the map calls this, and the last batch to finish sorts the photons into the grid.
+     */
+    void build();
+
+    // irradiance from the photons within radius() of p that arrived on the side of the surface that n points to
+    color irradiance(const point3& p, const vec3& n) const;
+
+    // true once build() has finished (size() is only meaningful after that)
+    bool built() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_built;
+    }
+
+    size_t size() const { return m_photons.size(); }
+    double radius() const { return m_radius; }
+    int pass() const { return m_pass; }
+
+private:
+    struct photon {
+        float position[3];
+        float direction[3];         // direction the photon was traveling in
+        float power[3];
+    };
+
+    const scene* m_world;
+    int m_pass;
+    int m_max_depth;
+    int m_emitted;                  // photons emitted (including the ones that never reached a diffuse surface)
+    point3 m_center;                // bounding sphere of the glass spheres
+    double m_bound = 0.0;
+    double m_radius = 0.0;
+
+    // tracing
+    std::vector<std::vector<photon>> m_batches;
+    std::atomic<int> m_next_batch = 0;
+    int m_batches_done = 0;
+    bool m_built = false;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_built_cv;
+
+    // hash grid: the photons in bucket b are m_photons[m_bucket_start[b]] ... m_photons[m_bucket_start[b + 1] - 1]
+    std::vector<photon> m_photons;
+    std::vector<uint32_t> m_bucket_start;
+    uint32_t m_bucket_mask = 0;
+
+    void trace_batch(int batch);
+    void build_grid();
+    uint32_t bucket(int64_t x, int64_t y, int64_t z) const;
+};
@@ -0,0 +1,72 @@
+#include "radiance_cache.h"
+#include "sampling.h"
+
+#include <algorithm>
+#include <cmath>
+
+uint64_t radiance_cache::key(const point3& p, const vec3& n, double distance) {
+	// the grid doubles its spacing every time the distance doubles (level 1 ... 63, so that no key is zero)
+	int level = std::clamp((int)std::ceil(std::log2(std::max(distance, 1e-9))) + 32, 1, 63);
+	double size = std::ldexp(cell_size, level - 32);
+
+	// octahedral mapping of the normal, quantized to 4 x 4 directions
+	double l1 = std::fabs(n.x()) + std::fabs(n.y()) + std::fabs(n.z());
+	double u = n.x() / l1, v = n.y() / l1;
+	if (n.z() < 0.0) {
+		double fu = (1.0 - std::fabs(v)) * (u >= 0.0 ? 1.0 : -1.0);
+		double fv = (1.0 - std::fabs(u)) * (v >= 0.0 ? 1.0 : -1.0);
+		u = fu;
+		v = fv;
+	}
+	uint64_t nu = (uint64_t)std::clamp((int)((u + 1.0) * 2.0), 0, 3);
+	uint64_t nv = (uint64_t)std::clamp((int)((v + 1.0) * 2.0), 0, 3);
+
+	// 18 bits per coordinate (cells that are 2^18 apart share a key, which is harmless that far from the camera)
+	uint64_t k = (uint64_t)level << 58 | nu << 56 | nv << 54;
+	for (int a = 0; a < 3; a++)
+		k |= ((uint64_t)(int64_t)std::floor(p[a] / size) & 0x3ffff) << (18 * a);
+	return k;
+}
+
+bool radiance_cache::lookup(uint64_t key, color& radiance) const {
+	size_t start = hash64(key) & (capacity - 1);
+	for (int i = 0; i < max_probes; i++) {
+		const slot& s = m_slots[(start + i) & (capacity - 1)];
+		uint64_t k = s.key.load(std::memory_order_acquire);
+		if (k == 0)
+			return false;
+		if (k != key)
+			continue;
+		uint32_t count = s.count.load(std::memory_order_relaxed);
+		if (count < (uint32_t)min_samples)
+			return false;
+		radiance = color(s.sum[0].load(std::memory_order_relaxed), s.sum[1].load(std::memory_order_relaxed),
+			s.sum[2].load(std::memory_order_relaxed)) / count;
+		return true;
+	}
+	return false;
+}
+
+void radiance_cache::record(uint64_t key, const color& radiance) {
+	size_t start = hash64(key) & (capacity - 1);
+	for (int i = 0; i < max_probes; i++) {
+		slot& s = m_slots[(start + i) & (capacity - 1)];
+		uint64_t k = s.key.load(std::memory_order_acquire);
+		if (k == 0) {
+			// claim the empty slot (if another thread got there first, it may have claimed it for the same cell)
+			if (s.key.compare_exchange_strong(k, key, std::memory_order_acq_rel))
+				m_cells.fetch_add(1, std::memory_order_relaxed);
+			else if (k != key)
+				continue;
+		}
+		else if (k != key) {
+			continue;
+		}
+		if (s.count.load(std::memory_order_relaxed) >= max_samples)
+			return;
+		for (int ch = 0; ch < 3; ch++)
+			s.sum[ch].fetch_add((float)radiance[ch], std::memory_order_relaxed);
+		s.count.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+}
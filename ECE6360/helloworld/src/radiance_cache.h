@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "vec3.h"
+
+/*
+ * A radiance cache: the light leaving diffuse surfaces, averaged over everything the path tracer has found so far and
+ * stored in a hash grid over world space. Paths look it up once they have bounced a few times and end there instead
+ * of tracing the rest of their bounces, so multi-bounce indirect light costs about as much as one or two bounces.
+ * The image is biased (the cached value is an average over a cell rather than the light at the exact point), but the
+ * cache keeps learning from every path while it renders, which is the right trade for interactive previews.
+ *
+ *   - A cell is identified by a 64-bit key: the position quantized to a grid whose spacing grows with the distance
+ *     from the camera in powers of two (so far away cells are larger, like the pixels they cover), the level of that
+ *     grid, and the normal quantized to 16 directions (so the two sides of a thin object don't share a cell).
+ *   - The table is open addressed with linear probing over a fixed number of slots. A slot is claimed by swapping
+ *     its key from zero with compare-and-swap, and radiance is added with atomic adds, so any number of render
+ *     threads can read and update it without locks. The running sum and the sample count are separate atomics, so a
+ *     read can see one sample more in one than the other, which only perturbs the average slightly.
+ *   - When the table is full (every probed slot belongs to another cell), the point is simply not cached.
+ *
+ * Every diffuse surface a path visits before it ends adds the light it sent back along the path to its cell, so cells
+ * near the camera are refined by full paths, and cells that were used to end paths pass their light on to the cells
+ * before them (which is how light of many bounces gets into the cache).
+ */
+class radiance_cache {
+public:
+    static constexpr int capacity = 1 << 19;                // slots in the table (a power of two)
+    static constexpr int max_probes = 8;                    // slots searched for a cell before giving up
+    static constexpr int min_samples = 16;                  // samples a cell needs before paths end in it
+    static constexpr uint32_t max_samples = 1 << 16;        // samples after which a cell stops learning
+    static constexpr double cell_size = 1.0 / 64.0;         // cell size at distance 1 from the camera
+
+    radiance_cache() : m_slots(std::make_unique<slot[]>(capacity)) {}
+
+    // the key of the cell that contains p on a surface with normal n, at a distance from the camera
+    static uint64_t key(const point3& p, const vec3& n, double distance);
+
+    // the average radiance of a cell (false if the cell doesn't exist or has too few samples)
+    bool lookup(uint64_t key, color& radiance) const;
+
+    // add a sample of the radiance leaving a surface in a cell (creating the cell if it doesn't exist)
+    void record(uint64_t key, const color& radiance);
+
+    // number of cells in the table
+    size_t cells() const { return m_cells.load(std::memory_order_relaxed); }
+
+private:
+    struct slot {
+        std::atomic<uint64_t> key = 0;                      // zero for an empty slot
+        std::atomic<float> sum[3] = { 0.0f, 0.0f, 0.0f };
+        std::atomic<uint32_t> count = 0;
+    };
+
+    std::unique_ptr<slot[]> m_slots;
+    std::atomic<size_t> m_cells = 0;
+};
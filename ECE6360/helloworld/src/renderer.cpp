@@ -0,0 +1,691 @@
+#include "helloworld.h"
+#include "renderer.h"
+#include "fastmath.h"
+#include "environment.h"
+#include "isosurface.h"
+#include "tubes.h"
+#include "sdf.h"
+#include "sampling.h"
+#include "allocation.h"
+#include "trace.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <stdexcept>
+
+double HitSphere(const point3& s, float r, const ray& rt, bool fast) {
+	auto p = rt.origin();
+	auto v = rt.direction();
+
+	auto a = dot(v, v);
+	auto b = 2.0 * dot(v, s-p);
+	auto c = dot(s - p, s - p) - r * r;
+
+	auto h = b * b - 4 * a * c;
+
+	if (h < 0)
+	{
+		return -1.0;
+	}
+
+	// a ray that starts inside the sphere (refracted into a glass sphere) hits it where it leaves
+	auto root = fast ? fast_sqrt(h) : std::sqrt(h);
+	auto t = (b - root) / (2.0 * a);
+	return t > 0.0 ? t : (b + root) / (2.0 * a);
+}
+
+// r(t) = a + t*b
+// s(t) = (s - a)(s - a) - r^2 = 0
+
+/*
+ * Find the closest object other than the implicit surfaces (which are traced in packets by HitScene4()). len is the
+ * length of the ray direction, which the callers compute (HitScene4() does it for four rays at once).
+ */
+static bool HitObjects(const ray& r, double len, const scene& world, bool fast, hit_record& rec) {
+	rec.t = INFINITY;
+	for (size_t i = 0; i < world.spheres.size(); i++) {
+		const sphere& s = world.spheres[i];
+		double t = HitSphere(s.center, (float)s.radius, r, fast);
+		if (t > 0.0 && t < rec.t) {
+			rec.t = t;
+			rec.object = (int)i;
+		}
+	}
+	if (rec.object >= 0) {
+		const sphere& s = world.spheres[rec.object];
+		rec.p = r.at(rec.t);
+		rec.normal = fast ? fast_unit_vector(rec.p - s.center) : unit_vector(rec.p - s.center);
+		rec.material = s.material;
+	}
+	bool hit = rec.object >= 0;
+
+	// Tubes and the isosurface are intersected with a unit length direction, so their distances are scaled back to this ray
+	ray unit_ray(r.origin(), r.direction() / len);
+	if (world.tubes) {
+		hit_record tube_rec;
+		if (world.tubes->intersect(unit_ray, 0.0, rec.t * len, tube_rec)) {
+			rec = tube_rec;
+			rec.t /= len;
+			hit = true;
+		}
+	}
+
+	if (world.vol && world.iso && world.volume_mode == scene::volume_isosurface) {
+		hit_record iso_rec;
+		if (world.iso->intersect(unit_ray, 0.0, rec.t * len, world.iso_value, iso_rec)) {
+			rec = iso_rec;
+			rec.t /= len;
+			rec.object = -1;
+			rec.material = world.iso_material;
+			return true;
+		}
+	}
+	return hit;
+}
+
+// Find the closest object in front of the ray origin (returns false if the ray doesn't hit anything)
+bool HitScene(const ray& r, const scene& world, hit_record& rec) {
+	bool fast = fast_math.load(std::memory_order_relaxed);
+	double len = fast ? fast_sqrt(r.direction().length_squared()) : r.direction().length();
+	bool hit = HitObjects(r, len, world, fast, rec);
+	if (world.sdf) {
+		hit_record sdf_rec;
+		if (world.sdf->intersect(ray(r.origin(), r.direction() / len), 0.0, rec.t * len, sdf_rec)) {
+			rec = sdf_rec;
+			rec.t /= len;
+			hit = true;
+		}
+	}
+	return hit;
+}
+
+/*
+ * HitScene() for four rays at once. The implicit surfaces are sphere traced as a packet so that the four rays share
+ * every SIMD evaluation of the distance field. Neighboring pixels take a similar number of steps, so few lanes idle.
+ * In fast math mode the lengths of the four directions come from one packed reciprocal square root.
+ */
+void HitScene4(const ray r[4], const scene& world, hit_record rec[4], bool hit[4]) {
+	bool fast = fast_math.load(std::memory_order_relaxed);
+	double len[4];
+	if (fast) {
+		float length_squared[4], inv_len[4];
+		for (int i = 0; i < 4; i++)
+			length_squared[i] = (float)r[i].direction().length_squared();
+		fast_rsqrt4(length_squared, inv_len);
+		for (int i = 0; i < 4; i++)
+			len[i] = length_squared[i] * inv_len[i];
+	}
+	else {
+		for (int i = 0; i < 4; i++)
+			len[i] = r[i].direction().length();
+	}
+	for (int i = 0; i < 4; i++)
+		hit[i] = HitObjects(r[i], len[i], world, fast, rec[i]);
+	if (!world.sdf)
+		return;
+
+	ray unit_rays[4];
+	double tmax[4];
+	for (int i = 0; i < 4; i++) {
+		unit_rays[i] = ray(r[i].origin(), r[i].direction() / len[i]);
+		tmax[i] = rec[i].t * len[i];
+	}
+	hit_record sdf_rec[4];
+	bool sdf_hit[4];
+	world.sdf->intersect4(unit_rays, 0.0, tmax, sdf_rec, sdf_hit);
+	for (int i = 0; i < 4; i++) {
+		if (sdf_hit[i]) {
+			rec[i] = sdf_rec[i];
+			rec[i].t /= len[i];
+			hit[i] = true;
+		}
+	}
+}
+
+color RayColor(const ray& r, const scene& world) {
+	hit_record rec;
+	bool hit = HitScene(r, world, rec);
+	return ShadeRay(r, world, hit, rec);
+}
+
+/*
+ * Preview shading of a surface. A diffuse surface shows its normal as a color, tinted by its albedo (the default
+ * gray albedo of 0.5 gives the plain normal colors). Glass shows the environment it reflects, mixed by the Fresnel
+ * reflectance with the environment seen straight through it. Only the environment is looked up, so every pixel still
+ * depends on nothing but its primary ray (which the masked re-render of an edit relies on).
+ */
+static color ShadeSurface(const vec3& direction, const scene& world, const hit_record& rec) {
+	const material& m = world.materials[std::clamp(rec.material, 0, (int)world.materials.size() - 1)];
+	if (m.type != material::dielectric)
+		return m.albedo * (rec.normal + vec3(1, 1, 1));
+	vec3 d = unit_vector(direction);
+	double cos_i = -dot(d, rec.normal);
+	vec3 n = cos_i >= 0.0 ? rec.normal : -rec.normal;
+	cos_i = std::fabs(cos_i);
+	double r0 = (1.0 - m.ior) / (1.0 + m.ior);
+	r0 = r0 * r0;
+	double x = 1.0 - cos_i;
+	double fresnel = r0 + (1.0 - r0) * x * x * x * x * x;
+	return fresnel * environment.miss(d + 2.0 * cos_i * n) + (1.0 - fresnel) * m.albedo * environment.miss(d);
+}
+
+// Color of a ray given the result of HitScene() (shared by single rays and packets)
+color ShadeRay(const ray& r, const scene& world, bool hit, const hit_record& rec) {
+	// rays that miss the scene see the environment (the default sky gradient is looked up from a small table)
+	color c = hit ? ShadeSurface(r.direction(), world, rec) : environment.miss(r.direction());
+
+	/*
+	 * a volume is composited over whatever is behind it (the volume integrator needs a unit length direction), and
+	 * the preview shows a participating medium the same way since scattering is only simulated by the path tracer
+	 */
+	if (world.vol && world.volume_mode != scene::volume_isosurface) {
+		double len = r.direction().length();
+		ray unit_ray(r.origin(), r.direction() / len);
+		c = world.vol->integrate(unit_ray, hit ? rec.t * len : INFINITY, c);
+	}
+	return c;
+}
+
+/*
+ * RenderTile() and TraceTile() keep their tile buffers on the stack (about 120 KB each), so the per-pixel work never
+ * allocates. The pool's threads have the platform's default stack, which is at least 512 KB (secondary threads on
+ * macOS; 1 MB on Windows and 8 MB on Linux), and the buffers of each function are held to half of that.
+ */
+constexpr size_t tile_stack_size = 256 * 1024;
+
+/*
+ * The hits of one tile, sorted by how they are shaded, with every component in its own array so that four
+ * consecutive hits of a group load into one float4 per component. Every group starts on a multiple of four (an
+ * aligned load) and is padded to a multiple of four with unused lanes, so its last few hits are shaded like the others.
+ */
+struct preview_hits {
+	enum group_type { miss = 0, diffuse = 1, glass = 2, group_count };
+	static constexpr int capacity = renderer::tile_size * renderer::tile_size + 3 * group_count;
+
+	alignas(16) float dx[capacity], dy[capacity], dz[capacity];			// ray direction
+	alignas(16) float nx[capacity], ny[capacity], nz[capacity];			// surface normal
+	alignas(16) float ar[capacity], ag[capacity], ab[capacity];			// albedo
+	alignas(16) float ior[capacity];
+	alignas(16) float cr[capacity], cg[capacity], cb[capacity];			// shaded color
+	int pixel[capacity];												// index of the pixel in the view
+	int object[capacity];												// what the pixel sees (for render_view::objects)
+	double t[capacity];													// ray parameter of the hit (INFINITY for a miss)
+	int group_start[group_count];										// hits of group g are group_start[g] ... group_end[g] - 1
+	int group_end[group_count];
+};
+
+/*
+ * Shade the hits of each group four at a time. Every group runs one straight-line code path, so all four lanes do
+ * useful work (rather than shading each hit right after it is found, where a diffuse hit next to glass would switch
+ * code paths from one pixel to the next). Only the table reads of the environment lookups are done one lane at a time.
+ */
+static void ShadeHits(preview_hits& h) {
+	for (int k = h.group_start[preview_hits::miss]; k < h.group_end[preview_hits::miss]; k += 4) {
+		vec3x4 d = { float4::load(h.dx + k), float4::load(h.dy + k), float4::load(h.dz + k) };
+		float4 r, g, b;
+		environment.miss4(d, r, g, b);
+		r.store(h.cr + k);
+		g.store(h.cg + k);
+		b.store(h.cb + k);
+	}
+
+	for (int k = h.group_start[preview_hits::diffuse]; k < h.group_end[preview_hits::diffuse]; k += 4) {
+		float4 one(1.0f);
+		(float4::load(h.ar + k) * (float4::load(h.nx + k) + one)).store(h.cr + k);
+		(float4::load(h.ag + k) * (float4::load(h.ny + k) + one)).store(h.cg + k);
+		(float4::load(h.ab + k) * (float4::load(h.nz + k) + one)).store(h.cb + k);
+	}
+
+	for (int k = h.group_start[preview_hits::glass]; k < h.group_end[preview_hits::glass]; k += 4) {
+		vec3x4 d = { float4::load(h.dx + k), float4::load(h.dy + k), float4::load(h.dz + k) };
+		vec3x4 n = { float4::load(h.nx + k), float4::load(h.ny + k), float4::load(h.nz + k) };
+		float4 inv_len = float4(1.0f) / sqrt(max(dot(d, d), float4(1e-30f)));
+		d = inv_len * d;
+
+		// flip the normal toward the ray, Schlick's Fresnel reflectance, and the mirror direction
+		float4 cos_i = -dot(d, n);
+		float4 back = cos_i < float4(0.0f);
+		n = { select(back, -n.x, n.x), select(back, -n.y, n.y), select(back, -n.z, n.z) };
+		cos_i = abs(cos_i);
+		float4 eta = float4::load(h.ior + k);
+		float4 r0 = (float4(1.0f) - eta) / (float4(1.0f) + eta);
+		r0 = r0 * r0;
+		float4 x = float4(1.0f) - cos_i;
+		float4 x2 = x * x;
+		float4 fresnel = r0 + (float4(1.0f) - r0) * x2 * x2 * x;
+		vec3x4 reflected = d + (float4(2.0f) * cos_i) * n;
+
+		// the environment in both directions, mixed by the reflectance (the transmitted part is tinted by the albedo)
+		float4 rr, rg, rb, tr, tg, tb;
+		environment.miss4(reflected, rr, rg, rb);
+		environment.miss4(d, tr, tg, tb);
+		float4 transmitted = float4(1.0f) - fresnel;
+		(fresnel * rr + transmitted * float4::load(h.ar + k) * tr).store(h.cr + k);
+		(fresnel * rg + transmitted * float4::load(h.ag + k) * tg).store(h.cg + k);
+		(fresnel * rb + transmitted * float4::load(h.ab + k) * tb).store(h.cb + k);
+	}
+}
+
+/*
+ * Render all of the pixels in one tile of a view. Pixels are traced in 2 x 2 blocks (one packet of four rays); at
+ * the right and bottom edges of an odd-sized tile the missing pixels repeat the last row or column and are not stored.
+ * The hits of the whole tile are then sorted by material type and shaded group by group (see ShadeHits()).
+ */
+void RenderTile(const scene& world, const render_view& view, const render_tile& tile) {
+	int width = view.cam.image_width;
+
+	// Trace every pixel, remembering its hit and the group that shades it
+	struct traced {
+		float direction[3];
+		float normal[3];
+		double t;															// INFINITY for a miss
+		int material;
+		int object;															// what the pixel sees (for render_view::objects)
+		int pixel;
+		int group;
+	};
+	traced found[renderer::tile_size * renderer::tile_size];		// on the stack, like the buffers of TraceTile()
+	static_assert(sizeof(found) + sizeof(preview_hits) <= tile_stack_size,
+		"RenderTile() needs more stack than the pool's threads are guaranteed");
+	int count = 0;
+	int group_count[preview_hits::group_count] = {};
+	for (int y0 = tile.y0; y0 < tile.y1; y0 += 2) {						// iterate through each 2 x 2 block in the tile
+		for (int x0 = tile.x0; x0 < tile.x1; x0 += 2) {
+			ray r[4];
+			int xs[4], ys[4];
+			for (int i = 0; i < 4; i++) {
+				xs[i] = std::min(x0 + (i & 1), tile.x1 - 1);
+				ys[i] = std::min(y0 + (i >> 1), tile.y1 - 1);
+				r[i] = view.cam.get_ray(xs[i], ys[i]);
+			}
+			// blocks without any masked pixel are skipped entirely
+			bool skip[4];
+			for (int i = 0; i < 4; i++) {
+				skip[i] = ((i & 1) && xs[i] == xs[i - 1]) || ((i >> 1) && ys[i] == ys[i - 2]);	// duplicated pixels at the tile edges
+				if (view.mask)
+					skip[i] = skip[i] || !view.mask[(size_t)ys[i] * width + xs[i]];
+			}
+			if (skip[0] && skip[1] && skip[2] && skip[3])
+				continue;
+
+			hit_record rec[4];
+			bool hit[4];
+			HitScene4(r, world, rec, hit);
+
+			for (int i = 0; i < 4; i++) {
+				if (skip[i]) continue;
+				traced& f = found[count++];
+				const vec3& d = r[i].direction();
+				for (int a = 0; a < 3; a++) {
+					f.direction[a] = (float)d[a];
+					f.normal[a] = (float)rec[i].normal[a];
+				}
+				f.t = hit[i] ? rec[i].t : INFINITY;
+				f.material = std::clamp(rec[i].material, 0, (int)world.materials.size() - 1);
+				f.object = !hit[i] ? render_view::no_object : rec[i].object >= 0 ? rec[i].object : render_view::other_object;
+				f.pixel = ys[i] * width + xs[i];
+				f.group = !hit[i] ? preview_hits::miss :
+					world.materials[f.material].type == material::dielectric ? preview_hits::glass : preview_hits::diffuse;
+				group_count[f.group]++;
+			}
+		}
+	}
+
+	// Sort the hits by group (a counting sort) into the arrays of the shading stage
+	preview_hits h;
+	int next[preview_hits::group_count];
+	for (int g = 0, start = 0; g < preview_hits::group_count; g++) {
+		h.group_start[g] = next[g] = start;
+		h.group_end[g] = start + group_count[g];
+		start = (h.group_end[g] + 3) & ~3;
+	}
+	for (int j = 0; j < count; j++) {
+		const traced& f = found[j];
+		int k = next[f.group]++;
+		const material& m = world.materials[f.material];
+		h.dx[k] = f.direction[0];
+		h.dy[k] = f.direction[1];
+		h.dz[k] = f.direction[2];
+		h.nx[k] = f.normal[0];
+		h.ny[k] = f.normal[1];
+		h.nz[k] = f.normal[2];
+		h.ar[k] = (float)m.albedo.x();
+		h.ag[k] = (float)m.albedo.y();
+		h.ab[k] = (float)m.albedo.z();
+		h.ior[k] = (float)m.ior;
+		h.pixel[k] = f.pixel;
+		h.object[k] = f.object;
+		h.t[k] = f.t;
+	}
+	for (int g = 0; g < preview_hits::group_count; g++) {
+		for (int k = h.group_end[g]; k & 3; k++) {						// the unused lanes after the group
+			h.dx[k] = h.dz[k] = h.nx[k] = h.ny[k] = h.nz[k] = 0.0f;
+			h.dy[k] = 1.0f;												// a valid direction for the environment lookups
+			h.ar[k] = h.ag[k] = h.ab[k] = 0.0f;
+			h.ior[k] = 1.0f;
+		}
+	}
+
+	ShadeHits(h);
+
+	for (int g = 0; g < preview_hits::group_count; g++) {
+		for (int k = h.group_start[g]; k < h.group_end[g]; k++) {
+			color pixel(h.cr[k], h.cg[k], h.cb[k]);
+			size_t p = (size_t)h.pixel[k];
+
+			// a volume is composited over the surface (see ShadeRay())
+			if (world.vol && world.volume_mode != scene::volume_isosurface) {
+				ray r = view.cam.get_ray((int)(p % width), (int)(p / width));
+				double len = r.direction().length();
+				ray unit_ray(r.origin(), r.direction() / len);
+				pixel = world.vol->integrate(unit_ray, h.t[k] * len, pixel);
+			}
+
+			size_t idx = p * 4;											// calculate the starting position for the current pixel
+			view.pixels[idx + 0] = pixel.x();							// update the red, green, blue, and alpha channels
+			view.pixels[idx + 1] = pixel.y();
+			view.pixels[idx + 2] = pixel.z();
+			view.pixels[idx + 3] = 1.0f;
+
+			// remember what the pixel sees, so an edit can find the pixels it has to re-render
+			if (view.objects)
+				view.objects[p] = h.object[k];
+		}
+	}
+}
+
+/*
+ * Path trace one pass over a tile: add `samples` jittered samples of every pixel to the running sums of the tile,
+ * then write the average into the view's image. The random numbers only depend on the view, pixel, and pass, so the
+ * result is the same no matter which threads render which passes (except with path guiding, the radiance cache, and
+ * resampling, which depend on which samples had finished before).
+ */
+void TraceTile(const scene& world, const render_settings& settings, int view_index, const render_view& view,
+	const render_tile& tile, int pass, std::vector<float>& sums, int& tile_samples, std::mutex& tile_mutex, guide_tree* guide,
+	const photon_map* photons, radiance_cache* cache, light_reservoir* reservoirs) {
+
+	int width = view.cam.image_width;
+	int samples = std::min(settings.samples_per_pass, settings.samples_per_pixel - pass * settings.samples_per_pass);
+	int tile_width = tile.x1 - tile.x0;
+	int tile_height = tile.y1 - tile.y0;
+	color pass_sum[renderer::tile_size * renderer::tile_size];	// on the stack: the per-pixel path never allocates
+
+	// Resampling starts from the tile's reservoirs after its last pass (the neighbors stay as they were, the pixels change)
+	light_reservoir previous[renderer::tile_size * renderer::tile_size];
+	light_reservoir current[renderer::tile_size * renderer::tile_size];
+	if (reservoirs) {
+		std::lock_guard<std::mutex> lock(tile_mutex);
+		for (int yi = tile.y0; yi < tile.y1; yi++)
+			std::copy_n(reservoirs + (size_t)yi * width + tile.x0, tile_width, previous + (size_t)(yi - tile.y0) * tile_width);
+		std::copy_n(previous, tile_width * tile_height, current);
+	}
+
+	// Each pixel keeps its generator for all of its samples, and every sample of the tile is traced as one batch
+	int count = tile_width * tile_height;
+	rng gens[renderer::tile_size * renderer::tile_size];
+	static_assert(sizeof(pass_sum) + sizeof(previous) + sizeof(current) + sizeof(gens) <= tile_stack_size,
+		"TraceTile() needs more stack than the pool's threads are guaranteed");
+	for (int local = 0; local < count; local++) {
+		int xi = tile.x0 + local % tile_width, yi = tile.y0 + local / tile_width;
+		gens[local] = rng(view_index, (uint64_t)yi * width + xi, pass, 0);
+		pass_sum[local] = color(0, 0, 0);
+	}
+	path_batch& batch = path_batch::thread(guide != nullptr || cache != nullptr);
+	for (int s = 0; s < samples; s++) {
+		for (int local = 0; local < count; local++) {
+			int xi = tile.x0 + local % tile_width, yi = tile.y0 + local / tile_width;
+			direct_reuse reuse{ current + local, previous, xi - tile.x0, yi - tile.y0, tile_width, tile_height };
+			rng& gen = gens[local];
+			ray r = view.cam.get_ray(xi, yi, gen.next() - 0.5, gen.next() - 0.5);
+			batch.start(local, r, gen, reservoirs ? &reuse : nullptr);
+		}
+		batch.trace(count, world, settings, guide, photons, cache);
+		for (int local = 0; local < count; local++)
+			pass_sum[local] += batch.radiance(local);
+	}
+
+	std::lock_guard<std::mutex> lock(tile_mutex);
+	tile_samples += samples;
+	for (int yi = tile.y0; yi < tile.y1; yi++) {
+		if (reservoirs)
+			std::copy_n(current + (size_t)(yi - tile.y0) * tile_width, tile_width, reservoirs + (size_t)yi * width + tile.x0);
+		for (int xi = tile.x0; xi < tile.x1; xi++) {
+			size_t idx = (size_t)yi * width + xi;
+			const color& c = pass_sum[(size_t)(yi - tile.y0) * tile_width + (xi - tile.x0)];
+			for (int ch = 0; ch < 3; ch++) {
+				sums[idx * 3 + ch] += (float)c[ch];
+				view.pixels[idx * 4 + ch] = sums[idx * 3 + ch] / tile_samples;
+			}
+			view.pixels[idx * 4 + 3] = 1.0f;
+		}
+	}
+}
+
+// true if any pixel of the tile is set in the view's mask
+static bool TileMasked(const render_view& view, const render_tile& tile) {
+	for (int yi = tile.y0; yi < tile.y1; yi++) {
+		const unsigned char* row = view.mask + (size_t)yi * view.cam.image_width;
+		if (std::any_of(row + tile.x0, row + tile.x1, [](unsigned char m) { return m != 0; }))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Priority of a tile for a focus (lower is rendered first). Tiles are grouped into rings one tile wide around the
+ * focus point, and ordered by angle within a ring, which turns the rings into a spiral. Tiles of the focused view that
+ * are outside of its visible rectangle come after all of the visible ones, and other views come last.
+ */
+static double TilePriority(const render_view& view, int view_index, const render_tile& tile, const render_focus& focus) {
+	bool focused = focus.order == render_focus::viewport_first && view_index == focus.view;
+	double fx = focused ? focus.x : 0.5 * view.cam.image_width;
+	double fy = focused ? focus.y : 0.5 * view.cam.image_height;
+	int group = 0;
+	if (focused && focus.x1 > focus.x0 && focus.y1 > focus.y0)
+		group = tile.x1 > focus.x0 && tile.x0 < focus.x1 && tile.y1 > focus.y0 && tile.y0 < focus.y1 ? 0 : 1;
+	if (focus.order == render_focus::viewport_first && view_index != focus.view)
+		group = 2;
+
+	double dx = 0.5 * (tile.x0 + tile.x1) - fx;
+	double dy = 0.5 * (tile.y0 + tile.y1) - fy;
+	double ring = std::floor(std::sqrt(dx * dx + dy * dy) / renderer::tile_size);
+	double turn = (std::atan2(dy, dx) + pi) / (2.0 * pi + 1e-9);		// in [0, 1)
+	return group * 1e9 + ring + turn;
+}
+
+void render_job::prioritize(const render_focus& focus) {
+	std::lock_guard<std::mutex> lock(m_schedule_mutex);
+	for (size_t t = 0; t < m_tiles.size(); t++)
+		m_priority[t] = TilePriority(m_views[m_tiles[t].view], m_tiles[t].view, m_tiles[t], focus);
+	std::stable_sort(m_order.begin() + m_position, m_order.end(), [this](int a, int b) { return m_priority[a] < m_priority[b]; });
+}
+
+bool render_job::next_tile(size_t& tile_index, int& pass, std::shared_ptr<photon_map>& photons) {
+	std::lock_guard<std::mutex> lock(m_schedule_mutex);
+	if (m_position == m_order.size() && m_pass + 1 < m_passes) {
+		// start the next pass with every tile, in the current priority order
+		m_pass++;
+		m_position = 0;
+		if (m_guide)
+			m_guide->pass_started(m_pass);
+		if (m_photons)
+			m_photons = std::make_shared<photon_map>(*m_world, m_settings.photons, m_pass, m_settings.max_depth);
+		std::stable_sort(m_order.begin(), m_order.end(), [this](int a, int b) { return m_priority[a] < m_priority[b]; });
+	}
+	if (m_position == m_order.size())
+		return false;
+	tile_index = m_order[m_position++];
+	pass = m_pass;
+	photons = m_photons;
+	return true;
+}
+
+std::shared_ptr<render_job> renderer::start(std::shared_ptr<const scene> world, std::vector<render_view> views,
+	const render_settings& settings, std::function<void(const render_tile&)> on_tile, const render_focus& focus) {
+
+	allocation_tracker::scope phase(allocation_tracker::render_setup);
+	auto job = std::make_shared<render_job>();
+	job->m_world = std::move(world);
+	job->m_views = std::move(views);
+	job->m_on_tile = std::move(on_tile);
+	job->m_settings = settings;
+	job->m_passes = settings.passes();
+
+	// Split every view into tiles and put all of them into one list, so that the threads balance the work across views
+	for (int v = 0; v < (int)job->m_views.size(); v++) {
+		const render_view& view = job->m_views[v];
+		const camera& cam = view.cam;
+		for (int y0 = 0; y0 < cam.image_height; y0 += tile_size) {
+			for (int x0 = 0; x0 < cam.image_width; x0 += tile_size) {
+				render_tile tile;
+				tile.view = v;
+				tile.x0 = x0;
+				tile.y0 = y0;
+				tile.x1 = std::min(x0 + tile_size, cam.image_width);
+				tile.y1 = std::min(y0 + tile_size, cam.image_height);
+				if (view.mask && !TileMasked(view, tile))
+					continue;
+				job->m_tiles.push_back(tile);
+			}
+		}
+	}
+
+	// Order the tiles for the focus (it can be changed with prioritize() while the job is running)
+	job->m_order.resize(job->m_tiles.size());
+	for (size_t t = 0; t < job->m_tiles.size(); t++)
+		job->m_order[t] = (int)t;
+	job->m_priority.resize(job->m_tiles.size());
+	job->prioritize(focus);
+
+	// Progressive renders accumulate samples, so every view gets a running sum and every tile a sample count and lock
+	if (settings.mode == render_settings::path_tracing) {
+		for (const render_view& view : job->m_views)
+			job->m_sums.emplace_back((size_t)view.cam.image_width * view.cam.image_height * 3, 0.0f);
+		if (settings.resampling) {
+			for (const render_view& view : job->m_views)
+				job->m_reservoirs.emplace_back((size_t)view.cam.image_width * view.cam.image_height);
+		}
+		job->m_tile_samples.assign(job->m_tiles.size(), 0);
+		job->m_tile_mutex = std::make_unique<std::mutex[]>(job->m_tiles.size());
+		if (settings.guiding)
+			job->m_guide = std::make_unique<path_guide>();
+		bool use_medium = job->m_world->fog && job->m_world->vol && job->m_world->volume_mode == scene::volume_medium;
+		if (settings.photons > 0 && !use_medium)
+			job->m_photons = std::make_shared<photon_map>(*job->m_world, settings.photons, 0, settings.max_depth);
+		if (settings.radiance_cache > 0) {
+			if (!m_radiance_cache || m_radiance_cache_scene.lock() != job->m_world || m_radiance_cache_depth != settings.max_depth) {
+				m_radiance_cache = std::make_shared<radiance_cache>();
+				m_radiance_cache_scene = job->m_world;
+				m_radiance_cache_depth = settings.max_depth;
+			}
+			job->m_cache = m_radiance_cache;
+		}
+	}
+
+	// Every thread in the pool pulls tiles from the job until there are none left
+	unsigned int workers = std::min<unsigned int>(m_pool.size(), (unsigned int)std::max<size_t>(job->tile_count(), 1));
+	job->m_running_workers = workers;
+	job->m_start = std::chrono::steady_clock::now();
+	job->m_end = job->m_start;
+	for (unsigned int i = 0; i < workers; i++)
+		m_pool.submit([job] { run_worker(job); });
+	return job;
+}
+
+void renderer::render(const scene& world, const std::vector<render_view>& views, const render_settings& settings) {
+	// the job is finished before this returns, so it can point at the caller's scene without owning it
+	start(std::shared_ptr<const scene>(&world, [](const scene*) {}), views, settings)->wait();
+}
+
+void renderer::run_worker(const std::shared_ptr<render_job>& job) {
+	for (;;) {
+		if (job->m_cancelled)
+			break;
+
+		// Tile passes are handed out pass by pass, so the whole image gets its first samples before any tile gets more
+		size_t tile_index;
+		int pass;
+		std::shared_ptr<photon_map> photons;
+		if (!job->next_tile(tile_index, pass, photons))
+			break;
+		const render_tile& tile = job->m_tiles[tile_index];
+
+		// the first tiles of a pass trace its photons together (the others wait until the map is complete)
+		if (photons) {
+			allocation_tracker::scope phase(allocation_tracker::render_setup);
+			photons->build();
+		}
+		{
+			// the tile keeps the guide tree it started with alive (and releases it outside of the pixels phase)
+			std::shared_ptr<guide_tree> guide = job->m_guide ? job->m_guide->current() : nullptr;
+
+			// the zone comes first: recording the first zone of a thread allocates its ring buffer
+			timeline::zone zone("tile", (int64_t)tile_index);
+			allocation_tracker::scope phase(allocation_tracker::pixels);
+			if (job->m_settings.mode == render_settings::path_tracing)
+				TraceTile(*job->m_world, job->m_settings, tile.view, job->m_views[tile.view], tile, pass,
+					job->m_sums[tile.view], job->m_tile_samples[tile_index], job->m_tile_mutex[tile_index], guide.get(),
+					photons.get(), job->m_cache.get(), job->m_reservoirs.empty() ? nullptr : job->m_reservoirs[tile.view].data());
+			else
+				RenderTile(*job->m_world, job->m_views[tile.view], tile);
+		}
+		job->m_done++;
+		if (job->m_on_tile)
+			job->m_on_tile(tile);
+	}
+
+	// The last worker to stop marks the job as finished
+	std::vector<std::coroutine_handle<>> waiting;
+	{
+		std::lock_guard<std::mutex> lock(job->m_mutex);
+		if (--job->m_running_workers == 0) {
+			job->m_end = std::chrono::steady_clock::now();
+			timeline::record("render", job->m_start, job->m_end, (int64_t)job->m_done);
+			{
+				// the photon map points into the scene (photons() reads it under the schedule lock from other threads)
+				std::lock_guard<std::mutex> schedule_lock(job->m_schedule_mutex);
+				job->m_photons.reset();
+			}
+			job->m_world.reset();							// unpin the scene version as soon as nothing reads it
+			job->m_finished_cv.notify_all();
+			waiting.swap(job->m_waiting);
+		}
+	}
+
+	// Coroutines that were waiting for the job continue on this thread (outside the lock, since they may start new jobs)
+	for (std::coroutine_handle<> h : waiting)
+		h.resume();
+}
+
+task<std::shared_ptr<render_job>> renderer::render_async(std::shared_ptr<const scene> world, std::vector<render_view> views,
+	render_settings settings, std::function<void(const render_tile&)> on_tile) {
+	std::shared_ptr<render_job> job = start(std::move(world), std::move(views), settings, std::move(on_tile));
+	co_await job->completed();
+	co_return job;
+}
+
+task<void> renderer::write_image_async(std::string filename, const float* pixels, int width, int height) {
+	co_await m_pool.schedule();
+	WriteImage(filename, pixels, width, height);
+}
+
+/*
+ * Save an RGBA image as an ASCII PPM file (the alpha channel is dropped). Colors are clamped to [0, 1] before they
+ * are converted to bytes, since HDR environment maps can produce values larger than one.
+ */
+void WriteImage(const std::string& filename, const float* pixels, int width, int height) {
+	timeline::zone zone("write image");
+	std::ofstream out(filename);
+	if (!out)
+		throw std::runtime_error("Unable to write image " + filename);
+
+	out << "P3\n" << width << ' ' << height << "\n255\n";
+	for (size_t i = 0; i < (size_t)width * height; i++) {
+		color c(std::clamp(pixels[i * 4 + 0], 0.0f, 0.999f),
+				std::clamp(pixels[i * 4 + 1], 0.0f, 0.999f),
+				std::clamp(pixels[i * 4 + 2], 0.0f, 0.999f));
+		write_color(out, c);
+	}
+}
@@ -0,0 +1,295 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "camera.h"
+#include "scene.h"
+#include "task.h"
+#include "guiding.h"
+#include "photons.h"
+#include "radiance_cache.h"
+#include "restir.h"
+#include "threadpool.h"
+
+/*
+ * One camera view of a render, along with the RGBA image (cam.image_width x cam.image_height floats x 4) it fills.
+ * A view can optionally record which object each pixel sees (the index of the sphere, no_object for the background,
+ * or other_object for everything else) and render only the pixels that are set in a mask, so that an edit can
+ * re-render just the pixels it changes.
+ */
+struct render_view {
+    static constexpr int no_object = -1;
+    static constexpr int other_object = -2;
+
+    camera cam;
+    float* pixels = nullptr;
+    int* objects = nullptr;                 // optional pixel -> object map (filled by the preview renderer)
+    const unsigned char* mask = nullptr;    // optional: only pixels with a non-zero mask are rendered
+};
+
+// A rectangle of pixels [x0, x1) x [y0, y1) in one of the views of a render job
+struct render_tile {
+    int view = 0;
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+};
+
+/*
+ * How the pixels of a render are computed. The preview shades surfaces by their normals and materials (glass shows the
+ * environment it reflects and transmits) with one ray per pixel. The path tracer estimates the lighting from the
+ * environment (including scattering in a participating medium) and refines the image progressively: every pass adds
+ * samples_per_pass samples to every tile until each pixel has samples_per_pixel samples, so a noisy version of the
+ * whole image shows up quickly.
+ */
+struct render_settings {
+    enum mode_type { preview = 0, path_tracing = 1 };
+    int mode = preview;
+    int samples_per_pixel = 64;
+    int samples_per_pass = 4;
+    int max_depth = 8;                      // longest path (in bounces or scattering events)
+    bool guiding = false;                   // learn where light comes from while rendering (see guiding.h)
+    int photons = 0;                        // caustic photons traced per pass (0 = no photon map, see photons.h)
+    int radiance_cache = 0;                 // bounces after which paths end in the radiance cache (0 = no cache)
+    bool resampling = false;                // reuse direct light samples between pixels and passes (see restir.h)
+
+    int passes() const {
+        if (mode == preview) return 1;
+        return std::max(1, (samples_per_pixel + samples_per_pass - 1) / std::max(samples_per_pass, 1));
+    }
+};
+
+/*
+ * Which tiles of a render are handed out first. What the user sees first matters more than how long the whole image
+ * takes, so tiles are ordered by their distance to a focus point, in rings around it ordered by angle (a spiral):
+ *   center_out      the focus is the center of every view
+ *   viewport_first  tiles inside the visible rectangle of the focused view come first, starting at (x, y) (the
+ *                   pixel under the mouse or the center of the zoomed viewport), followed by the rest of the view
+ */
+struct render_focus {
+    enum order_type { center_out = 0, viewport_first = 1 };
+    int order = center_out;
+    int view = 0;
+    double x = 0.0, y = 0.0;                // image coordinates (pixels) of the focus point
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0;     // visible part [x0, x1) x [y0, y1) of the view (empty = all of it)
+
+    bool operator==(const render_focus&) const = default;
+};
+
+/*
+ * A render job renders one or more views of the same scene. The tiles of every view are placed in a single list
+ * that all of the worker threads pull from, so a view that is quick to render (mostly background) doesn't leave
+ * threads idle while another view is still busy. Jobs are created by renderer::start().
+ */
+class render_job {
+public:
+    // stop handing out tiles (tiles that are already being rendered are finished)
+    void cancel() { m_cancelled = true; }
+
+    // change the order of the tiles that haven't been handed out yet (for example when the user zooms in)
+    void prioritize(const render_focus& focus);
+
+    // block until every worker has stopped working on this job
+    void wait() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_finished_cv.wait(lock, [this] { return m_running_workers == 0; });
+    }
+
+    bool finished() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_running_workers == 0;
+    }
+    bool cancelled() const { return m_cancelled; }
+
+    // an awaitable that resumes a coroutine once every worker has stopped (on the thread of the last worker)
+    auto completed() {
+        struct awaiter {
+            render_job& job;
+            bool await_ready() const { return job.finished(); }
+            bool await_suspend(std::coroutine_handle<> h) {
+                std::lock_guard<std::mutex> lock(job.m_mutex);
+                if (job.m_running_workers == 0)
+                    return false;
+                job.m_waiting.push_back(h);
+                return true;
+            }
+            void await_resume() const noexcept {}
+        };
+        return awaiter{ *this };
+    }
+
+    // the path guide learned by this job (null unless it path traces with guiding)
+    const path_guide* guide() const { return m_guide.get(); }
+
+    // the radiance cache used by this job (null unless it path traces with a radiance cache)
+    const radiance_cache* cache() const { return m_cache.get(); }
+
+    // the photon map of the pass that is being rendered (null unless it path traces with photons)
+    std::shared_ptr<const photon_map> photons() const {
+        std::lock_guard<std::mutex> lock(m_schedule_mutex);
+        return m_photons;
+    }
+
+    // number of tile passes (every tile is rendered once per pass) and how many of them are finished
+    size_t tile_count() const { return m_tiles.size() * m_passes; }
+    size_t tiles_done() const { return m_done; }
+    int passes() const { return m_passes; }
+
+    // time since the job started (or the total render time once it has finished)
+    double elapsed_seconds() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto end = m_running_workers == 0 ? m_end : std::chrono::steady_clock::now();
+        return std::chrono::duration<double>(end - m_start).count();
+    }
+
+private:
+    friend class renderer;
+
+    std::shared_ptr<const scene> m_world;                   // the scene version the job renders (pinned until the job finishes)
+    std::vector<render_view> m_views;
+    std::vector<render_tile> m_tiles;
+    std::function<void(const render_tile&)> m_on_tile;     // called by the worker thread after each finished tile
+    render_settings m_settings;
+    int m_passes = 1;
+
+    /*
+     * Progressive rendering: the running sum of the samples of every pixel (RGB per view) and the number of samples
+     * added to each tile so far. Two passes over the same tile can run at the same time on different threads, so
+     * the sums of a tile are only updated while holding its lock.
+     */
+    std::vector<std::vector<float>> m_sums;
+    std::vector<std::vector<light_reservoir>> m_reservoirs;  // direct light reservoir of every pixel (when resampling)
+    std::vector<int> m_tile_samples;
+    std::unique_ptr<std::mutex[]> m_tile_mutex;
+    std::unique_ptr<path_guide> m_guide;
+    std::shared_ptr<photon_map> m_photons;                  // photon map of the current pass (tiles keep theirs alive)
+    std::shared_ptr<radiance_cache> m_cache;                // shared with the other jobs that render the same scene
+
+    /*
+     * Tiles are handed out pass by pass in the order of m_order, which is sorted by m_priority (lower first). When
+     * the priorities change, only the part of the current pass that hasn't been handed out yet is sorted again,
+     * so no tile is rendered twice or skipped in a pass.
+     */
+    std::vector<int> m_order;
+    std::vector<double> m_priority;
+    size_t m_position = 0;                                  // next entry of m_order to hand out in the current pass
+    int m_pass = 0;
+    mutable std::mutex m_schedule_mutex;
+
+    // get the next tile, its pass and the pass's photon map (false if every pass of every tile has been handed out)
+    bool next_tile(size_t& tile_index, int& pass, std::shared_ptr<photon_map>& photons);
+    std::atomic<size_t> m_done = 0;                         // number of finished tiles
+    std::atomic<bool> m_cancelled = false;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_finished_cv;
+    unsigned int m_running_workers = 0;
+    std::vector<std::coroutine_handle<>> m_waiting;            // coroutines that await completed()
+    std::chrono::steady_clock::time_point m_start;
+    std::chrono::steady_clock::time_point m_end;
+};
+
+/*
+ * The renderer owns the thread pool used to render images. A single renderer is created at startup and every
+ * render (the interactive view in the window, or a batch of views rendered from the command line) re-uses its
+ * threads. A job keeps the scene it renders alive, and the scene must not be modified while the job exists (pass an
+ * immutable snapshot, see snapshot_store, so that the scene can be edited while it is rendering).
+ */
+class renderer {
+public:
+    static constexpr int tile_size = 32;
+
+    explicit renderer(unsigned int threads = 0) : m_pool(threads) {}
+
+    // start rendering a batch of views in the background and return immediately
+    std::shared_ptr<render_job> start(std::shared_ptr<const scene> world, std::vector<render_view> views,
+        const render_settings& settings = render_settings(), std::function<void(const render_tile&)> on_tile = nullptr,
+        const render_focus& focus = render_focus());
+
+    // render a batch of views and wait for all of them to finish
+    void render(const scene& world, const std::vector<render_view>& views, const render_settings& settings = render_settings());
+
+    /*
+     * Coroutine versions of start() and WriteImage() for pipelines of tasks (see task.h). render_async() resumes the
+     * awaiting coroutine when the job has finished and returns the job, and write_image_async() writes the file on
+     * one of the pool's threads, so that saving an image overlaps with rendering the next one. The image must stay
+     * alive until the write has finished.
+     */
+    task<std::shared_ptr<render_job>> render_async(std::shared_ptr<const scene> world, std::vector<render_view> views,
+        render_settings settings = render_settings(), std::function<void(const render_tile&)> on_tile = nullptr);
+    task<void> write_image_async(std::string filename, const float* pixels, int width, int height);
+
+    unsigned int thread_count() const { return m_pool.size(); }
+    thread_pool& pool() { return m_pool; }
+
+private:
+    thread_pool m_pool;
+
+    /*
+     * The radiance cache holds light in world space, so it stays valid when only the camera or the sample counts
+     * change: jobs that render the same scene snapshot with the same path length share it, and a new scene (every
+     * edit publishes a new snapshot) starts a new cache.
+     */
+    std::shared_ptr<radiance_cache> m_radiance_cache;
+    std::weak_ptr<const scene> m_radiance_cache_scene;
+    int m_radiance_cache_depth = 0;
+
+    static void run_worker(const std::shared_ptr<render_job>& job);
+};
+
+class rng;
+
+// Offset used to move secondary rays off of the surface they start on (so they don't hit it again)
+constexpr double surface_epsilon = 1e-4;
+
+bool HitScene(const ray& r, const scene& world, hit_record& rec);
+void HitScene4(const ray r[4], const scene& world, hit_record rec[4], bool hit[4]);
+color RayColor(const ray& r, const scene& world);
+color ShadeRay(const ray& r, const scene& world, bool hit, const hit_record& rec);
+color PathTrace(const ray& r, const scene& world, const render_settings& settings, rng& gen, guide_tree* guide = nullptr,
+    const photon_map* photons = nullptr, radiance_cache* cache = nullptr, const direct_reuse* reuse = nullptr);
+void WriteImage(const std::string& filename, const float* pixels, int width, int height);
+
+struct path_state;
+struct path_log;
+
+/*
+ * The paths of one tile sample, traced together one bounce at a time: every bounce traces all of the paths that are
+ * still going, sorts them by what they ran into (the medium, the environment, glass, or a diffuse surface), and
+ * shades the groups one after another, so the same shading code runs over a whole group instead of switching from
+ * one material to the next at every pixel. Every path draws from its own generator in the same order as PathTrace().
+ */
+class path_batch {
+public:
+    static constexpr int capacity = renderer::tile_size * renderer::tile_size;
+
+    // the batch of the calling thread (logs are needed for path guiding and the radiance cache)
+    static path_batch& thread(bool logs);
+    ~path_batch();
+
+    // set up path i for a camera ray (gen and reuse are used like the arguments of PathTrace())
+    void start(int i, const ray& r, rng& gen, const direct_reuse* reuse);
+
+    // trace paths 0 ... count - 1 until all of them have ended
+    void trace(int count, const scene& world, const render_settings& settings, guide_tree* guide,
+        const photon_map* photons, radiance_cache* cache);
+
+    // radiance found by path i
+    const color& radiance(int i) const;
+
+private:
+    path_batch();
+
+    std::unique_ptr<path_state[]> m_paths;
+    std::unique_ptr<path_log[]> m_logs;
+    int m_alive[capacity];                          // paths that are still going
+    int m_sorted[capacity];                         // ... sorted by the group of their next bounce
+    unsigned char m_group[capacity];
+};
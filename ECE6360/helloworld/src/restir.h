@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cmath>
+
+#include "vec3.h"
+
+/*
+ * Reservoir resampling of direct light (ReSTIR, Bitterli et al. 2020). The environment map is a light made of one
+ * light per texel, and sampling it by brightness alone ignores the cosine at the surface and everything the previous
+ * samples of the pixel and its neighbors have found. Resampled importance sampling draws several candidate directions
+ * from the environment, and keeps one of them with a probability proportional to how much light it would bring
+ * (the target function: brightness times cosine, without a shadow ray). A reservoir is the state of that choice:
+ * the kept direction, the sum of the candidate weights, and the number of candidates seen, which is all that is needed
+ * to merge two reservoirs into one as if all of their candidates had been seen together. That is what makes reuse
+ * cheap:
+ *
+ *   - temporal: every sample of a pixel merges the reservoir the pixel's previous samples (of this pass and the passes
+ *     before it) left behind, so a good direction keeps being found from one sample to the next,
+ *   - spatial: it also merges the reservoirs of a few random pixels of the same tile from the tile's previous pass,
+ *     if they saw a similar surface (similar normal and distance).
+ *
+ * The kept direction is shadow tested once, so a sample costs one shadow ray however many candidates it weighed.
+ * Reused reservoirs count as at most max_history samples' worth of candidates: a progressive render averages many
+ * samples per pixel, and a longer history makes them pick the same direction over and over, so they stop averaging
+ * out (with a cap of one sample the noise at every sample count was lower than with longer histories). Shadowed
+ * directions are passed on like any other (zeroing them darkens the pixels near shadows). The combination uses the
+ * simple 1/M weights, which is slightly biased where neighboring surfaces differ (the same trade the original biased
+ * ReSTIR makes), and the result depends on which passes of a tile finished first.
+ */
+struct light_reservoir {
+    static constexpr int candidates = 8;                    // environment samples drawn per pixel sample
+    static constexpr int neighbors = 5;                     // reservoirs of other pixels merged per pixel sample
+    static constexpr int radius = 6;                        // neighbors are at most this many pixels away
+    static constexpr float max_history = 1.0f;              // cap on the candidate count (in samples' worth)
+
+    // no default member values, so a tile's worth can live on the stack without being cleared (a job's start at zero)
+    float dir[3];                   // kept direction
+    float weight_sum;               // sum of the resampling weights of every candidate
+    float count;                    // number of candidates (M)
+    float weight;                   // contribution weight of the kept direction (W)
+    float normal[3];                // surface the reservoir was made for
+    float depth;
+
+    vec3 direction() const { return vec3(dir[0], dir[1], dir[2]); }
+
+    // add a candidate with resampling weight w, and keep it with probability w / weight_sum (u is uniform in [0, 1))
+    void update(const vec3& d, double w, double u) {
+        weight_sum += (float)w;
+        if (w > 0.0 && u * weight_sum < w) {
+            dir[0] = (float)d.x();
+            dir[1] = (float)d.y();
+            dir[2] = (float)d.z();
+        }
+    }
+
+    // true if a reservoir made for another surface can be reused on this one
+    bool similar(const vec3& n, double d) const {
+        return count > 0.0f && normal[0] * n.x() + normal[1] * n.y() + normal[2] * n.z() > 0.9 &&
+            std::fabs(depth - d) < 0.1 * d;
+    }
+};
+
+/*
+ * What PathTrace() needs to resample the direct light at a pixel's first surface: the pixel's reservoir (updated by
+ * every sample) and the reservoirs of the whole tile after its previous pass (the neighbors for spatial reuse).
+ */
+struct direct_reuse {
+    light_reservoir* pixel = nullptr;
+    const light_reservoir* previous = nullptr;  // tile_width x tile_height reservoirs
+    int x = 0, y = 0;                           // pixel within the tile
+    int tile_width = 0, tile_height = 0;
+};
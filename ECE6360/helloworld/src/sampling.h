@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+#include "vec3.h"
+
+constexpr double pi = 3.14159265358979323846;
+
+// mix the bits of a 64-bit integer (SplitMix64 finalizer), used to turn pixel coordinates into random seeds
+inline uint64_t hash64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+/*
+ * A small and fast random number generator (PCG32). Every pixel sample creates its own generator seeded from the
+ * view, pixel coordinates and sample index, so the image doesn't depend on which thread rendered which tile.
+ */
+class rng {
+public:
+    explicit rng(uint64_t seed = 0) : m_state(hash64(seed)), m_inc((hash64(seed + 1) << 1) | 1) {}
+    rng(uint64_t a, uint64_t b, uint64_t c, uint64_t d) : rng(hash64(hash64(hash64(a) ^ b) ^ c) ^ d) {}
+
+    uint32_t next_u32() {
+        uint64_t old = m_state;
+        m_state = old * 6364136223846793005ull + m_inc;
+        uint32_t xorshifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+        uint32_t rot = (uint32_t)(old >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    }
+
+    // uniform random number in [0, 1)
+    double next() { return next_u32() * (1.0 / 4294967296.0); }
+
+private:
+    uint64_t m_state;
+    uint64_t m_inc;
+};
+
+// orthonormal basis with w along a given unit vector (used to turn local sample directions into world directions)
+struct onb {
+    vec3 u, v, w;
+    explicit onb(const vec3& n) {
+        w = n;
+        vec3 a = std::fabs(w.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+        v = unit_vector(cross(w, a));
+        u = cross(w, v);
+    }
+    vec3 to_world(const vec3& d) const { return d.x() * u + d.y() * v + d.z() * w; }
+};
+
+// cosine-weighted direction on the hemisphere around +z (pdf = cos(theta) / pi)
+inline vec3 sample_cosine_hemisphere(double u1, double u2) {
+    double r = std::sqrt(u1);
+    double phi = 2.0 * pi * u2;
+    return vec3(r * std::cos(phi), r * std::sin(phi), std::sqrt(std::fmax(0.0, 1.0 - u1)));
+}
+
+// uniformly distributed direction on the unit sphere (pdf = 1 / (4 pi))
+inline vec3 sample_uniform_sphere(double u1, double u2) {
+    double z = 1.0 - 2.0 * u1;
+    double r = std::sqrt(std::fmax(0.0, 1.0 - z * z));
+    double phi = 2.0 * pi * u2;
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+// multiple importance sampling weight of a sample from strategy a when strategy b could also have produced it
+inline double power_heuristic(double pdf_a, double pdf_b) {
+    double a2 = pdf_a * pdf_a;
+    double b2 = pdf_b * pdf_b;
+    return a2 + b2 > 0.0 ? a2 / (a2 + b2) : 0.0;
+}
+
+inline double luminance(const color& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+/*
+ * Scatter a ray that hits a dielectric surface: it is reflected with the Fresnel reflectance (Schlick's
+ * approximation, or always under total internal reflection) and refracted otherwise. dir is the unit direction of the
+ * ray and normal the outward unit normal of the surface. The reflectance is also the probability of choosing the
+ * reflection, so the weight of the scattered ray is one (apart from the tint of the material). Returns the new
+ * direction and sets `inside` to the side of the surface it leaves on (true for the inside of the object).
+ */
+inline vec3 scatter_dielectric(const vec3& dir, const vec3& normal, double ior, double u, bool& inside) {
+    bool entering = dot(dir, normal) < 0.0;
+    vec3 n = entering ? normal : -normal;
+    double eta = entering ? 1.0 / ior : ior;
+    double cos_i = std::fmin(-dot(dir, n), 1.0);
+    double sin2_t = eta * eta * (1.0 - cos_i * cos_i);
+    double r0 = (1.0 - ior) / (1.0 + ior);
+    r0 = r0 * r0;
+    double reflectance = sin2_t >= 1.0 ? 1.0 : r0 + (1.0 - r0) * std::pow(1.0 - cos_i, 5.0);
+    if (u < reflectance) {
+        inside = !entering;
+        return dir + 2.0 * cos_i * n;
+    }
+    inside = entering;
+    return eta * dir + (eta * cos_i - std::sqrt(1.0 - sin2_t)) * n;
+}
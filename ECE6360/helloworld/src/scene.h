@@ -0,0 +1,75 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "ray.h"
+#include "vec3.h"
+#include "volume.h"
+
+class isosurface;
+class medium;
+class tube_set;
+class sdf_scene;
+
+/*
+ * Surface reflectance used by the path tracer (the preview only tints its normal colors by the albedo, and shows glass
+ * as a Fresnel mix of the environment). A dielectric (glass) reflects or refracts every ray perfectly, chosen by its
+ * Fresnel reflectance, and tints the light by its albedo.
+ */
+struct material {
+    enum type_id { lambertian = 0, dielectric = 1 };
+    int type = lambertian;
+    color albedo = color(0.5, 0.5, 0.5);
+    double ior = 1.5;               // index of refraction (dielectrics only)
+};
+
+// A sphere defined by its center and radius
+struct sphere {
+    point3 center;
+    double radius = 1.0;
+    int material = 0;               // index into scene::materials
+};
+
+// Information about the closest intersection found along a ray
+struct hit_record {
+    double t = 0.0;                 // ray parameter of the hit point
+    point3 p;                       // position of the hit point
+    vec3 normal;                    // unit surface normal at the hit point (pointing outwards)
+    int object = -1;                // index of the object that was hit
+    int material = 0;               // index of the material at the hit point
+};
+
+/*
+ * Everything that can be seen by the renderer. A scene is only read while rendering, so a single scene can be
+ * shared by all of the render threads and by all of the views in a multi-view render.
+ */
+class scene {
+public:
+    std::vector<sphere> spheres;
+    std::shared_ptr<volume> vol;            // optional scalar volume
+    std::shared_ptr<tube_set> tubes;        // optional streamlines / fiber tracts drawn as capsules or cylinders
+    std::shared_ptr<sdf_scene> sdf;         // optional implicit surfaces rendered by sphere tracing
+
+    std::vector<material> materials = { material() };
+
+    /*
+     * The volume is either rendered with direct volume ray casting, as the isosurface at iso_value, or (when path
+     * tracing) as a participating medium whose extinction is the volume scaled by medium_density
+     */
+    enum volume_mode_type { volume_direct = 0, volume_isosurface = 1, volume_medium = 2 };
+    int volume_mode = volume_direct;
+    std::shared_ptr<isosurface> iso;        // min/max octree used to ray cast the isosurface
+    double iso_value = 0.5;
+    int iso_material = 0;
+    std::shared_ptr<medium> fog;            // participating medium built from the volume (with its majorant grid)
+    double medium_density = 40.0;
+    color medium_albedo = color(0.9, 0.9, 0.9);
+
+    // the scene rendered at startup: a single sphere in front of the camera
+    static scene default_scene() {
+        scene world;
+        world.spheres.push_back(sphere{ point3(0, 0, -1), 0.5 });
+        return world;
+    }
+};
@@ -0,0 +1,198 @@
+#include "scene_file.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+scene_description scene_description::load(const std::string& filename) {
+	std::ifstream in(filename);
+	if (!in)
+		throw std::runtime_error("Unable to open scene file " + filename);
+
+	scene_description desc;
+	std::string line;
+	int line_number = 0;
+	while (std::getline(in, line)) {
+		line_number++;
+		line = line.substr(0, line.find('#'));
+		std::istringstream fields(line);
+		std::string keyword;
+		if (!(fields >> keyword))
+			continue;
+
+		auto error = [&](const std::string& message) {
+			return std::runtime_error(filename + ":" + std::to_string(line_number) + ": " + message);
+		};
+		bool valid = true;
+		if (keyword == "material") {
+			double r, g, b;
+			valid = (bool)(fields >> r >> g >> b);
+			desc.materials.push_back(material{ material::lambertian, color(r, g, b) });
+		}
+		else if (keyword == "glass") {
+			double ior, r = 1.0, g = 1.0, b = 1.0;
+			valid = (bool)(fields >> ior);
+			if (valid && !(fields >> r >> g >> b)) {
+				r = g = b = 1.0;
+				fields.clear();
+			}
+			if (valid && ior <= 0.0)
+				throw error("glass index of refraction must be positive");
+			desc.materials.push_back(material{ material::dielectric, color(r, g, b), ior });
+		}
+		else if (keyword == "sphere") {
+			double x, y, z, radius;
+			int m = 0;
+			valid = (bool)(fields >> x >> y >> z >> radius);
+			if (valid && !(fields >> m)) {
+				m = 0;
+				fields.clear();
+			}
+			if (valid && radius <= 0.0)
+				throw error("sphere radius must be positive");
+			desc.spheres.push_back(sphere{ point3(x, y, z), radius, m });
+		}
+		else if (keyword == "segment") {
+			double ax, ay, az, bx, by, bz, radius;
+			valid = (bool)(fields >> ax >> ay >> az >> bx >> by >> bz >> radius);
+			desc.segments.push_back(tube_set::segment{ point3(ax, ay, az), point3(bx, by, bz), radius });
+		}
+		else if (keyword == "polyline") {
+			double radius, x, y, z;
+			valid = (bool)(fields >> radius);
+			std::vector<point3> points;
+			while (fields >> x >> y >> z)
+				points.push_back(point3(x, y, z));
+			for (size_t i = 1; i < points.size(); i++)
+				desc.segments.push_back(tube_set::segment{ points[i - 1], points[i], radius });
+			fields.clear();
+		}
+		else if (keyword == "tubes") {
+			std::string shape;
+			fields >> shape;
+			if (shape == "capsule")
+				desc.tube_shape = tube_set::capsule;
+			else if (shape == "cylinder")
+				desc.tube_shape = tube_set::cylinder;
+			else
+				throw error("unknown tube shape \"" + shape + "\"");
+		}
+		else {
+			throw error("unknown keyword \"" + keyword + "\"");
+		}
+
+		std::string extra;
+		if (!valid || (fields >> extra))
+			throw error("expected " + keyword + " parameters");
+	}
+
+	if (desc.materials.empty())
+		desc.materials.push_back(material());
+	for (const sphere& s : desc.spheres) {
+		if (s.material < 0 || s.material >= (int)desc.materials.size())
+			throw std::runtime_error(filename + ": sphere material " + std::to_string(s.material) + " doesn't exist");
+	}
+	return desc;
+}
+
+std::shared_ptr<tube_set> scene_description::make_tubes() const {
+	if (segments.empty())
+		return nullptr;
+	auto tubes = std::make_shared<tube_set>();
+	for (const tube_set::segment& s : segments)
+		tubes->add_segment(s.a, s.b, s.radius);
+	tubes->build();
+	tubes->shape = tube_shape;
+	return tubes;
+}
+
+static bool Same(const vec3& a, const vec3& b) {
+	return a.x() == b.x() && a.y() == b.y() && a.z() == b.z();
+}
+
+scene_changes scene_changes::diff(const scene_description& before, const scene_description& after) {
+	scene_changes changes;
+
+	changes.materials = before.materials.size() != after.materials.size();
+	for (size_t i = 0; !changes.materials && i < after.materials.size(); i++)
+		changes.materials = before.materials[i].type != after.materials[i].type ||
+			!Same(before.materials[i].albedo, after.materials[i].albedo) || before.materials[i].ior != after.materials[i].ior;
+
+	changes.spheres_removed = after.spheres.size() < before.spheres.size();
+	for (size_t i = 0; i < std::min(before.spheres.size(), after.spheres.size()); i++) {
+		const sphere& a = before.spheres[i];
+		const sphere& b = after.spheres[i];
+		if (!Same(a.center, b.center) || a.radius != b.radius || a.material != b.material)
+			changes.spheres.push_back({ (int)i, b });
+	}
+	// spheres appended at the end can be rendered like moved ones (they didn't cover any pixels before)
+	for (size_t i = before.spheres.size(); i < after.spheres.size(); i++)
+		changes.spheres.push_back({ (int)i, after.spheres[i] });
+
+	changes.segment_count = before.segments.size() != after.segments.size();
+	if (!changes.segment_count) {
+		for (size_t i = 0; i < after.segments.size(); i++) {
+			const tube_set::segment& a = before.segments[i];
+			const tube_set::segment& b = after.segments[i];
+			if (!Same(a.a, b.a) || !Same(a.b, b.b) || a.radius != b.radius)
+				changes.segments.push_back({ i, b });
+		}
+	}
+	changes.tube_shape = before.tube_shape != after.tube_shape;
+	return changes;
+}
+
+file_watcher::file_watcher(const std::string& filename) : m_path(std::filesystem::absolute(filename)) {
+#ifdef __linux__
+	m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (m_fd >= 0 && inotify_add_watch(m_fd, m_path.parent_path().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		close(m_fd);
+		m_fd = -1;
+	}
+#endif
+	m_time = write_time();
+}
+
+file_watcher::~file_watcher() {
+#ifdef __linux__
+	if (m_fd >= 0)
+		close(m_fd);
+#endif
+}
+
+std::filesystem::file_time_type file_watcher::write_time() const {
+	std::error_code error;
+	std::filesystem::file_time_type time = std::filesystem::last_write_time(m_path, error);
+	return error ? std::filesystem::file_time_type::min() : time;
+}
+
+bool file_watcher::changed() {
+#ifdef __linux__
+	if (m_fd >= 0) {
+		// drain every pending event, the file only has to be reloaded once no matter how many times it was written
+		bool written = false;
+		alignas(inotify_event) char buffer[4096];
+		ssize_t length;
+		while ((length = read(m_fd, buffer, sizeof(buffer))) > 0) {
+			for (ssize_t offset = 0; offset < length;) {
+				const inotify_event* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+				if (event->len > 0 && m_path.filename() == event->name)
+					written = true;
+				offset += sizeof(inotify_event) + event->len;
+			}
+		}
+		return written;
+	}
+#endif
+	std::filesystem::file_time_type time = write_time();
+	if (time == m_time)
+		return false;
+	m_time = time;
+	return true;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "scene.h"
+#include "tubes.h"
+
+/*
+ * The editable part of a scene as it is written in a scene file: a plain text file with one object per line.
+ *
+ *   # comment
+ *   material r g b                  diffuse material (numbered from 0, a default one is added if there are none)
+ *   glass ior [r g b]               dielectric material (numbered along with the diffuse ones), optionally tinted
+ *   sphere x y z radius [material]
+ *   segment ax ay az bx by bz radius
+ *   polyline radius x y z x y z ... consecutive points joined by segments
+ *   tubes capsule|cylinder          shape of all of the segments
+ *
+ * Objects are numbered in the order they appear in the file, so when the file is saved again the new description
+ * can be compared object by object with the old one (see diff()).
+ */
+struct scene_description {
+    std::vector<material> materials;
+    std::vector<sphere> spheres;
+    std::vector<tube_set::segment> segments;
+    int tube_shape = tube_set::capsule;
+
+    // parse a scene file (throws std::runtime_error with the line number on errors)
+    static scene_description load(const std::string& filename);
+
+    // build the tube set for the segments (nullptr if there aren't any)
+    std::shared_ptr<tube_set> make_tubes() const;
+};
+
+/*
+ * Differences between two versions of a scene file. Spheres and segments that were moved or resized are listed
+ * with their index (spheres added at the end are listed too), so that the renderer can update them in place instead
+ * of starting over. Everything that can't be updated in place (removed spheres, added or removed segments,
+ * materials, the tube shape) is flagged instead.
+ */
+struct scene_changes {
+    bool materials = false;
+    bool spheres_removed = false;
+    bool segment_count = false;             // segments were added or removed
+    bool tube_shape = false;
+    std::vector<std::pair<int, sphere>> spheres;
+    std::vector<std::pair<size_t, tube_set::segment>> segments;
+
+    static scene_changes diff(const scene_description& before, const scene_description& after);
+
+    bool empty() const {
+        return !materials && !spheres_removed && !segment_count && !tube_shape && spheres.empty() && segments.empty();
+    }
+};
+
+/*
+ * Notices when a file is written. On Linux the directory that contains the file is watched with inotify, which
+ * also catches editors that save by writing a new file and renaming it over the old one (the watch on the file
+ * itself would be lost). Other platforms poll the modification time of the file.
+ */
+class file_watcher {
+public:
+    explicit file_watcher(const std::string& filename);
+    ~file_watcher();
+    file_watcher(const file_watcher&) = delete;
+    file_watcher& operator=(const file_watcher&) = delete;
+
+    // true if the file was written since the last call (never blocks)
+    bool changed();
+
+private:
+    std::filesystem::path m_path;
+    int m_fd = -1;                          // inotify instance (-1 when polling)
+    std::filesystem::file_time_type m_time;
+
+    std::filesystem::file_time_type write_time() const;
+};
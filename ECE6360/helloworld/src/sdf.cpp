@@ -0,0 +1,337 @@
+#include "sdf.h"
+#include "sampling.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+// the deepest CSG tree that distance() can evaluate (the size of its fixed value stack)
+const int sdf_stack_size = 64;
+
+int sdf_scene::add_node(const node& n) {
+	m_nodes.push_back(n);
+	return (int)m_nodes.size() - 1;
+}
+
+int sdf_scene::add_sphere(const point3& center, double radius) {
+	node n;
+	n.op = sphere;
+	for (int a = 0; a < 3; a++)
+		n.param[a] = (float)center[a];
+	n.param[3] = (float)radius;
+	n.lo = center - vec3(radius, radius, radius);
+	n.hi = center + vec3(radius, radius, radius);
+	return add_node(n);
+}
+
+int sdf_scene::add_box(const point3& center, const vec3& half_size, double rounding) {
+	node n;
+	n.op = box;
+	for (int a = 0; a < 3; a++) {
+		n.param[a] = (float)center[a];
+		n.param[3 + a] = (float)half_size[a];
+	}
+	n.param[6] = (float)rounding;
+	n.lo = center - half_size;
+	n.hi = center + half_size;
+	return add_node(n);
+}
+
+int sdf_scene::add_torus(const point3& center, double major_radius, double minor_radius) {
+	node n;
+	n.op = torus;
+	for (int a = 0; a < 3; a++)
+		n.param[a] = (float)center[a];
+	n.param[3] = (float)major_radius;
+	n.param[4] = (float)minor_radius;
+	vec3 extent(major_radius + minor_radius, minor_radius, major_radius + minor_radius);
+	n.lo = center - extent;
+	n.hi = center + extent;
+	return add_node(n);
+}
+
+int sdf_scene::add_capsule(const point3& a, const point3& b, double radius) {
+	node n;
+	n.op = capsule;
+	for (int c = 0; c < 3; c++) {
+		n.param[c] = (float)a[c];
+		n.param[3 + c] = (float)b[c];
+		n.lo[c] = std::min(a[c], b[c]) - radius;
+		n.hi[c] = std::max(a[c], b[c]) + radius;
+	}
+	n.param[6] = (float)radius;
+	return add_node(n);
+}
+
+int sdf_scene::combine(op_type op, int a, int b, double k) {
+	if (op < op_union || a < 0 || b < 0 || a >= (int)m_nodes.size() || b >= (int)m_nodes.size())
+		throw std::runtime_error("Invalid SDF operation");
+
+	node n;
+	n.op = op;
+	n.a = a;
+	n.b = b;
+	n.param[0] = (float)std::max(k, 1e-6);
+	const node& na = m_nodes[a];
+	const node& nb = m_nodes[b];
+	for (int c = 0; c < 3; c++) {
+		switch (op) {
+		case op_subtract:                   // carving can only remove material from a
+			n.lo[c] = na.lo[c];
+			n.hi[c] = na.hi[c];
+			break;
+		case op_intersect:
+			n.lo[c] = std::max(na.lo[c], nb.lo[c]);
+			n.hi[c] = std::min(na.hi[c], nb.hi[c]);
+			break;
+		default:
+			// the smooth union can bulge out by up to k / 4 where the two shapes blend
+			double pad = op == op_smooth_union ? 0.25 * k : 0.0;
+			n.lo[c] = std::min(na.lo[c], nb.lo[c]) - pad;
+			n.hi[c] = std::max(na.hi[c], nb.hi[c]) + pad;
+			break;
+		}
+	}
+	return add_node(n);
+}
+
+void sdf_scene::set_root(int root) {
+	// Post-order traversal: every node is evaluated after its children, using a stack of values
+	m_program.clear();
+	m_stack_depth = 0;
+	int depth = 0;
+	auto emit = [&](auto&& self, int index) -> void {
+		const node& n = m_nodes[index];
+		if (n.op >= op_union) {
+			self(self, n.a);
+			self(self, n.b);
+			depth--;
+		}
+		else {
+			depth++;
+		}
+		m_stack_depth = std::max(m_stack_depth, depth);
+		m_program.push_back(index);
+	};
+	emit(emit, root);
+	if (m_stack_depth > sdf_stack_size)
+		throw std::runtime_error("SDF tree is too deep");
+
+	m_bounds.clear();
+	collect_bounds(root, 0.0);
+}
+
+/*
+ * The boxes used to clip rays: unions are split into the boxes of their children (padded by the smooth union's blend
+ * distance), so that a scene made of separate shapes isn't bounded by one big box around all of them.
+ */
+void sdf_scene::collect_bounds(int index, double pad) {
+	const node& n = m_nodes[index];
+	if (n.op == op_union || n.op == op_smooth_union) {
+		double child_pad = pad + (n.op == op_smooth_union ? 0.25 * n.param[0] : 0.0);
+		collect_bounds(n.a, child_pad);
+		collect_bounds(n.b, child_pad);
+		return;
+	}
+	vec3 p(pad, pad, pad);
+	m_bounds.push_back(bounds{ n.lo - p, n.hi + p });
+}
+
+static float4 length3(float4 x, float4 y, float4 z) {
+	return sqrt(x * x + y * y + z * z);
+}
+
+float4 sdf_scene::distance(const vec3x4& p) const {
+	float4 stack[sdf_stack_size];
+	int top = 0;
+	const float4 zero(0.0f), one(1.0f);
+	for (int index : m_program) {
+		const node& n = m_nodes[index];
+		const float* q = n.param;
+		switch (n.op) {
+		case sphere:
+			stack[top++] = length3(p.x - q[0], p.y - q[1], p.z - q[2]) - q[3];
+			break;
+		case box: {
+			// distance to a box shrunk by the rounding radius, minus that radius
+			float4 dx = abs(p.x - q[0]) - (q[3] - q[6]);
+			float4 dy = abs(p.y - q[1]) - (q[4] - q[6]);
+			float4 dz = abs(p.z - q[2]) - (q[5] - q[6]);
+			float4 outside = length3(max(dx, zero), max(dy, zero), max(dz, zero));
+			float4 inside = min(max(dx, max(dy, dz)), zero);
+			stack[top++] = outside + inside - q[6];
+			break;
+		}
+		case torus: {
+			float4 dx = p.x - q[0], dy = p.y - q[1], dz = p.z - q[2];
+			float4 ring = sqrt(dx * dx + dz * dz) - q[3];
+			stack[top++] = sqrt(ring * ring + dy * dy) - q[4];
+			break;
+		}
+		case capsule: {
+			float4 pax = p.x - q[0], pay = p.y - q[1], paz = p.z - q[2];
+			float bax = q[3] - q[0], bay = q[4] - q[1], baz = q[5] - q[2];
+			float baba = bax * bax + bay * bay + baz * baz;
+			float4 h = min(max((pax * bax + pay * bay + paz * baz) / (baba > 0.0f ? baba : 1.0f), zero), one);
+			stack[top++] = length3(pax - h * bax, pay - h * bay, paz - h * baz) - q[6];
+			break;
+		}
+		default: {
+			float4 b = stack[--top];
+			float4 a = stack[--top];
+			if (n.op == op_union) {
+				stack[top++] = min(a, b);
+			}
+			else if (n.op == op_smooth_union) {
+				// polynomial smooth minimum: blends the two distances where they are within k of each other
+				float4 k(q[0]);
+				float4 h = max(k - abs(a - b), zero) / k;
+				stack[top++] = min(a, b) - h * h * k * 0.25f;
+			}
+			else if (n.op == op_subtract) {
+				stack[top++] = max(a, -b);
+			}
+			else {
+				stack[top++] = max(a, b);
+			}
+			break;
+		}
+		}
+	}
+	return top > 0 ? stack[0] : float4(std::numeric_limits<float>::infinity());
+}
+
+double sdf_scene::distance(const point3& p) const {
+	vec3x4 p4{ float4((float)p.x()), float4((float)p.y()), float4((float)p.z()) };
+	return distance(p4)[0];
+}
+
+vec3 sdf_scene::normal(const point3& p) const {
+	// the four corners of a tetrahedron around p are evaluated as one packet
+	const float h = 5e-4f;
+	vec3x4 p4{ float4((float)p.x()) + float4(h, -h, -h, h),
+			   float4((float)p.y()) + float4(-h, -h, h, h),
+			   float4((float)p.z()) + float4(-h, h, -h, h) };
+	float4 d = distance(p4);
+	vec3 n(d[0] - d[1] - d[2] + d[3], -d[0] - d[1] + d[2] + d[3], -d[0] + d[1] - d[2] + d[3]);
+	return n.length_squared() > 0.0 ? unit_vector(n) : vec3(0, 1, 0);
+}
+
+void sdf_scene::intersect4(const ray r[4], double tmin, const double tmax[4], hit_record rec[4], bool hit[4]) const {
+	/*
+	 * Secondary rays start within a hair of the surface they leave (or enter, for refraction), where the first step
+	 * would already pass the hit test. Those origins are moved off the surface along the normal, to the side the ray
+	 * heads toward, so the march starts clear of the surface it came from.
+	 */
+	point3 origin[4];
+	alignas(16) float o[3][4], d[3][4];
+	for (int lane = 0; lane < 4; lane++) {
+		origin[lane] = r[lane].origin();
+		for (int a = 0; a < 3; a++)
+			o[a][lane] = (float)origin[lane][a];
+	}
+	alignas(16) float start_dist[4];
+	distance(vec3x4{ float4::load(o[0]), float4::load(o[1]), float4::load(o[2]) }).store(start_dist);
+	for (int lane = 0; lane < 4; lane++) {
+		if (std::fabs(start_dist[lane]) >= start_offset || tmax[lane] < tmin)
+			continue;
+		vec3 n = normal(origin[lane]);
+		double side = dot(r[lane].direction(), n) >= 0.0 ? 1.0 : -1.0;
+		origin[lane] = origin[lane] + (side * start_offset - start_dist[lane]) * n;
+	}
+
+	// Bounding pre-pass: every ray only marches between its first entry into and last exit from the shape boxes
+	alignas(16) float t_start[4], t_end[4];
+	for (int lane = 0; lane < 4; lane++) {
+		hit[lane] = false;
+		double first = INFINITY, last = -INFINITY;
+		for (const bounds& b : m_bounds) {
+			double t0 = tmin, t1 = tmax[lane];
+			for (int a = 0; a < 3 && t0 <= t1; a++) {
+				double inv = 1.0 / r[lane].direction()[a];
+				double ta = (b.lo[a] - origin[lane][a]) * inv;
+				double tb = (b.hi[a] - origin[lane][a]) * inv;
+				if (ta > tb) std::swap(ta, tb);
+				t0 = ta > t0 ? ta : t0;
+				t1 = tb < t1 ? tb : t1;
+			}
+			if (t0 <= t1) {
+				first = std::min(first, t0);
+				last = std::max(last, t1);
+			}
+		}
+		t_start[lane] = first < last ? (float)first : 1.0f;
+		t_end[lane] = first < last ? (float)(last + hit_epsilon * std::max(last, 1.0)) : 0.0f;	// so a ray leaving the box from inside still hits
+		for (int a = 0; a < 3; a++) {
+			o[a][lane] = (float)origin[lane][a];
+			d[a][lane] = (float)r[lane].direction()[a];
+		}
+	}
+
+	/*
+	 * Sphere trace all four rays together until every one of them has hit the surface or left its interval. Rays step
+	 * by the absolute distance, so a ray that starts inside a shape (refracted into glass) marches forward to where
+	 * it leaves the shape.
+	 */
+	vec3x4 o4{ float4::load(o[0]), float4::load(o[1]), float4::load(o[2]) };
+	vec3x4 d4{ float4::load(d[0]), float4::load(d[1]), float4::load(d[2]) };
+	float4 t = float4::load(t_start);
+	float4 end = float4::load(t_end);
+	float4 active = t < end;
+	float4 t_hit(-1.0f);
+	for (int step = 0; step < max_steps && any(active); step++) {
+		float4 dist = distance(o4 + t * d4);
+		float4 done = active & (abs(dist) < float4(hit_epsilon) * max(t, float4(1.0f)));
+		t_hit = select(done, t, t_hit);
+		active = andnot(done, active);
+		t = t + abs(dist);
+		active = active & (t < end);
+	}
+
+	alignas(16) float t_out[4];
+	t_hit.store(t_out);
+	for (int lane = 0; lane < 4; lane++) {
+		if (t_out[lane] < 0.0f || t_out[lane] < tmin || t_out[lane] > tmax[lane])
+			continue;
+		hit[lane] = true;
+		rec[lane].t = t_out[lane];
+		rec[lane].p = origin[lane] + t_out[lane] * r[lane].direction();
+		rec[lane].normal = normal(rec[lane].p);
+		rec[lane].object = -1;
+		rec[lane].material = material;
+	}
+}
+
+bool sdf_scene::intersect(const ray& r, double tmin, double tmax, hit_record& rec) const {
+	// a packet with one live ray (the other lanes get an empty interval)
+	ray rays[4] = { r, r, r, r };
+	double tmaxes[4] = { tmax, -INFINITY, -INFINITY, -INFINITY };
+	hit_record recs[4];
+	bool hits[4];
+	intersect4(rays, tmin, tmaxes, recs, hits);
+	if (hits[0])
+		rec = recs[0];
+	return hits[0];
+}
+
+/*
+ * A rounded cube carved out by a sphere, with a ball smoothly blended onto its top, a ring around it, and a few
+ * capsules blended into the ring.
+ */
+std::shared_ptr<sdf_scene> sdf_scene::demo() {
+	auto s = std::make_shared<sdf_scene>();
+	point3 c(0.0, -0.1, -1.5);
+	int cube = s->add_box(c, vec3(0.25, 0.25, 0.25), 0.04);
+	int carved = s->combine(op_subtract, cube, s->add_sphere(c, 0.32));
+	int body = s->combine(op_smooth_union, carved, s->add_sphere(c + vec3(0.0, 0.3, 0.0), 0.14), 0.12);
+
+	int ring = s->add_torus(c, 0.48, 0.035);
+	for (int i = 0; i < 3; i++) {
+		double angle = 2.0 * pi * i / 3.0;
+		vec3 spoke(std::cos(angle), 0.0, std::sin(angle));
+		ring = s->combine(op_smooth_union, ring, s->add_capsule(c + 0.48 * spoke, c + 0.48 * spoke + vec3(0.0, 0.25, 0.0), 0.03), 0.08);
+	}
+	s->set_root(s->combine(op_union, body, ring));
+	return s;
+}
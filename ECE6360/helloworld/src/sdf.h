@@ -0,0 +1,75 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "ray.h"
+#include "scene.h"
+#include "simd.h"
+#include "vec3.h"
+
+/*
+ * Implicit surfaces defined by a signed distance field: a tree of primitives and CSG operations (including a smooth
+ * union). Rays are sphere traced in packets of four, starting where they enter the bounding boxes of the shapes.
+ */
+class sdf_scene {
+public:
+    enum op_type { sphere = 0, box, torus, capsule, op_union, op_smooth_union, op_subtract, op_intersect };
+
+    static constexpr int max_steps = 256;
+    static constexpr float hit_epsilon = 1e-4f;             // a ray hits where |distance| < hit_epsilon * max(t, 1)
+    static constexpr float start_offset = 4e-4f;            // rays that start on the surface are moved this far off it
+
+    int material = 0;
+
+    // primitives (each call returns the index of the new node)
+    int add_sphere(const point3& center, double radius);
+    int add_box(const point3& center, const vec3& half_size, double rounding = 0.0);
+    int add_torus(const point3& center, double major_radius, double minor_radius);     // the torus lies in the xz plane
+    int add_capsule(const point3& a, const point3& b, double radius);
+
+    // combine two nodes (k is the blend distance of the smooth union)
+    int combine(op_type op, int a, int b, double k = 0.0);
+
+    // use a node as the whole shape, and compile the tree into a program that can be evaluated without recursion
+    void set_root(int root);
+
+    // signed distance at four points at once
+    float4 distance(const vec3x4& p) const;
+    double distance(const point3& p) const;
+
+    // surface normal from the gradient of the field (estimated with four samples on a tetrahedron)
+    vec3 normal(const point3& p) const;
+
+    // closest intersection in (tmin, tmax) (the ray direction must be unit length)
+    bool intersect(const ray& r, double tmin, double tmax, hit_record& rec) const;
+
+    // intersect four rays as a packet (hit[i] is false for rays that don't hit within tmax[i])
+    void intersect4(const ray r[4], double tmin, const double tmax[4], hit_record rec[4], bool hit[4]) const;
+
+    size_t node_count() const { return m_nodes.size(); }
+    size_t bound_count() const { return m_bounds.size(); }
+
+    // a few blended and carved shapes in front of the camera
+    static std::shared_ptr<sdf_scene> demo();
+
+private:
+    struct node {
+        int op = sphere;
+        float param[7] = { 0, 0, 0, 0, 0, 0, 0 };
+        int a = -1, b = -1;             // children of CSG operations
+        vec3 lo, hi;                    // bounding box of the surface
+    };
+
+    struct bounds {
+        vec3 lo, hi;
+    };
+
+    std::vector<node> m_nodes;
+    std::vector<int> m_program;         // node indices in post-order (children before their parent)
+    std::vector<bounds> m_bounds;       // boxes around the top-level shapes, used to clip rays before marching
+    int m_stack_depth = 0;
+
+    int add_node(const node& n);
+    void collect_bounds(int index, double pad);
+};
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+/*
+ * A minimal four-wide float vector for code that processes four primitives (or four rays) at a time. On x86 every
+ * operation is a single SSE instruction. Other architectures get a plain array version of the same interface, which
+ * the compiler can still vectorize. Comparisons return masks with all bits set in the lanes where they are true, so
+ * that branches can be replaced by select() and any().
+ */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#define SIMD_SSE 1
+#endif
+
+struct alignas(16) float4 {
+#ifdef SIMD_SSE
+    __m128 v;
+
+    float4() : v(_mm_setzero_ps()) {}
+    float4(__m128 x) : v(x) {}
+    float4(float x) : v(_mm_set1_ps(x)) {}
+    float4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) {}
+
+    static float4 load(const float* p) { return _mm_load_ps(p); }
+    void store(float* p) const { _mm_store_ps(p, v); }
+    float operator[](int i) const { alignas(16) float f[4]; store(f); return f[i]; }
+#else
+    float v[4];
+
+    float4() : v{ 0, 0, 0, 0 } {}
+    float4(float x) : v{ x, x, x, x } {}
+    float4(float a, float b, float c, float d) : v{ a, b, c, d } {}
+
+    static float4 load(const float* p) { float4 r; std::memcpy(r.v, p, sizeof(r.v)); return r; }
+    void store(float* p) const { std::memcpy(p, v, sizeof(v)); }
+    float operator[](int i) const { return v[i]; }
+#endif
+};
+
+#ifdef SIMD_SSE
+inline float4 operator+(float4 a, float4 b) { return _mm_add_ps(a.v, b.v); }
+inline float4 operator-(float4 a, float4 b) { return _mm_sub_ps(a.v, b.v); }
+inline float4 operator*(float4 a, float4 b) { return _mm_mul_ps(a.v, b.v); }
+inline float4 operator/(float4 a, float4 b) { return _mm_div_ps(a.v, b.v); }
+inline float4 operator-(float4 a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)); }
+inline float4 min(float4 a, float4 b) { return _mm_min_ps(a.v, b.v); }
+inline float4 max(float4 a, float4 b) { return _mm_max_ps(a.v, b.v); }
+inline float4 sqrt(float4 a) { return _mm_sqrt_ps(a.v); }
+inline float4 abs(float4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+
+inline float4 operator<(float4 a, float4 b) { return _mm_cmplt_ps(a.v, b.v); }
+inline float4 operator<=(float4 a, float4 b) { return _mm_cmple_ps(a.v, b.v); }
+inline float4 operator>(float4 a, float4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline float4 operator>=(float4 a, float4 b) { return _mm_cmpge_ps(a.v, b.v); }
+inline float4 operator&(float4 a, float4 b) { return _mm_and_ps(a.v, b.v); }
+inline float4 operator|(float4 a, float4 b) { return _mm_or_ps(a.v, b.v); }
+
+// lanes of a where the mask is not set (and zero elsewhere)
+inline float4 andnot(float4 mask, float4 a) { return _mm_andnot_ps(mask.v, a.v); }
+
+// lanes of a where the mask is set, lanes of b everywhere else
+inline float4 select(float4 mask, float4 a, float4 b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+
+// one bit per lane (bit i is set if lane i of the mask is set)
+inline int movemask(float4 mask) { return _mm_movemask_ps(mask.v); }
+#else
+template <typename F>
+inline float4 lanes(float4 a, float4 b, F f) {
+    float4 r;
+    for (int i = 0; i < 4; i++) r.v[i] = f(a.v[i], b.v[i]);
+    return r;
+}
+inline float mask_value(bool b) { uint32_t bits = b ? 0xffffffffu : 0u; float f; std::memcpy(&f, &bits, 4); return f; }
+inline bool mask_bit(float f) { uint32_t bits; std::memcpy(&bits, &f, 4); return bits != 0; }
+
+inline float4 operator+(float4 a, float4 b) { return lanes(a, b, [](float x, float y) { return x + y; }); }
+inline float4 operator-(float4 a, float4 b) { return lanes(a, b, [](float x, float y) { return x - y; }); }
+inline float4 operator*(float4 a, float4 b) { return lanes(a, b, [](float x, float y) { return x * y; }); }
+inline float4 operator/(float4 a, float4 b) { return lanes(a, b, [](float x, float y) { return x / y; }); }
+inline float4 operator-(float4 a) { return float4(0.0f) - a; }
+inline float4 min(float4 a, float4 b) { return lanes(a, b, [](float x, float y) { return y < x ? y : x; }); }
+inline float4 max(float4 a, float4 b) { return lanes(a, b, [](float x, float y) { return y > x ? y : x; }); }
+inline float4 sqrt(float4 a) { return lanes(a, a, [](float x, float) { return std::sqrt(x); }); }
+inline float4 abs(float4 a) { return lanes(a, a, [](float x, float) { return std::fabs(x); }); }
+
+inline float4 operator<(float4 a, float4 b) { return lanes(a, b, [](float x, float y) { return mask_value(x < y); }); }
+inline float4 operator<=(float4 a, float4 b) { return lanes(a, b, [](float x, float y) { return mask_value(x <= y); }); }
+inline float4 operator>(float4 a, float4 b) { return lanes(a, b, [](float x, float y) { return mask_value(x > y); }); }
+inline float4 operator>=(float4 a, float4 b) { return lanes(a, b, [](float x, float y) { return mask_value(x >= y); }); }
+inline float4 operator&(float4 a, float4 b) { return lanes(a, b, [](float x, float y) { return mask_value(mask_bit(x) && mask_bit(y)); }); }
+inline float4 operator|(float4 a, float4 b) { return lanes(a, b, [](float x, float y) { return mask_value(mask_bit(x) || mask_bit(y)); }); }
+
+inline float4 andnot(float4 mask, float4 a) {
+    float4 r;
+    for (int i = 0; i < 4; i++) r.v[i] = mask_bit(mask.v[i]) ? mask_value(false) : a.v[i];
+    return r;
+}
+
+inline float4 select(float4 mask, float4 a, float4 b) {
+    float4 r;
+    for (int i = 0; i < 4; i++) r.v[i] = mask_bit(mask.v[i]) ? a.v[i] : b.v[i];
+    return r;
+}
+
+inline int movemask(float4 mask) {
+    int bits = 0;
+    for (int i = 0; i < 4; i++) bits |= mask_bit(mask.v[i]) ? 1 << i : 0;
+    return bits;
+}
+#endif
+
+inline bool any(float4 mask) { return movemask(mask) != 0; }
+inline float4 madd(float4 a, float4 b, float4 c) { return a * b + c; }
+
+// three-component vector of float4s: four 3D vectors stored as separate x, y, and z lanes
+struct vec3x4 {
+    float4 x, y, z;
+};
+inline float4 dot(const vec3x4& a, const vec3x4& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+inline vec3x4 operator+(const vec3x4& a, const vec3x4& b) { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+inline vec3x4 operator-(const vec3x4& a, const vec3x4& b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+inline vec3x4 operator*(float4 t, const vec3x4& a) { return { t * a.x, t * a.y, t * a.z }; }
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+/*
+ * Immutable versions of an object that one thread edits while others read it (read-copy-update): readers pin a
+ * version with an atomic load, and the writer publishes a new copy with an atomic store. Shared parts stay unchanged.
+ */
+template <typename T>
+class snapshot_store {
+public:
+    snapshot_store() : m_live(std::make_shared<std::atomic<int>>(0)) {}
+
+    // pin the current version (nullptr if nothing has been published yet) and optionally return its version number
+    std::shared_ptr<const T> pin(uint64_t* version = nullptr) const {
+        std::shared_ptr<const entry> current = m_current.load(std::memory_order_acquire);
+        if (version != nullptr)
+            *version = current ? current->version : 0;
+        return current ? std::shared_ptr<const T>(current, &current->value) : nullptr;
+    }
+
+    // make a copy of `value` the current version and return it (already pinned for the caller)
+    std::shared_ptr<const T> publish(T value) {
+        // the counter is shared with the deleter, so versions that outlive the store can still be deleted safely
+        std::shared_ptr<std::atomic<int>> live = m_live;
+        std::shared_ptr<const entry> next(new entry{ std::move(value), ++m_version }, [live](const entry* e) {
+            live->fetch_sub(1, std::memory_order_relaxed);
+            delete e;
+        });
+        live->fetch_add(1, std::memory_order_relaxed);
+        m_current.store(next, std::memory_order_release);
+        return std::shared_ptr<const T>(next, &next->value);
+    }
+
+    // number of the most recently published version (versions are numbered from 1)
+    uint64_t version() const { return m_version; }
+
+    // number of versions that still exist (the current one plus older ones that are still pinned)
+    int live_versions() const { return m_live->load(std::memory_order_relaxed); }
+
+private:
+    struct entry {
+        T value;
+        uint64_t version;
+    };
+
+    std::atomic<std::shared_ptr<const entry>> m_current;
+    std::atomic<uint64_t> m_version = 0;        // only incremented by the writer
+    std::shared_ptr<std::atomic<int>> m_live;
+};
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+/*
+ * Lazy C++20 coroutine tasks: a task<T> starts when it is awaited, continues on whichever thread resumed it, and
+ * rethrows its exception in the awaiter. WhenAll() runs tasks at the same time, and SyncWait() blocks until one ends.
+ */
+template <typename T = void>
+class task;
+
+struct task_promise_base {
+    std::coroutine_handle<> continuation = std::noop_coroutine();  // coroutine that awaits this one
+    std::exception_ptr exception;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    // when the task finishes, the coroutine that awaited it continues directly (without growing the stack)
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept { return h.promise().continuation; }
+        void await_resume() noexcept {}
+    };
+    final_awaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template <typename T>
+struct task_promise : task_promise_base {
+    std::optional<T> value;
+
+    task<T> get_return_object();
+    void return_value(T v) { value = std::move(v); }
+    T result() {
+        if (exception)
+            std::rethrow_exception(exception);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct task_promise<void> : task_promise_base {
+    task<void> get_return_object();
+    void return_void() {}
+    void result() {
+        if (exception)
+            std::rethrow_exception(exception);
+    }
+};
+
+template <typename T>
+class task {
+public:
+    using promise_type = task_promise<T>;
+
+    task() = default;
+    explicit task(std::coroutine_handle<promise_type> h) : m_handle(h) {}
+    task(task&& other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) {}
+    task& operator=(task&& other) noexcept {
+        if (this != &other) {
+            if (m_handle)
+                m_handle.destroy();
+            m_handle = std::exchange(other.m_handle, nullptr);
+        }
+        return *this;
+    }
+    ~task() {
+        if (m_handle)
+            m_handle.destroy();
+    }
+
+    // awaiting a task starts it and returns its result (or rethrows its exception)
+    bool await_ready() const noexcept { return !m_handle || m_handle.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        m_handle.promise().continuation = awaiting;
+        return m_handle;
+    }
+    T await_resume() { return m_handle.promise().result(); }
+
+    // an awaitable that waits for the task to finish without taking its result (so that it can't throw)
+    auto when_ready() noexcept {
+        struct awaiter {
+            std::coroutine_handle<promise_type> h;
+            bool await_ready() noexcept { return !h || h.done(); }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+                h.promise().continuation = awaiting;
+                return h;
+            }
+            void await_resume() noexcept {}
+        };
+        return awaiter{ m_handle };
+    }
+
+private:
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+template <typename T>
+task<T> task_promise<T>::get_return_object() {
+    return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+inline task<void> task_promise<void>::get_return_object() {
+    return task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+/*
+ * A coroutine that runs as soon as it is called and frees itself when it finishes. It is only used to start a task
+ * from code that can't await it, and to call a function once the task is done.
+ */
+struct started_task {
+    struct promise_type {
+        started_task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+template <typename T, typename F>
+started_task StartTask(task<T>& t, F on_done) {
+    co_await t.when_ready();
+    on_done();
+}
+
+// start a task and block the calling thread until it has finished (this must not be called from a pool thread)
+template <typename T>
+T SyncWait(task<T> t) {
+    std::mutex mutex;
+    std::condition_variable finished_cv;
+    bool finished = false;
+    StartTask(t, [&] {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+        finished_cv.notify_one();
+    });
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished_cv.wait(lock, [&] { return finished; });
+    }
+    return t.await_resume();
+}
+
+/*
+ * A flag that a coroutine can await: set() resumes the coroutine that is waiting for it (on the thread that calls
+ * set()), and awaiting an event that is already set continues right away. Only one coroutine may await an event.
+ */
+class async_event {
+public:
+    void set() {
+        void* waiting = m_state.exchange(this);
+        if (waiting != nullptr && waiting != this)
+            std::coroutine_handle<>::from_address(waiting).resume();
+    }
+
+    bool await_ready() const noexcept { return m_state.load() == this; }
+    bool await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        void* expected = nullptr;
+        return m_state.compare_exchange_strong(expected, awaiting.address());   // false if set() got there first
+    }
+    void await_resume() const noexcept {}
+
+private:
+    std::atomic<void*> m_state = nullptr;       // null, the waiting coroutine, or this once the event is set
+};
+
+/*
+ * Starts every task and resumes the awaiter on the thread that finishes the last one (the count starts one higher,
+ * so a task that finishes while the others are still being started can't resume it early).
+ */
+template <typename T>
+class when_all_awaiter {
+public:
+    explicit when_all_awaiter(std::vector<task<T>>& tasks) : m_tasks(tasks) {}
+
+    bool await_ready() const noexcept { return m_tasks.empty(); }
+    bool await_suspend(std::coroutine_handle<> awaiting) {
+        m_continuation = awaiting;
+        m_remaining = m_tasks.size() + 1;
+        for (task<T>& t : m_tasks)
+            StartTask(t, [this] {
+                if (--m_remaining == 0)
+                    m_continuation.resume();
+            });
+        return --m_remaining != 0;
+    }
+    void await_resume() noexcept {}
+
+private:
+    std::vector<task<T>>& m_tasks;
+    std::atomic<size_t> m_remaining = 0;
+    std::coroutine_handle<> m_continuation;
+};
+
+// run tasks at the same time and return their results in order (the first exception is rethrown)
+template <typename T>
+task<std::vector<T>> WhenAll(std::vector<task<T>> tasks) {
+    co_await when_all_awaiter<T>(tasks);
+    std::vector<T> results;
+    results.reserve(tasks.size());
+    for (task<T>& t : tasks)
+        results.push_back(t.await_resume());
+    co_return results;
+}
+
+inline task<void> WhenAll(std::vector<task<void>> tasks) {
+    co_await when_all_awaiter<void>(tasks);
+    for (task<void>& t : tasks)
+        t.await_resume();
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <latch>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * A fixed set of worker threads that execute tasks from a shared queue. Creating threads is expensive, so the
+ * threads are started once and re-used for every render (and every view of a multi-view render).
+ */
+class thread_pool {
+public:
+    // start the worker threads (0 uses one thread per hardware thread)
+    explicit thread_pool(unsigned int threads = 0) {
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned int i = 0; i < threads; i++)
+            m_workers.emplace_back([this] { worker(); });
+    }
+
+    // finish all queued tasks and stop the worker threads
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_task_ready.notify_all();
+        for (std::thread& t : m_workers)
+            t.join();
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    unsigned int size() const { return static_cast<unsigned int>(m_workers.size()); }
+
+    // add a task to the end of the queue
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_tasks.push_back(std::move(task));
+        }
+        m_task_ready.notify_one();
+    }
+
+    /*
+     * An awaitable that moves a coroutine onto the pool: after co_await pool.schedule() the rest of the coroutine
+     * runs as a task on one of the pool's threads (see task.h).
+     */
+    auto schedule() {
+        struct awaiter {
+            thread_pool& pool;
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> h) { pool.submit([h] { h.resume(); }); }
+            void await_resume() const noexcept {}
+        };
+        return awaiter{ *this };
+    }
+
+    // block until the queue is empty and no task is running
+    void wait() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_idle.wait(lock, [this] { return m_tasks.empty() && m_active == 0; });
+    }
+
+    /*
+     * Call fn(0) ... fn(count - 1) using all of the threads and wait for every call to return. Indices are handed out
+     * one at a time, so uneven amounts of work per index are balanced automatically. This must not be called from a
+     * task running on the pool, since the calling thread blocks until the pool's threads have finished the loop.
+     */
+    void parallel_for(int count, const std::function<void(int)>& fn) {
+        std::atomic<int> next = 0;
+        std::latch done(size());
+        for (unsigned int t = 0; t < size(); t++) {
+            submit([&] {
+                for (int i = next++; i < count; i = next++)
+                    fn(i);
+                done.count_down();
+            });
+        }
+        done.wait();
+    }
+
+private:
+    std::vector<std::thread> m_workers;
+    std::deque<std::function<void()>> m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_task_ready;       // signalled when a task is added (or the pool is stopping)
+    std::condition_variable m_idle;             // signalled when the last running task finishes
+    unsigned int m_active = 0;                  // number of tasks currently executing
+    bool m_stop = false;
+
+    void worker() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;) {
+            m_task_ready.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+            if (m_tasks.empty())
+                return;                         // only reached when stopping
+            std::function<void()> task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+            m_active++;
+
+            lock.unlock();
+            task();
+            lock.lock();
+
+            m_active--;
+            if (m_active == 0 && m_tasks.empty())
+                m_idle.notify_all();
+        }
+    }
+};
@@ -0,0 +1,143 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+/*
+ * One recorded zone. The fields are atomics (only ever accessed with relaxed ordering, which compiles to plain loads
+ * and stores) because write_chrome_trace() may read an entry while its thread is overwriting it.
+ */
+struct trace_entry {
+	std::atomic<const char*> name = nullptr;
+	std::atomic<int64_t> start = 0;				// nanoseconds since the program started
+	std::atomic<int64_t> duration = 0;
+	std::atomic<int64_t> value = -1;
+};
+
+// The ring buffer of one thread. Only that thread writes to it, and it publishes every entry by advancing head.
+struct trace_ring {
+	std::atomic<uint64_t> head = 0;				// number of zones recorded so far (entry i is at i % ring_size)
+	std::atomic<const char*> name = nullptr;
+	int id = 0;
+	trace_entry entries[timeline::ring_size];
+};
+
+static std::atomic<bool> trace_enabled = false;
+static const timeline::clock::time_point trace_epoch = timeline::clock::now();
+
+// every ring that was ever created (they are never deleted, since a thread may still record while the program exits)
+static std::mutex ring_mutex;
+static std::vector<trace_ring*>& Rings() {
+	static std::vector<trace_ring*>* rings = new std::vector<trace_ring*>();
+	return *rings;
+}
+
+static thread_local trace_ring* thread_ring = nullptr;
+
+// ring buffer of the calling thread (created the first time the thread records a zone)
+static trace_ring* ThreadRing() {
+	if (thread_ring == nullptr) {
+		auto ring = std::make_unique<trace_ring>();
+		std::lock_guard<std::mutex> lock(ring_mutex);
+		ring->id = (int)Rings().size();
+		thread_ring = ring.release();
+		Rings().push_back(thread_ring);
+	}
+	return thread_ring;
+}
+
+timeline::zone::zone(const char* name, int64_t value) : m_name(nullptr), m_value(value) {
+	if (trace_enabled.load(std::memory_order_relaxed)) {
+		m_name = name;
+		m_start = clock::now();
+	}
+}
+
+timeline::zone::~zone() {
+	if (m_name != nullptr)
+		record(m_name, m_start, clock::now(), m_value);
+}
+
+void timeline::enable(bool on) {
+	trace_enabled = on;
+}
+
+bool timeline::enabled() {
+	return trace_enabled.load(std::memory_order_relaxed);
+}
+
+void timeline::record(const char* name, clock::time_point start, clock::time_point end, int64_t value) {
+	if (!enabled())
+		return;
+	trace_ring* ring = ThreadRing();
+	uint64_t head = ring->head.load(std::memory_order_relaxed);
+	trace_entry& e = ring->entries[head % ring_size];
+	e.name.store(name, std::memory_order_relaxed);
+	e.start.store(std::chrono::duration_cast<std::chrono::nanoseconds>(start - trace_epoch).count(), std::memory_order_relaxed);
+	e.duration.store(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(), std::memory_order_relaxed);
+	e.value.store(value, std::memory_order_relaxed);
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+void timeline::name_thread(const char* name) {
+	ThreadRing()->name.store(name, std::memory_order_relaxed);
+}
+
+void timeline::write_chrome_trace(const std::string& filename) {
+	std::ofstream out(filename);
+	if (!out)
+		throw std::runtime_error("Unable to write trace " + filename);
+
+	std::vector<trace_ring*> rings;
+	{
+		std::lock_guard<std::mutex> lock(ring_mutex);
+		rings = Rings();
+	}
+
+	out << "{\"traceEvents\":[\n";
+	bool first = true;
+	char line[256];
+	for (trace_ring* ring : rings) {
+		const char* thread_name = ring->name.load(std::memory_order_relaxed);
+		std::string name = thread_name ? thread_name : "thread " + std::to_string(ring->id);
+		std::snprintf(line, sizeof(line), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			first ? "" : ",\n", ring->id, name.c_str());
+		out << line;
+		first = false;
+
+		// Copy the entries that are in the buffer, then drop the ones the thread may have overwritten in the meantime
+		uint64_t end = ring->head.load(std::memory_order_acquire);
+		uint64_t begin = end > (uint64_t)ring_size ? end - ring_size : 0;
+		struct copy {
+			const char* name;
+			int64_t start, duration, value;
+		};
+		std::vector<copy> copies;
+		copies.reserve(end - begin);
+		for (uint64_t i = begin; i < end; i++) {
+			const trace_entry& e = ring->entries[i % ring_size];
+			copies.push_back({ e.name.load(std::memory_order_relaxed), e.start.load(std::memory_order_relaxed),
+				e.duration.load(std::memory_order_relaxed), e.value.load(std::memory_order_relaxed) });
+		}
+		uint64_t after = ring->head.load(std::memory_order_acquire);
+		uint64_t valid = after >= (uint64_t)ring_size ? after - ring_size + 1 : 0;
+
+		for (uint64_t i = std::max(begin, valid); i < end; i++) {
+			const copy& c = copies[i - begin];
+			if (c.value >= 0)
+				std::snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"value\":%lld}}",
+					c.name, ring->id, c.start / 1000.0, c.duration / 1000.0, (long long)c.value);
+			else
+				std::snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+					c.name, ring->id, c.start / 1000.0, c.duration / 1000.0);
+			out << line;
+		}
+	}
+	out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
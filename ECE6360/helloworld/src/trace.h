@@ -0,0 +1,41 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/*
+ * A per-thread timeline of zones, written as a Chrome trace (chrome://tracing or https://ui.perfetto.dev). Zones go
+ * into lock-free per-thread ring buffers, and cost one relaxed load while disabled. Names must be string literals.
+ */
+class timeline {
+public:
+    using clock = std::chrono::steady_clock;
+
+    static constexpr int ring_size = 1 << 16;   // zones kept per thread
+
+    class zone {
+    public:
+        explicit zone(const char* name, int64_t value = -1);
+        ~zone();
+        zone(const zone&) = delete;
+        zone& operator=(const zone&) = delete;
+
+    private:
+        const char* m_name;
+        int64_t m_value;
+        clock::time_point m_start;
+    };
+
+    static void enable(bool on);
+    static bool enabled();
+
+    // record a zone that can't be scoped (for example a render job that runs on several threads)
+    static void record(const char* name, clock::time_point start, clock::time_point end, int64_t value = -1);
+
+    // name the calling thread's row in the trace (threads are named "thread N" otherwise)
+    static void name_thread(const char* name);
+
+    // write every recorded zone as a Chrome trace JSON file
+    static void write_chrome_trace(const std::string& filename);
+};
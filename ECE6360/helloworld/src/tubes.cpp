@@ -0,0 +1,510 @@
+#include "tubes.h"
+#include "sampling.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+
+void tube_set::add_segment(const point3& a, const point3& b, double radius) {
+	m_segments.push_back(segment{ a, b, radius });
+}
+
+void tube_set::add_polyline(const std::vector<point3>& points, double radius) {
+	for (size_t i = 1; i < points.size(); i++)
+		add_segment(points[i - 1], points[i], radius);
+}
+
+void tube_set::build() {
+	timeline::zone zone("BVH build", (int64_t)m_segments.size());
+	m_segment_count = m_segments.size();
+	m_nodes.clear();
+	m_packets.clear();
+	m_slot.assign(m_segment_count, -1);
+	m_build_area.clear();
+	if (m_segments.empty())
+		return;
+
+	std::vector<int> indices(m_segments.size());
+	std::iota(indices.begin(), indices.end(), 0);
+	size_t packets = (m_segments.size() + 3) / 4;
+	m_packets.reserve(packets);
+	m_nodes.reserve(2 * packets);
+	build_node(indices, 0, (int)indices.size(), m_nodes, m_packets);
+
+	for (const bvh_node& node : m_nodes)
+		m_build_area.push_back((float)box_area(node));
+	for (size_t p = 0; p < m_packets.size(); p++) {
+		for (int lane = 0; lane < 4; lane++) {
+			if (m_packets[p].segment[lane] >= 0)
+				m_slot[m_packets[p].segment[lane]] = (int)(p * 4 + lane);
+		}
+	}
+
+	// the packets hold everything the intersector needs, so the original segments can go
+	m_segments.clear();
+	m_segments.shrink_to_fit();
+}
+
+void tube_set::packet::set(int lane, const tube_set::segment& s, int index) {
+	ax[lane] = (float)s.a.x(); ay[lane] = (float)s.a.y(); az[lane] = (float)s.a.z();
+	bx[lane] = (float)s.b.x(); by[lane] = (float)s.b.y(); bz[lane] = (float)s.b.z();
+	radius[lane] = (float)s.radius;
+	segment[lane] = index;
+}
+
+/*
+ * Build the subtree over m_segments[indices[begin, end)], appending its nodes and packets. The shape of the tree
+ * only depends on the number of segments, which rebuild_subtree() relies on to rebuild a subtree in place.
+ */
+int tube_set::build_node(std::vector<int>& indices, int begin, int end, std::vector<bvh_node>& nodes,
+	std::vector<packet>& packets) const {
+
+	int index = (int)nodes.size();
+	bvh_node node;
+	fit_box(end - begin, [&](int i) -> const segment& { return m_segments[indices[begin + i]]; }, node);
+	nodes.push_back(node);
+
+	// Up to four segments become a leaf with a single packet
+	if (end - begin <= 4) {
+		packet p;
+		for (int lane = 0; lane < 4; lane++) {
+			if (begin + lane < end)
+				p.set(lane, m_segments[indices[begin + lane]], indices[begin + lane]);
+			else
+				p.set(lane, segment{ point3(0, 0, 0), point3(0, 0, 0), -1.0 }, -1);
+		}
+		nodes[index].packet = (int)packets.size();
+		packets.push_back(p);
+		return index;
+	}
+
+	// Split at the median of the segment centers along the axis where they are spread out the most. The first half
+	// is rounded up to a multiple of four so that the leaves are full packets.
+	vec3 lo(INFINITY, INFINITY, INFINITY), hi(-INFINITY, -INFINITY, -INFINITY);
+	for (int i = begin; i < end; i++) {
+		const segment& s = m_segments[indices[i]];
+		vec3 c = 0.5 * (s.a + s.b);
+		for (int a = 0; a < 3; a++) {
+			lo[a] = std::min(lo[a], c[a]);
+			hi[a] = std::max(hi[a], c[a]);
+		}
+	}
+	vec3 extent = hi - lo;
+	int axis = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
+	int mid = begin + ((end - begin) / 2 + 3) / 4 * 4;
+	std::nth_element(indices.begin() + begin, indices.begin() + mid, indices.begin() + end, [&](int i, int j) {
+		const segment& si = m_segments[i];
+		const segment& sj = m_segments[j];
+		return si.a[axis] + si.b[axis] < sj.a[axis] + sj.b[axis];
+	});
+
+	build_node(indices, begin, mid, nodes, packets);
+	int right = build_node(indices, mid, end, nodes, packets);
+	nodes[index].right = right;
+	return index;
+}
+
+template <typename F>
+double tube_set::fit_box(int count, F&& segment_at, bvh_node& node) {
+	// Main direction of the segments (directions that point the other way are flipped so they don't cancel out)
+	vec3 reference = segment_at(0).b - segment_at(0).a;
+	vec3 sum(0, 0, 0);
+	for (int i = 0; i < count; i++) {
+		vec3 d = segment_at(i).b - segment_at(i).a;
+		sum += dot(d, reference) < 0.0 ? -d : d;
+	}
+	onb frame(sum.length_squared() > 0.0 ? unit_vector(sum) : vec3(0, 0, 1));
+
+	// Bound the end point spheres in the oriented frame and in the world axes, and keep whichever box is smaller
+	const vec3 axes[2][3] = { { frame.u, frame.v, frame.w }, { vec3(1, 0, 0), vec3(0, 1, 0), vec3(0, 0, 1) } };
+	double lo[2][3], hi[2][3];
+	for (int f = 0; f < 2; f++) {
+		for (int a = 0; a < 3; a++) {
+			lo[f][a] = INFINITY;
+			hi[f][a] = -INFINITY;
+		}
+	}
+	for (int i = 0; i < count; i++) {
+		const segment& s = segment_at(i);
+		for (int f = 0; f < 2; f++) {
+			for (int a = 0; a < 3; a++) {
+				double pa = dot(axes[f][a], s.a), pb = dot(axes[f][a], s.b);
+				lo[f][a] = std::min(lo[f][a], std::min(pa, pb) - s.radius);
+				hi[f][a] = std::max(hi[f][a], std::max(pa, pb) + s.radius);
+			}
+		}
+	}
+	double area[2];
+	for (int f = 0; f < 2; f++) {
+		double dx = hi[f][0] - lo[f][0], dy = hi[f][1] - lo[f][1], dz = hi[f][2] - lo[f][2];
+		area[f] = dx * dy + dy * dz + dz * dx;
+	}
+	int best = area[0] < area[1] ? 0 : 1;
+
+	// the bounds are padded a little so that rounding to float can't cut off the tubes
+	for (int a = 0; a < 3; a++) {
+		for (int c = 0; c < 3; c++)
+			node.axis[a][c] = (float)axes[best][a][c];
+		double pad = 1e-6 * (1.0 + std::max(std::fabs(lo[best][a]), std::fabs(hi[best][a])));
+		node.lo[a] = (float)(lo[best][a] - pad);
+		node.hi[a] = (float)(hi[best][a] + pad);
+	}
+	return area[best];
+}
+
+double tube_set::box_area(const bvh_node& node) {
+	double dx = node.hi[0] - node.lo[0], dy = node.hi[1] - node.lo[1], dz = node.hi[2] - node.lo[2];
+	return dx * dy + dy * dz + dz * dx;
+}
+
+/*
+ * Recompute every box bottom-up (children are always stored after their parent). Leaves are fit around their
+ * segments again, while interior nodes keep their orientation and are fit around the corners of their children's
+ * boxes, which is looser than fitting the segments but doesn't need to visit them.
+ */
+void tube_set::refit() {
+	for (int n = (int)m_nodes.size() - 1; n >= 0; n--) {
+		bvh_node& node = m_nodes[n];
+		if (node.packet >= 0) {
+			const packet& p = m_packets[node.packet];
+			segment lanes[4];
+			int count = 0;
+			for (int lane = 0; lane < 4; lane++) {
+				if (p.segment[lane] >= 0)
+					lanes[count++] = p.get(lane);
+			}
+			fit_box(count, [&](int i) -> const segment& { return lanes[i]; }, node);
+			continue;
+		}
+
+		double lo[3] = { INFINITY, INFINITY, INFINITY }, hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+		for (int child : { n + 1, node.right }) {
+			const bvh_node& c = m_nodes[child];
+			for (int corner = 0; corner < 8; corner++) {
+				// corner of the child box in world space
+				vec3 local((corner & 1) ? c.hi[0] : c.lo[0], (corner & 2) ? c.hi[1] : c.lo[1], (corner & 4) ? c.hi[2] : c.lo[2]);
+				vec3 world(0, 0, 0);
+				for (int a = 0; a < 3; a++)
+					world += local[a] * vec3(c.axis[a][0], c.axis[a][1], c.axis[a][2]);
+				for (int a = 0; a < 3; a++) {
+					double x = dot(vec3(node.axis[a][0], node.axis[a][1], node.axis[a][2]), world);
+					lo[a] = std::min(lo[a], x);
+					hi[a] = std::max(hi[a], x);
+				}
+			}
+		}
+		for (int a = 0; a < 3; a++) {
+			double pad = 1e-6 * (1.0 + std::max(std::fabs(lo[a]), std::fabs(hi[a])));
+			node.lo[a] = (float)(lo[a] - pad);
+			node.hi[a] = (float)(hi[a] + pad);
+		}
+	}
+}
+
+/*
+ * Rebuild the subtree rooted at node `index` from the segments in its packets. The subtree's nodes and packets are
+ * stored contiguously (the tree is built depth first), and a rebuilt subtree over the same number of segments has
+ * the same number of nodes and packets, so it simply overwrites the old one.
+ */
+void tube_set::rebuild_subtree(int index) {
+	int last = index;
+	while (m_nodes[last].packet < 0)
+		last = m_nodes[last].right;
+	int first_packet = index;
+	while (m_nodes[first_packet].packet < 0)
+		first_packet++;
+	first_packet = m_nodes[first_packet].packet;
+	int last_packet = m_nodes[last].packet;
+
+	std::vector<int> ids;
+	for (int p = first_packet; p <= last_packet; p++) {
+		for (int lane = 0; lane < 4; lane++) {
+			if (m_packets[p].segment[lane] >= 0) {
+				m_segments.push_back(m_packets[p].get(lane));
+				ids.push_back(m_packets[p].segment[lane]);
+			}
+		}
+	}
+	std::vector<int> indices(m_segments.size());
+	std::iota(indices.begin(), indices.end(), 0);
+	std::vector<bvh_node> nodes;
+	std::vector<packet> packets;
+	build_node(indices, 0, (int)indices.size(), nodes, packets);
+	m_segments.clear();
+
+	if ((int)nodes.size() != last - index + 1 || (int)packets.size() != last_packet - first_packet + 1)
+		throw std::runtime_error("Tube BVH subtree rebuild changed the size of the subtree");
+
+	for (size_t n = 0; n < nodes.size(); n++) {
+		bvh_node node = nodes[n];
+		if (node.packet >= 0)
+			node.packet += first_packet;
+		else
+			node.right += index;
+		m_nodes[index + n] = node;
+		m_build_area[index + n] = (float)box_area(node);
+	}
+	for (size_t p = 0; p < packets.size(); p++) {
+		packet& dst = m_packets[first_packet + p];
+		dst = packets[p];
+		for (int lane = 0; lane < 4; lane++) {
+			if (dst.segment[lane] >= 0) {
+				dst.segment[lane] = ids[dst.segment[lane]];
+				m_slot[dst.segment[lane]] = (int)((first_packet + p) * 4 + lane);
+			}
+		}
+	}
+}
+
+int tube_set::update(const std::vector<std::pair<size_t, segment>>& changes) {
+	timeline::zone zone("BVH update", (int64_t)changes.size());
+	for (const auto& [index, s] : changes) {
+		if (index >= m_slot.size())
+			throw std::runtime_error("Tube segment index out of range");
+		int slot = m_slot[index];
+		m_packets[slot / 4].set(slot % 4, s, (int)index);
+	}
+	refit();
+
+	// Rebuild the largest subtrees that became too loose (nothing below a rebuilt subtree has to be checked)
+	int rebuilt = 0;
+	std::vector<int> stack = { 0 };
+	while (!stack.empty()) {
+		int n = stack.back();
+		stack.pop_back();
+		if (m_nodes[n].packet >= 0)
+			continue;
+		if (box_area(m_nodes[n]) > 2.0 * m_build_area[n]) {
+			rebuild_subtree(n);
+			rebuilt++;
+			continue;
+		}
+		stack.push_back(n + 1);
+		stack.push_back(m_nodes[n].right);
+	}
+
+	// the ancestors of rebuilt subtrees still have the boxes from before the rebuild
+	if (rebuilt > 0)
+		refit();
+	return rebuilt;
+}
+
+bool tube_set::hit_box(const bvh_node& node, const point3& o, const vec3& d, double tmax, double& t_entry) {
+	// slab test in the frame of the box
+	double t0 = 0.0, t1 = tmax;
+	for (int a = 0; a < 3; a++) {
+		vec3 axis(node.axis[a][0], node.axis[a][1], node.axis[a][2]);
+		double oa = dot(axis, o);
+		double inv = 1.0 / dot(axis, d);
+		double ta = (node.lo[a] - oa) * inv;
+		double tb = (node.hi[a] - oa) * inv;
+		if (ta > tb) std::swap(ta, tb);
+		t0 = ta > t0 ? ta : t0;
+		t1 = tb < t1 ? tb : t1;
+		if (t0 > t1)
+			return false;
+	}
+	t_entry = t0;
+	return true;
+}
+
+/*
+ * Intersect a ray with the four segments of a packet at once. Every lane computes the first hit with the infinite
+ * cylinder around its segment, and then with the end caps (spheres for capsules, discs for cylinders). The nearest
+ * valid candidate of each lane is returned. To avoid losing precision when a thin tube is far away from the ray
+ * origin, the origin is first moved along the ray to the point closest to the segment's start.
+ */
+float4 tube_set::intersect_packet(const packet& p, const vec3x4& o, const vec3x4& d, float tmin) const {
+	const float4 inf(std::numeric_limits<float>::infinity());
+	vec3x4 a{ float4::load(p.ax), float4::load(p.ay), float4::load(p.az) };
+	vec3x4 b{ float4::load(p.bx), float4::load(p.by), float4::load(p.bz) };
+	float4 r = float4::load(p.radius);
+	float4 valid = r > float4(0.0f);
+
+	vec3x4 oa = o - a;
+	float4 t_shift = -dot(oa, d);
+	oa = oa + t_shift * d;
+	float4 t_min = float4(tmin) - t_shift;
+
+	vec3x4 ba = b - a;
+	float4 baba = dot(ba, ba);
+	float4 bard = dot(ba, d);
+	float4 baoa = dot(ba, oa);
+	float4 rdoa = dot(d, oa);
+	float4 oaoa = dot(oa, oa);
+	float4 r2 = r * r;
+
+	// infinite cylinder: k2 t^2 + 2 k1 t + k0 = 0 (all terms are scaled by |b - a|^2)
+	float4 k2 = baba - bard * bard;
+	float4 k1 = baba * rdoa - baoa * bard;
+	float4 k0 = baba * oaoa - baoa * baoa - r2 * baba;
+	float4 h = k1 * k1 - k2 * k0;
+	float4 inside = valid & (h >= float4(0.0f));
+	if (!any(inside))
+		return inf;
+	float4 sh = sqrt(max(h, float4(0.0f)));
+
+	// the body is hit if the hit point projects onto the segment
+	float4 t_body = (-k1 - sh) / k2;
+	float4 y = baoa + t_body * bard;
+	float4 t = select(inside & (y > float4(0.0f)) & (y < baba) & (t_body > t_min), t_body, inf);
+
+	if (shape == capsule) {
+		// spheres at both ends
+		vec3x4 ob = oa - ba;
+		for (const vec3x4& oc : { oa, ob }) {
+			float4 bc = dot(d, oc);
+			float4 hc = bc * bc - (dot(oc, oc) - r2);
+			float4 t_cap = -bc - sqrt(max(hc, float4(0.0f)));
+			t = select(inside & (hc >= float4(0.0f)) & (t_cap > t_min) & (t_cap < t), t_cap, t);
+		}
+	}
+	else {
+		// flat discs at both ends (a point on the cap plane is on the disc if it is inside the infinite cylinder)
+		for (const float4& plane : { float4(0.0f), baba }) {
+			float4 t_cap = (plane - baoa) / bard;
+			float4 on_disc = abs(k1 + k2 * t_cap) < sh;
+			t = select(inside & on_disc & (t_cap > t_min) & (t_cap < t), t_cap, t);
+		}
+	}
+	return t + t_shift;
+}
+
+bool tube_set::intersect(const ray& r, double tmin, double tmax, hit_record& rec) const {
+	if (m_nodes.empty())
+		return false;
+
+	const point3& o = r.origin();
+	const vec3& d = r.direction();
+	vec3x4 o4{ float4((float)o.x()), float4((float)o.y()), float4((float)o.z()) };
+	vec3x4 d4{ float4((float)d.x()), float4((float)d.y()), float4((float)d.z()) };
+
+	// Visit the nodes closest first, and skip any node whose box starts beyond the closest hit found so far
+	struct stack_entry { int node; double t; };
+	stack_entry stack[64];
+	int top = 0;
+	double t_root;
+	if (!hit_box(m_nodes[0], o, d, tmax, t_root))
+		return false;
+	stack[top++] = { 0, t_root };
+
+	double t_best = tmax;
+	int best_packet = -1, best_lane = -1;
+	while (top > 0) {
+		stack_entry entry = stack[--top];
+		if (entry.t >= t_best)
+			continue;
+		const bvh_node& node = m_nodes[entry.node];
+		if (node.packet >= 0) {
+			alignas(16) float t[4];
+			intersect_packet(m_packets[node.packet], o4, d4, (float)tmin).store(t);
+			for (int lane = 0; lane < 4; lane++) {
+				if (t[lane] < t_best) {
+					t_best = t[lane];
+					best_packet = node.packet;
+					best_lane = lane;
+				}
+			}
+			continue;
+		}
+
+		int children[2] = { entry.node + 1, node.right };
+		double t_child[2];
+		bool hit[2];
+		for (int c = 0; c < 2; c++)
+			hit[c] = hit_box(m_nodes[children[c]], o, d, t_best, t_child[c]);
+		int first = hit[0] && hit[1] && t_child[1] < t_child[0] ? 1 : 0;
+		for (int c : { 1 - first, first }) {
+			if (hit[c] && top < 64)
+				stack[top++] = { children[c], t_child[c] };
+		}
+	}
+	if (best_packet < 0)
+		return false;
+
+	// Compute the hit point and normal in double precision from the winning segment
+	const packet& p = m_packets[best_packet];
+	point3 a(p.ax[best_lane], p.ay[best_lane], p.az[best_lane]);
+	point3 b(p.bx[best_lane], p.by[best_lane], p.bz[best_lane]);
+	vec3 ba = b - a;
+	rec.t = t_best;
+	rec.p = r.at(t_best);
+	double s = dot(rec.p - a, ba) / dot(ba, ba);
+	if (shape == cylinder && (s <= 1e-3 || s >= 1.0 - 1e-3))
+		rec.normal = (s < 0.5 ? -1.0 : 1.0) * unit_vector(ba);
+	else
+		rec.normal = unit_vector(rec.p - (a + std::clamp(s, 0.0, 1.0) * ba));
+	rec.object = -1;
+	rec.material = material;
+	return true;
+}
+
+std::shared_ptr<tube_set> tube_set::load_polylines(const std::string& filename, double radius) {
+	std::ifstream in(filename);
+	if (!in)
+		throw std::runtime_error("Unable to open polyline file " + filename);
+
+	auto tubes = std::make_shared<tube_set>();
+	std::vector<point3> points;
+	std::string line;
+	while (std::getline(in, line)) {
+		std::istringstream fields(line);
+		double x, y, z;
+		if (fields >> x >> y >> z) {
+			points.push_back(point3(x, y, z));
+		}
+		else {
+			tubes->add_polyline(points, radius);
+			points.clear();
+		}
+	}
+	tubes->add_polyline(points, radius);
+	tubes->build();
+	return tubes;
+}
+
+/*
+ * Two crossing bundles: an arch over the center of the view (like the corpus callosum) and a straight bundle that
+ * runs up through it. Each fiber is displaced from the bundle's center curve by a random offset that slowly twists
+ * around the curve, with a little wobble so the fibers don't look perfectly parallel.
+ */
+std::shared_ptr<tube_set> tube_set::procedural_fibers(int fibers, int segments_per_fiber, double radius) {
+	auto tubes = std::make_shared<tube_set>();
+	rng gen(6360);
+	const point3 center(0.0, -0.35, -1.5);
+
+	for (int f = 0; f < fibers; f++) {
+		bool arch = f % 3 != 2;
+		double offset_r = 0.12 * std::sqrt(gen.next());
+		double offset_angle = 2.0 * pi * gen.next();
+		double wobble_phase = 2.0 * pi * gen.next();
+
+		std::vector<point3> points;
+		for (int i = 0; i <= segments_per_fiber; i++) {
+			double s = (double)i / segments_per_fiber;
+			point3 c;
+			vec3 tangent;
+			if (arch) {
+				double angle = pi * (0.1 + 0.8 * s);
+				c = center + vec3(-0.6 * std::cos(angle), 0.6 * std::sin(angle), 0.0);
+				tangent = vec3(std::sin(angle), std::cos(angle), 0.0);
+			}
+			else {
+				c = center + vec3(0.0, 1.0 * s - 0.2, 0.05 * std::sin(2.0 * pi * s));
+				tangent = vec3(0.0, 1.0, 0.0);
+			}
+			onb frame(unit_vector(tangent));
+			double angle = offset_angle + 2.0 * s;
+			double wobble = 1.0 + 0.1 * std::sin(12.0 * s + wobble_phase);
+			points.push_back(c + offset_r * wobble * (std::cos(angle) * frame.u + std::sin(angle) * frame.v));
+		}
+		tubes->add_polyline(points, radius);
+	}
+	tubes->build();
+	return tubes;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ray.h"
+#include "scene.h"
+#include "simd.h"
+#include "vec3.h"
+
+/*
+ * Tube segments (capsules or flat-capped cylinders) for drawing streamlines and fibers without tessellating them.
+ * Segments are intersected four at a time, under a BVH of oriented boxes that fit diagonal bundles of fibers.
+ */
+class tube_set {
+public:
+    enum shape_type { capsule = 0, cylinder = 1 };
+
+    struct segment {
+        point3 a, b;
+        double radius;
+    };
+
+    int shape = capsule;                    // can be changed between renders (the BVH bounds fit both shapes)
+    int material = 0;
+
+    // add one segment, or a polyline (one streamline) as a chain of segments with a constant radius
+    void add_segment(const point3& a, const point3& b, double radius);
+    void add_polyline(const std::vector<point3>& points, double radius);
+
+    // build the packets and the BVH after all of the segments are added (segments can only be moved afterwards)
+    void build();
+
+        /*
+     * Move or resize segments (pairs of segment index and new segment). The BVH is refit, and subtrees whose boxes
+     * more than doubled are rebuilt. Returns the number of rebuilt subtrees.
+     */
+    int update(const std::vector<std::pair<size_t, segment>>& changes);
+
+    // read polylines from a text file with one "x y z" point per line and blank lines between polylines
+    static std::shared_ptr<tube_set> load_polylines(const std::string& filename, double radius);
+
+    // bundles of twisted fibers running through the view (a test scene that looks a bit like a tractography)
+    static std::shared_ptr<tube_set> procedural_fibers(int fibers, int segments_per_fiber, double radius);
+
+    // closest intersection in (tmin, tmax) (the ray direction must be unit length)
+    bool intersect(const ray& r, double tmin, double tmax, hit_record& rec) const;
+
+    size_t segment_count() const { return m_segment_count; }
+    size_t node_count() const { return m_nodes.size(); }
+    size_t memory_bytes() const {
+        return m_nodes.size() * (sizeof(bvh_node) + sizeof(float)) + m_packets.size() * sizeof(packet) + m_slot.size() * sizeof(int);
+    }
+
+private:
+    // four segments in structure-of-arrays layout (unused lanes have a negative radius)
+    struct alignas(16) packet {
+        float ax[4], ay[4], az[4];
+        float bx[4], by[4], bz[4];
+        float radius[4];
+        int segment[4];                     // index of the segment in each lane (-1 for unused lanes)
+
+        tube_set::segment get(int lane) const {
+            return { point3(ax[lane], ay[lane], az[lane]), point3(bx[lane], by[lane], bz[lane]), radius[lane] };
+        }
+        void set(int lane, const tube_set::segment& s, int index);
+    };
+
+    /*
+     * A BVH node with an oriented bounding box: the box is [lo, hi] in the coordinate frame given by the rows of
+     * axis. Interior nodes store their first child right after themselves and the second one at index `right`,
+     * leaves store a single packet.
+     */
+    struct bvh_node {
+        float axis[3][3];
+        float lo[3], hi[3];
+        int right = -1;                     // index of the second child (interior nodes)
+        int packet = -1;                    // index of the packet (leaves)
+    };
+
+    std::vector<segment> m_segments;        // only used until build() packs them
+    size_t m_segment_count = 0;
+    std::vector<bvh_node> m_nodes;
+    std::vector<packet> m_packets;
+    std::vector<int> m_slot;                // packet * 4 + lane of every segment
+    std::vector<float> m_build_area;        // surface area of every node's box when it was built
+
+    int build_node(std::vector<int>& indices, int begin, int end, std::vector<bvh_node>& nodes, std::vector<packet>& packets) const;
+    void rebuild_subtree(int index);
+    void refit();
+
+    // fit a box around `count` segments (segment_at(i) returns the i-th one) and return its surface area
+    template <typename F>
+    static double fit_box(int count, F&& segment_at, bvh_node& node);
+    static double box_area(const bvh_node& node);
+    static bool hit_box(const bvh_node& node, const point3& o, const vec3& d, double tmax, double& t_entry);
+
+    // ray parameters of the first hits with the four segments of a packet (infinity for misses)
+    float4 intersect_packet(const packet& p, const vec3x4& o, const vec3x4& d, float tmin) const;
+};
@@ -0,0 +1,362 @@
+#include "volume.h"
+#include "threadpool.h"
+
+#include <limits>
+#include <regex>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+mapped_file::mapped_file(const std::string& filename) {
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		throw std::runtime_error("Unable to open " + filename);
+	LARGE_INTEGER size;
+	GetFileSizeEx(file, &size);
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr) {
+		CloseHandle(file);
+		throw std::runtime_error("Unable to map " + filename);
+	}
+	m_file = file;
+	m_mapping = mapping;
+	m_size = (size_t)size.QuadPart;
+	m_data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (m_data == nullptr) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		throw std::runtime_error("Unable to map " + filename);
+	}
+#else
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("Unable to open " + filename);
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		throw std::runtime_error("Unable to read the size of " + filename);
+	}
+	m_size = (size_t)st.st_size;
+	m_data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);											// the mapping keeps its own reference to the file
+	if (m_data == MAP_FAILED) {
+		m_data = nullptr;
+		throw std::runtime_error("Unable to map " + filename);
+	}
+#endif
+}
+
+mapped_file::~mapped_file() {
+#ifdef _WIN32
+	if (m_data) UnmapViewOfFile(m_data);
+	if (m_mapping) CloseHandle(m_mapping);
+	if (m_file) CloseHandle(m_file);
+#else
+	if (m_data) munmap(m_data, m_size);
+#endif
+}
+
+static size_t voxel_bytes(voxel_type type) {
+	return type == voxel_type::uint8 ? 1 : type == voxel_type::uint16 ? 2 : 4;
+}
+
+std::shared_ptr<volume> volume::load_raw(const std::string& filename, int nx, int ny, int nz, voxel_type type, thread_pool& pool) {
+	if (nx < 2 || ny < 2 || nz < 2)
+		throw std::runtime_error("Volume " + filename + " needs at least 2 voxels along each axis");
+
+	auto vol = std::make_shared<volume>();
+	vol->m_file = std::make_shared<mapped_file>(filename);
+	if (vol->m_file->size() < (size_t)nx * ny * nz * voxel_bytes(type))
+		throw std::runtime_error("Volume " + filename + " is smaller than its dimensions");
+
+	vol->m_name = filename;
+	vol->m_data = vol->m_file->data();
+	vol->m_type = type;
+	vol->m_n[0] = nx;
+	vol->m_n[1] = ny;
+	vol->m_n[2] = nz;
+	vol->initialize(pool);
+	return vol;
+}
+
+std::shared_ptr<volume> volume::load_raw(const std::string& filename, thread_pool& pool) {
+	std::smatch match;
+	static const std::regex pattern("(\\d+)x(\\d+)x(\\d+)_(uint8|uint16|float32|float)");
+	if (!std::regex_search(filename, match, pattern))
+		throw std::runtime_error("Unable to find the dimensions and type (ex. _256x256x256_uint8) in " + filename);
+
+	voxel_type type = match[4] == "uint8" ? voxel_type::uint8 : match[4] == "uint16" ? voxel_type::uint16 : voxel_type::float32;
+	return load_raw(filename, std::stoi(match[1]), std::stoi(match[2]), std::stoi(match[3]), type, pool);
+}
+
+std::shared_ptr<volume> volume::procedural(int n, thread_pool& pool) {
+	auto vol = std::make_shared<volume>();
+	vol->m_name = "Marschner-Lobb " + std::to_string(n) + "^3";
+	vol->m_type = voxel_type::uint8;
+	vol->m_n[0] = vol->m_n[1] = vol->m_n[2] = n;
+	vol->m_owned = std::make_shared<std::vector<unsigned char>>((size_t)n * n * n);
+	std::vector<unsigned char>& voxels = *vol->m_owned;
+
+	// rho(x, y, z) = (1 - sin(pi z / 2) + alpha (1 + cos(2 pi fM cos(pi r / 2)))) / (2 (1 + alpha)) for x, y, z in [-1, 1]
+	const double pi = 3.14159265358979323846, fM = 6.0, alpha = 0.25;
+	pool.parallel_for(n, [&](int k) {
+		for (int j = 0; j < n; j++) {
+			for (int i = 0; i < n; i++) {
+				double x = 2.0 * i / (n - 1) - 1.0, y = 2.0 * j / (n - 1) - 1.0, z = 2.0 * k / (n - 1) - 1.0;
+				double r = std::sqrt(x * x + y * y);
+				double rho = (1.0 - std::sin(pi * z / 2.0) + alpha * (1.0 + std::cos(2.0 * pi * fM * std::cos(pi * r / 2.0)))) / (2.0 * (1.0 + alpha));
+				voxels[((size_t)k * n + j) * n + i] = (unsigned char)std::clamp(rho * 255.0 + 0.5, 0.0, 255.0);
+			}
+		}
+	});
+	vol->m_data = vol->m_owned->data();
+	vol->initialize(pool);
+	return vol;
+}
+
+// value noise: random values at integer lattice points, smoothly interpolated in between
+static double value_noise(double x, double y, double z) {
+	auto lattice = [](int i, int j, int k) {
+		uint32_t h = (uint32_t)i * 73856093u ^ (uint32_t)j * 19349663u ^ (uint32_t)k * 83492791u;
+		h = (h ^ (h >> 13)) * 1274126177u;
+		return (double)((h ^ (h >> 16)) & 0xffff) / 65535.0;
+	};
+	int i = (int)std::floor(x), j = (int)std::floor(y), k = (int)std::floor(z);
+	double fx = x - i, fy = y - j, fz = z - k;
+	fx = fx * fx * (3 - 2 * fx);
+	fy = fy * fy * (3 - 2 * fy);
+	fz = fz * fz * (3 - 2 * fz);
+	double c[2][2];
+	for (int dz = 0; dz < 2; dz++)
+		for (int dy = 0; dy < 2; dy++)
+			c[dy][dz] = lattice(i, j + dy, k + dz) * (1 - fx) + lattice(i + 1, j + dy, k + dz) * fx;
+	return (c[0][0] * (1 - fy) + c[1][0] * fy) * (1 - fz) + (c[0][1] * (1 - fy) + c[1][1] * fy) * fz;
+}
+
+std::shared_ptr<volume> volume::procedural_smoke(int n, thread_pool& pool) {
+	auto vol = std::make_shared<volume>();
+	vol->m_name = "Smoke " + std::to_string(n) + "^3";
+	vol->m_type = voxel_type::float32;
+	vol->m_n[0] = vol->m_n[1] = vol->m_n[2] = n;
+	vol->m_owned = std::make_shared<std::vector<unsigned char>>((size_t)n * n * n * sizeof(float));
+	float* voxels = reinterpret_cast<float*>(vol->m_owned->data());
+
+	// four octaves of noise, faded out towards the surface of a sphere so the smoke has no hard edges
+	pool.parallel_for(n, [&](int k) {
+		for (int j = 0; j < n; j++) {
+			for (int i = 0; i < n; i++) {
+				double x = 2.0 * i / (n - 1) - 1.0, y = 2.0 * j / (n - 1) - 1.0, z = 2.0 * k / (n - 1) - 1.0;
+				double noise = 0.0, amplitude = 0.5, frequency = 4.0;
+				for (int octave = 0; octave < 4; octave++) {
+					noise += amplitude * value_noise(x * frequency, y * frequency, z * frequency);
+					amplitude *= 0.5;
+					frequency *= 2.0;
+				}
+				double falloff = std::clamp(1.0 - std::sqrt(x * x + y * y + z * z), 0.0, 1.0);
+				voxels[((size_t)k * n + j) * n + i] = (float)std::max(0.0, 2.0 * noise * falloff - 0.35);
+			}
+		}
+	});
+	vol->m_data = vol->m_owned->data();
+	vol->initialize(pool);
+	return vol;
+}
+
+void volume::initialize(thread_pool& pool) {
+
+	// The largest side of the volume is one unit long, and the volume is placed in front of the camera
+	double longest = (double)std::max({ m_n[0] - 1, m_n[1] - 1, m_n[2] - 1 });
+	m_spacing = vec3(1.0 / longest, 1.0 / longest, 1.0 / longest);
+	vec3 extent((m_n[0] - 1) / longest, (m_n[1] - 1) / longest, (m_n[2] - 1) / longest);
+	point3 center(0.0, 0.0, -1.5);
+	box_min = center - 0.5 * extent;
+	box_max = center + 0.5 * extent;
+
+	// Compute the raw value range of every macrocell in parallel (this is the only full pass over the voxels)
+	for (int a = 0; a < 3; a++)
+		m_cells[a] = (m_n[a] - 2) / macrocell_size + 1;
+	size_t cell_count = (size_t)m_cells[0] * m_cells[1] * m_cells[2];
+	m_cell_min.assign(cell_count, 0.0f);
+	m_cell_max.assign(cell_count, 0.0f);
+	m_raw_min = 0.0;
+	m_raw_scale = 1.0;
+
+	pool.parallel_for(m_cells[2], [&](int cz) {
+		for (int cy = 0; cy < m_cells[1]; cy++) {
+			for (int cx = 0; cx < m_cells[0]; cx++) {
+				float lo, hi;
+				range(cx * macrocell_size, cy * macrocell_size, cz * macrocell_size,
+					std::min((cx + 1) * macrocell_size, m_n[0] - 1),
+					std::min((cy + 1) * macrocell_size, m_n[1] - 1),
+					std::min((cz + 1) * macrocell_size, m_n[2] - 1), lo, hi);
+				m_cell_min[cell_index(cx, cy, cz)] = lo;
+				m_cell_max[cell_index(cx, cy, cz)] = hi;
+			}
+		}
+	});
+
+	// Normalize the values to [0, 1] using the range of the whole volume
+	double lo = *std::min_element(m_cell_min.begin(), m_cell_min.end());
+	double hi = *std::max_element(m_cell_max.begin(), m_cell_max.end());
+	m_raw_min = lo;
+	m_raw_scale = hi > lo ? 1.0 / (hi - lo) : 1.0;
+	for (size_t c = 0; c < cell_count; c++) {
+		m_cell_min[c] = (float)((m_cell_min[c] - lo) * m_raw_scale);
+		m_cell_max[c] = (float)((m_cell_max[c] - lo) * m_raw_scale);
+	}
+
+	set_transfer_function(m_tf, m_step_factor);
+}
+
+void volume::range(int x0, int y0, int z0, int x1, int y1, int z1, float& lo, float& hi) const {
+	double vmin = std::numeric_limits<double>::max();
+	double vmax = std::numeric_limits<double>::lowest();
+	for (int k = z0; k <= z1; k++) {
+		for (int j = y0; j <= y1; j++) {
+			for (int i = x0; i <= x1; i++) {
+				double v = voxel(i, j, k);
+				vmin = std::min(vmin, v);
+				vmax = std::max(vmax, v);
+			}
+		}
+	}
+	lo = (float)vmin;
+	hi = (float)vmax;
+}
+
+std::shared_ptr<volume> volume::with_transfer_function(const transfer_function& tf, double step_factor) const {
+	auto vol = std::make_shared<volume>(*this);
+	vol->set_transfer_function(tf, step_factor);
+	return vol;
+}
+
+void volume::set_transfer_function(const transfer_function& tf, double step_factor) {
+	m_tf = tf;
+	m_step_factor = step_factor;
+	m_step = step_factor * std::min({ m_spacing.x(), m_spacing.y(), m_spacing.z() });
+
+	/*
+	 * The opacity in the transfer function is the opacity of one voxel-length slab. Taking a step of a different
+	 * length s changes it to 1 - (1 - alpha)^s, which keeps the image from getting brighter or darker when the
+	 * step size changes.
+	 */
+	for (int i = 0; i < lut_size; i++) {
+		double v = (double)i / (lut_size - 1);
+		m_lut_color[i] = tf.map_color(v);
+		m_lut_alpha[i] = 1.0 - std::pow(1.0 - std::min(tf.map_opacity(v), 0.999), step_factor);
+	}
+
+	// A cell is empty if every lookup table entry its value range can reach is transparent
+	std::vector<int> visible_prefix(lut_size + 1, 0);
+	for (int i = 0; i < lut_size; i++)
+		visible_prefix[i + 1] = visible_prefix[i] + (m_lut_alpha[i] > 0.0 ? 1 : 0);
+
+	size_t cell_count = m_cell_min.size();
+	m_cell_empty.resize(cell_count);
+	size_t empty = 0;
+	for (size_t c = 0; c < cell_count; c++) {
+		int b0 = std::clamp((int)std::floor(m_cell_min[c] * (lut_size - 1)), 0, lut_size - 1);
+		int b1 = std::clamp((int)std::ceil(m_cell_max[c] * (lut_size - 1)), 0, lut_size - 1);
+		m_cell_empty[c] = visible_prefix[b1 + 1] - visible_prefix[b0] == 0;
+		empty += m_cell_empty[c];
+	}
+	m_empty_fraction = cell_count > 0 ? (double)empty / cell_count : 0.0;
+}
+
+bool volume::intersect_box(const ray& r, double& t0, double& t1) const {
+	t0 = -std::numeric_limits<double>::infinity();
+	t1 = std::numeric_limits<double>::infinity();
+	for (int a = 0; a < 3; a++) {
+		double inv = 1.0 / r.direction()[a];
+		double ta = (box_min[a] - r.origin()[a]) * inv;
+		double tb = (box_max[a] - r.origin()[a]) * inv;
+		if (inv < 0.0) std::swap(ta, tb);
+		t0 = std::max(t0, ta);
+		t1 = std::min(t1, tb);
+	}
+	return t0 <= t1;
+}
+
+color volume::integrate(const ray& r, double tmax, const color& background) const {
+	double t0, t1;
+	if (!intersect_box(r, t0, t1))
+		return background;
+	t0 = std::max(t0, 0.0);
+	t1 = std::min(t1, tmax);
+	if (t0 >= t1)
+		return background;
+
+	// The ray in grid coordinates: g(t) = g0 + t * gd, where t is still the distance along the ray in world space
+	vec3 g0 = to_grid(r.origin());
+	vec3 gd(r.direction().x() / m_spacing.x(), r.direction().y() / m_spacing.y(), r.direction().z() / m_spacing.z());
+
+	/*
+	 * 3D-DDA through the macrocell grid: t_next is the distance at which the ray crosses the next cell boundary
+	 * along each axis, and t_delta is the distance between two boundaries along that axis.
+	 */
+	vec3 entry = g0 + t0 * gd;
+	int cell[3], step[3];
+	double t_next[3], t_delta[3];
+	for (int a = 0; a < 3; a++) {
+		cell[a] = std::clamp((int)std::floor(entry[a] / macrocell_size), 0, m_cells[a] - 1);
+		if (gd[a] > 0.0) {
+			step[a] = 1;
+			t_next[a] = ((cell[a] + 1) * macrocell_size - g0[a]) / gd[a];
+			t_delta[a] = macrocell_size / gd[a];
+		}
+		else if (gd[a] < 0.0) {
+			step[a] = -1;
+			t_next[a] = (cell[a] * macrocell_size - g0[a]) / gd[a];
+			t_delta[a] = -macrocell_size / gd[a];
+		}
+		else {
+			step[a] = 0;
+			t_next[a] = t_delta[a] = std::numeric_limits<double>::infinity();
+		}
+	}
+
+	color accumulated(0, 0, 0);
+	double alpha = 0.0;
+	double t_sample = t0;								// samples are evenly spaced from the entry point
+	double t_cell = t0;
+	while (t_cell < t1) {
+		int a = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+		double t_exit = std::min(t_next[a], t1);
+
+		if (!m_cell_empty[cell_index(cell[0], cell[1], cell[2])]) {
+			for (; t_sample < t_exit; t_sample += m_step) {
+				vec3 g = g0 + t_sample * gd;
+				int bin = std::clamp((int)(sample(g.x(), g.y(), g.z()) * (lut_size - 1) + 0.5), 0, lut_size - 1);
+				double a_sample = m_lut_alpha[bin];
+				if (a_sample > 0.0) {
+					// front-to-back compositing, stopping as soon as the ray is (almost) opaque
+					accumulated += (1.0 - alpha) * a_sample * m_lut_color[bin];
+					alpha += (1.0 - alpha) * a_sample;
+					if (alpha > 0.99)
+						return accumulated + (1.0 - alpha) * background;
+				}
+			}
+		}
+		else if (t_sample < t_exit) {
+			// skip the empty cell while keeping the samples on the same evenly spaced positions
+			t_sample += std::ceil((t_exit - t_sample) / m_step) * m_step;
+		}
+
+		t_cell = t_exit;
+		cell[a] += step[a];
+		if (cell[a] < 0 || cell[a] >= m_cells[a])
+			break;
+		t_next[a] += t_delta[a];
+	}
+	return accumulated + (1.0 - alpha) * background;
+}
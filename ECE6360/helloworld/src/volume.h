@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ray.h"
+#include "vec3.h"
+
+class thread_pool;
+
+// A read-only memory mapping of a file (large volumes are paged in as they are rendered instead of read up front)
+class mapped_file {
+public:
+    explicit mapped_file(const std::string& filename);
+    ~mapped_file();
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    const unsigned char* data() const { return static_cast<const unsigned char*>(m_data); }
+    size_t size() const { return m_size; }
+
+private:
+    void* m_data = nullptr;
+    size_t m_size = 0;
+    void* m_file = nullptr;                 // file and mapping handles (only used on Windows)
+    void* m_mapping = nullptr;
+};
+
+enum class voxel_type { uint8, uint16, float32 };
+
+/*
+ * Maps normalized values to a color and an opacity that ramps from zero at low to max_opacity at high. The opacity
+ * is per voxel length (the lookup table corrects it for the step size).
+ */
+struct transfer_function {
+    enum colormap_type { grayscale = 0, fire = 1, cool_warm = 2 };
+    int colormap = cool_warm;
+    float low = 0.3f;
+    float high = 0.8f;
+    float max_opacity = 0.5f;
+
+    color map_color(double v) const {
+        v = std::clamp(v, 0.0, 1.0);
+        switch (colormap) {
+        case fire:
+            return color(std::min(1.0, 3.0 * v), std::clamp(3.0 * v - 1.0, 0.0, 1.0), std::clamp(3.0 * v - 2.0, 0.0, 1.0));
+        case cool_warm:
+            return (1.0 - v) * color(0.23, 0.30, 0.75) + v * color(0.71, 0.02, 0.15) + (1.0 - std::fabs(2.0 * v - 1.0)) * color(0.6, 0.6, 0.6);
+        default:
+            return color(v, v, v);
+        }
+    }
+    double map_opacity(double v) const {
+        if (v <= low) return 0.0;
+        if (v >= high || high <= low) return max_opacity;
+        return max_opacity * (v - low) / (high - low);
+    }
+};
+
+/*
+ * A 3D grid of scalar values between box_min and box_max, rendered by front-to-back ray casting. Rays skip the
+ * macrocells (macrocell_size^3 voxels) that the transfer function makes completely transparent.
+ */
+class volume {
+public:
+    static constexpr int macrocell_size = 8;
+    static constexpr int lut_size = 256;
+
+    point3 box_min;
+    point3 box_max;
+
+    // memory-map a raw file of nx * ny * nz voxels stored with x changing fastest
+    static std::shared_ptr<volume> load_raw(const std::string& filename, int nx, int ny, int nz, voxel_type type, thread_pool& pool);
+
+    // parse dimensions and type from names like "skull_256x256x256_uint8.raw" and load the file
+    static std::shared_ptr<volume> load_raw(const std::string& filename, thread_pool& pool);
+
+    // the Marschner-Lobb test signal sampled on an n^3 grid (a standard volume rendering test case)
+    static std::shared_ptr<volume> procedural(int n, thread_pool& pool);
+
+    // a puff of smoke made from fractal value noise inside a soft sphere (useful as a participating medium)
+    static std::shared_ptr<volume> procedural_smoke(int n, thread_pool& pool);
+
+    int nx() const { return m_n[0]; }
+    int ny() const { return m_n[1]; }
+    int nz() const { return m_n[2]; }
+    const std::string& name() const { return m_name; }
+
+    // build the color/opacity lookup table and mark the macrocells that the transfer function makes empty
+    void set_transfer_function(const transfer_function& tf, double step_factor);
+    const transfer_function& get_transfer_function() const { return m_tf; }
+    double step_factor() const { return m_step_factor; }
+
+    // a copy of the volume with a different transfer function (the voxels are shared, only the tables are copied)
+    std::shared_ptr<volume> with_transfer_function(const transfer_function& tf, double step_factor) const;
+
+    // fraction of the macrocells that are skipped with the current transfer function
+    double empty_fraction() const { return m_empty_fraction; }
+
+    // entry and exit distances of a ray with a unit length direction through the bounding box
+    bool intersect_box(const ray& r, double& t0, double& t1) const;
+
+    // composite the volume between the ray origin and tmax over a background color (the ray direction must be unit length)
+    color integrate(const ray& r, double tmax, const color& background) const;
+
+    // value at grid point (i, j, k) normalized to [0, 1]
+    double voxel(int i, int j, int k) const {
+        size_t idx = ((size_t)k * m_n[1] + j) * m_n[0] + i;
+        double raw;
+        switch (m_type) {
+        case voxel_type::uint8: raw = m_data[idx]; break;
+        case voxel_type::uint16: raw = reinterpret_cast<const uint16_t*>(m_data)[idx]; break;
+        default: raw = reinterpret_cast<const float*>(m_data)[idx]; break;
+        }
+        return (raw - m_raw_min) * m_raw_scale;
+    }
+
+    // trilinearly interpolated value at a point in grid coordinates (grid point i is at coordinate i)
+    double sample(double x, double y, double z) const {
+        int i = std::clamp(static_cast<int>(x), 0, m_n[0] - 2);
+        int j = std::clamp(static_cast<int>(y), 0, m_n[1] - 2);
+        int k = std::clamp(static_cast<int>(z), 0, m_n[2] - 2);
+        double fx = x - i, fy = y - j, fz = z - k;
+        double c00 = voxel(i, j, k) * (1 - fx) + voxel(i + 1, j, k) * fx;
+        double c10 = voxel(i, j + 1, k) * (1 - fx) + voxel(i + 1, j + 1, k) * fx;
+        double c01 = voxel(i, j, k + 1) * (1 - fx) + voxel(i + 1, j, k + 1) * fx;
+        double c11 = voxel(i, j + 1, k + 1) * (1 - fx) + voxel(i + 1, j + 1, k + 1) * fx;
+        double c0 = c00 * (1 - fy) + c10 * fy;
+        double c1 = c01 * (1 - fy) + c11 * fy;
+        return c0 * (1 - fz) + c1 * fz;
+    }
+
+    // convert between world space and grid coordinates
+    vec3 spacing() const { return m_spacing; }
+    vec3 to_grid(const point3& p) const {
+        vec3 d = p - box_min;
+        return vec3(d.x() / m_spacing.x(), d.y() / m_spacing.y(), d.z() / m_spacing.z());
+    }
+    point3 to_world(const vec3& g) const {
+        return box_min + vec3(g.x() * m_spacing.x(), g.y() * m_spacing.y(), g.z() * m_spacing.z());
+    }
+
+    // minimum and maximum normalized values of grid points [x0, x1] x [y0, y1] x [z0, z1] (bounds are inclusive)
+    void range(int x0, int y0, int z0, int x1, int y1, int z1, float& lo, float& hi) const;
+
+    // macrocell grid (each cell covers macrocell_size voxels plus the shared grid points on its upper faces)
+    int cells(int axis) const { return m_cells[axis]; }
+    float cell_min(int cx, int cy, int cz) const { return m_cell_min[cell_index(cx, cy, cz)]; }
+    float cell_max(int cx, int cy, int cz) const { return m_cell_max[cell_index(cx, cy, cz)]; }
+
+private:
+    std::string m_name;
+    std::shared_ptr<mapped_file> m_file;    // memory-mapped voxels (or nullptr if the voxels are stored in m_owned)
+    std::shared_ptr<std::vector<unsigned char>> m_owned;    // shared, so that copies of the volume share the voxels
+    const unsigned char* m_data = nullptr;
+    voxel_type m_type = voxel_type::uint8;
+    int m_n[3] = { 0, 0, 0 };
+    vec3 m_spacing;
+    double m_raw_min = 0.0;                 // raw values are normalized as (raw - m_raw_min) * m_raw_scale
+    double m_raw_scale = 1.0;
+
+    int m_cells[3] = { 0, 0, 0 };
+    std::vector<float> m_cell_min;
+    std::vector<float> m_cell_max;
+    std::vector<unsigned char> m_cell_empty;
+
+    transfer_function m_tf;
+    double m_step_factor = 0.5;             // step size as a fraction of the smallest voxel spacing
+    double m_step = 0.0;                    // step size in world units
+    std::array<color, lut_size> m_lut_color;
+    std::array<double, lut_size> m_lut_alpha;   // opacity per step (already corrected for the step size)
+    double m_empty_fraction = 0.0;
+
+    size_t cell_index(int cx, int cy, int cz) const { return ((size_t)cz * m_cells[1] + cy) * m_cells[0] + cx; }
+
+    // set up the grid geometry and compute the macrocell ranges after the voxels are available
+    void initialize(thread_pool& pool);
+};